@@ -25,6 +25,37 @@
 #define	LKBCALL_RSTSELCS	21
 #define	LKBCALL_GETUSERS	22
 #define	LKBCALL_CREATESELFD	23
+#define	LKBCALL_LOCKRANGE	36
+#define	LKBCALL_UNLOCKRANGE	37
+#define	LKBCALL_SETSPIN		38
+#define	LKBCALL_SETPI		39
+#define	LKBCALL_FASTMAP		40
+#define	LKBCALL_LOCKMULTI	41
+#define	LKBCALL_WRITEMULTI	42
+#define	LKBCALL_STATEOP		45
+#define	LKBCALL_DATAOP		46
+#define	LKBCALL_GETVERSION	47
+#define	LKBCALL_GETDATAIF	48
+#define	LKBCALL_GETDELTA	50
+#define	LKBCALL_APPEND		52
+#define	LKBCALL_CREATETYPED	54
+#define	LKBCALL_PUSH		55
+#define	LKBCALL_POP		56
+#define	LKBCALL_READLOG		60
+#define	LKBCALL_MAPOP		62
+#define	LKBCALL_COUNTERADD	64
+#define	LKBCALL_COUNTERREAD	65
+#define	LKBCALL_SEMWAIT		67
+#define	LKBCALL_SEMPOST		68
+#define	LKBCALL_WAITSTATE	69
+#define	LKBCALL_SETSELDATA	70
+#define	LKBCALL_WATCHSHELF	71
+#define	LKBCALL_WATCHBOX	72
+#define	LKBCALL_BINDEVENTFD	73
+#define	LKBCALL_SETCOALESCE	74
+#define	LKBCALL_GETSTATECOUNTS	75
+#define	LKBCALL_SHELFSTATEOP	76
+#define	LKBCALL_CLOSESHELF	77
 
 #else
 
@@ -63,6 +94,49 @@
 #define	LKBCALL_GETACL		33
 #define	LKBCALL_GETSELBOXES	34
 #define	LKBCALL_CREATESELFD	35
+#define	LKBCALL_LOCKRANGE	36
+#define	LKBCALL_UNLOCKRANGE	37
+#define	LKBCALL_SETSPIN		38
+#define	LKBCALL_SETPI		39
+#define	LKBCALL_FASTMAP		40
+#define	LKBCALL32_LOCKMULTI	41
+#define	LKBCALL32_WRITEMULTI	42
+#define	LKBCALL_LOCKMULTI	43
+#define	LKBCALL_WRITEMULTI	44
+#define	LKBCALL_STATEOP		45
+#define	LKBCALL_DATAOP		46
+#define	LKBCALL_GETVERSION	47
+#define	LKBCALL32_GETDATAIF	48
+#define	LKBCALL_GETDATAIF	49
+#define	LKBCALL32_GETDELTA	50
+#define	LKBCALL_GETDELTA	51
+#define	LKBCALL32_APPEND	52
+#define	LKBCALL_APPEND		53
+#define	LKBCALL32_CREATETYPED	54
+#define	LKBCALL32_PUSH		55
+#define	LKBCALL32_POP		56
+#define	LKBCALL_CREATETYPED	57
+#define	LKBCALL_PUSH		58
+#define	LKBCALL_POP		59
+#define	LKBCALL32_READLOG	60
+#define	LKBCALL_READLOG		61
+#define	LKBCALL32_MAPOP		62
+#define	LKBCALL_MAPOP		63
+#define	LKBCALL_COUNTERADD	64
+#define	LKBCALL32_COUNTERREAD	65
+#define	LKBCALL_COUNTERREAD	66
+#define	LKBCALL_SEMWAIT		67
+#define	LKBCALL_SEMPOST		68
+#define	LKBCALL_WAITSTATE	69
+#define	LKBCALL_SETSELDATA	70
+#define	LKBCALL_WATCHSHELF	71
+#define	LKBCALL_WATCHBOX	72
+#define	LKBCALL_BINDEVENTFD	73
+#define	LKBCALL_SETCOALESCE	74
+#define	LKBCALL_GETSTATECOUNTS	75
+#define	LKBCALL_SHELFSTATEOP	76
+#define	LKBCALL32_CLOSESHELF	77
+#define	LKBCALL_CLOSESHELF	78
 
 #endif
 
@@ -108,6 +182,121 @@ typedef struct
 	char const	*name;
 } lockbox_open_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	int32_t		shelfid;
+	char const	*name;
+	lockbox_acl const *acl;
+	uint32_t	type;
+	uint32_t	capacity;
+} lockbox_createtyped_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		const *buffer;
+	size_t		size;
+	uint32_t	flags;
+} lockbox_push_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		*buffer;
+	size_t		bufsize;
+	uint32_t	flags;
+	size_t		sizeneeded;
+} lockbox_pop_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		*buffer;
+	size_t		bufsize;
+	uint32_t	flags;
+	size_t		sizeneeded;
+	uint32_t	lost;		/* Records overwritten unread	*/
+} lockbox_readlog_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	op;		/* LKB_MAPOP_*			*/
+	void		const *key;
+	size_t		keysize;
+	void		*buffer;	/* Value, or keys for KEYS	*/
+	size_t		bufsize;
+	size_t		sizeneeded;
+	uint32_t	cookie;		/* Next bucket for KEYS		*/
+	uint32_t	version_lo;	/* Version of the entry		*/
+	uint32_t	version_hi;
+} lockbox_mapop_struct;
+
+#define	LKB_MAPOP_GET		1
+#define	LKB_MAPOP_PUT		2
+#define	LKB_MAPOP_DELETE	3
+#define	LKB_MAPOP_KEYS		4
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	index;
+	uint32_t	delta_lo;
+	uint32_t	delta_hi;
+} lockbox_counteradd_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	index;
+	uint32_t	count;
+	int64_t		*values;
+} lockbox_counterread_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	timeout;	/* Milliseconds			*/
+} lockbox_semwait_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	units;
+} lockbox_sempost_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	mask;
+	uint32_t	value;		/* Wanted state bits in mask	*/
+	uint32_t	users_lt;
+	uint32_t	users_gt;
+	uint32_t	timeout;	/* Milliseconds			*/
+	uint32_t	state;		/* State that ended the wait	*/
+	uint32_t	users;		/* User count that ended it	*/
+} lockbox_waitstate_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	state;
+	uint32_t	sequence_lo;
+	uint32_t	sequence_hi;
+	uint32_t	setcounts[LKB_STATE_BITS];
+} lockbox_getstatecounts_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -127,6 +316,165 @@ typedef struct
 	lockbox_t	lockboxid;
 } lockbox_unlock_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	offset;
+	uint32_t	size;
+	uint32_t	flags;
+} lockbox_lockrange_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	usecs;
+} lockbox_setspin_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	msecs;
+} lockbox_setcoalesce_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	enable;
+} lockbox_setpi_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+} lockbox_fastmap_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_multilock_entry const *entries;
+	size_t		count;
+	uint32_t	flags;
+} lockbox_lockmulti_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_multiwrite_entry const *entries;
+	size_t		count;
+} lockbox_writemulti_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	op;		/* LKB_STATEOP_*		*/
+	uint32_t	operand;
+	uint32_t	compare;	/* Expected value for CAS	*/
+	uint32_t	old;		/* Returned previous state	*/
+} lockbox_stateop_struct;
+
+#define	LKB_STATEOP_OR		1
+#define	LKB_STATEOP_ANDNOT	2
+#define	LKB_STATEOP_XOR		3
+#define	LKB_STATEOP_CAS		4
+
+/* Only LKB_STATEOP_OR and LKB_STATEOP_ANDNOT apply to a whole shelf */
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	shelfid;
+	uint32_t	op;		/* LKB_STATEOP_*		*/
+	uint32_t	operand;
+	lockbox_shelf_result result;
+} lockbox_shelfstateop_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	shelfid;
+	uint32_t	nbits;		/* Handle ids covered by closed	*/
+	uint32_t	*closed;	/* Bitmap of the handles closed	*/
+} lockbox_closeshelf_struct;
+
+/* 64 bit values are passed in two halves, since uint64_t is aligned
+ * differently by 32 and 64 bit compilers.
+ */
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	op;		/* LKB_DATAOP_*			*/
+	uint32_t	width;		/* 4 or 8 bytes			*/
+	uint32_t	offset;
+	uint32_t	operand_lo;
+	uint32_t	operand_hi;
+	uint32_t	compare_lo;	/* Expected value for CAS	*/
+	uint32_t	compare_hi;
+	uint32_t	old_lo;		/* Returned previous value	*/
+	uint32_t	old_hi;
+} lockbox_dataop_struct;
+
+#define	LKB_DATAOP_ADD		1
+#define	LKB_DATAOP_XCHG		2
+#define	LKB_DATAOP_CAS		3
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	version_lo;
+	uint32_t	version_hi;
+} lockbox_getversion_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		*buffer;
+	size_t		size;
+	off_t		offset;
+	uint32_t	version_lo;	/* Version the caller has, and	*/
+	uint32_t	version_hi;	/* the version returned		*/
+} lockbox_getdataif_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		*buffer;
+	size_t		bufsize;
+	size_t		sizeneeded;
+	uint32_t	version_lo;	/* Version the caller has, and	*/
+	uint32_t	version_hi;	/* the version returned		*/
+} lockbox_getdelta_struct;
+
+/* The lock words shared between the kernel and liblockbox for the user
+ * space fast path, mapped from the vault file at an offset of the
+ * handle's id in pages. Each word is zero when its lock type is free,
+ * otherwise the token of the handle holding it. LKB_FAST_WAITERS is
+ * set when somebody is sleeping in the kernel for the lock, in which
+ * case it must be released with LKBCALL_UNLOCK. LKB_FAST_RANGES in
+ * the data word means range locks are held on the box, and
+ * LKB_FAST_KERNEL means the lock was taken before the page existed.
+ */
+typedef struct
+{
+	uint32_t	lkf_words[4];	/* One per lock type, by bit number	*/
+	uint32_t	lkf_flags;
+} lockbox_fastlock;
+
+#define	LKB_FAST_WAITERS	0x80000000
+#define	LKB_FAST_RANGES		0x7fffffff
+#define	LKB_FAST_KERNEL		0x7ffffffe
+#define	LKB_FAST_TOKEN_MASK	0x3fffffff
+
+/* lkf_flags: lock through the kernel, not the fast path */
+#define	LKB_FAST_SLOW		0x00000001
+
 typedef struct
 {
 	uint32_t	callid;
@@ -160,6 +508,15 @@ typedef struct
 	off_t		offset;
 } lockbox_setdata_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	void		const *buffer;
+	size_t		size;
+	uint32_t	offset;		/* Where the data was written	*/
+} lockbox_append_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -210,6 +567,38 @@ typedef struct
 	uint32_t	value;
 } lockbox_setselectcriterion_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	offset;
+	uint32_t	width;
+	uint32_t	op;		/* LKB_CMP_*			*/
+	uint32_t	value_lo;
+	uint32_t	value_hi;
+} lockbox_setselectdata_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	shelfid;
+	uint32_t	events;		/* LKB_EVENT_*			*/
+} lockbox_watchshelf_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	events;		/* LKB_EVENT_*			*/
+} lockbox_watchbox_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	int		fd;		/* -1 to unbind			*/
+} lockbox_bindeventfd_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -272,6 +661,78 @@ typedef struct
 	uint32_t	name;
 } lockbox32_open_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	int32_t		shelfid;
+	uint32_t	name;
+	uint32_t	acl;
+	uint32_t	type;
+	uint32_t	capacity;
+} lockbox32_createtyped_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	size;
+	uint32_t	flags;
+} lockbox32_push_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	bufsize;
+	uint32_t	flags;
+	uint32_t	sizeneeded;
+} lockbox32_pop_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	bufsize;
+	uint32_t	flags;
+	uint32_t	sizeneeded;
+	uint32_t	lost;
+} lockbox32_readlog_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	op;
+	uint32_t	key;
+	uint32_t	keysize;
+	uint32_t	buffer;
+	uint32_t	bufsize;
+	uint32_t	sizeneeded;
+	uint32_t	cookie;
+	uint32_t	version_lo;
+	uint32_t	version_hi;
+} lockbox32_mapop_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	index;
+	uint32_t	count;
+	uint32_t	values;
+} lockbox32_counterread_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	shelfid;
+	uint32_t	nbits;
+	uint32_t	closed;
+} lockbox32_closeshelf_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -290,6 +751,28 @@ typedef struct
 	uint32_t	offset;
 } lockbox32_getdata_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	size;
+	uint32_t	offset;
+	uint32_t	version_lo;
+	uint32_t	version_hi;
+} lockbox32_getdataif_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	bufsize;
+	uint32_t	sizeneeded;
+	uint32_t	version_lo;
+	uint32_t	version_hi;
+} lockbox32_getdelta_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -299,6 +782,15 @@ typedef struct
 	uint32_t	offset;
 } lockbox32_setdata_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	lockbox_t	lockboxid;
+	uint32_t	buffer;
+	uint32_t	size;
+	uint32_t	offset;
+} lockbox32_append_struct;
+
 typedef struct
 {
 	uint32_t	callid;
@@ -330,4 +822,19 @@ typedef struct
 	int		targetfd;
 } lockbox32_createselectfd_struct;
 
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	entries;
+	uint32_t	count;
+	uint32_t	flags;
+} lockbox32_lockmulti_struct;
+
+typedef struct
+{
+	uint32_t	callid;
+	uint32_t	entries;
+	uint32_t	count;
+} lockbox32_writemulti_struct;
+
 #endif
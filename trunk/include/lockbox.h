@@ -68,6 +68,128 @@ typedef struct
 } lockbox32_select_fd_entry;
 #endif
 
+typedef struct
+{
+	lockbox_t	lml_id;
+	uint32_t	lml_flags;	/* LKB_LOCK_* types to lock	*/
+} lockbox_multilock_entry;
+
+typedef struct
+{
+	lockbox_t	lmw_id;
+	uint32_t	lmw_op;		/* LKB_MULTI_SETDATA/SETSTATE	*/
+	void const	*lmw_data;
+	size_t		lmw_size;
+	off_t		lmw_offset;
+	uint32_t	lmw_state;
+} lockbox_multiwrite_entry;
+
+#if __x86_64__
+typedef struct
+{
+	lockbox_t	lmw_id;
+	uint32_t	lmw_op;
+	uint32_t	lmw_data;
+	uint32_t	lmw_size;
+	uint32_t	lmw_offset;
+	uint32_t	lmw_state;
+} lockbox32_multiwrite_entry;
+#endif
+
+/* An extent of changed data returned by lkb_getdelta. The changed
+ * bytes follow the header, and the next header follows them at
+ * LKB_DELTA_SIZE(lde_size) bytes from the start of this one.
+ */
+typedef struct
+{
+	uint32_t	lde_offset;
+	uint32_t	lde_size;
+} lockbox_delta_extent;
+
+#define	LKB_DELTA_SIZE(s)	(sizeof(lockbox_delta_extent) + \
+				 (((s) + 3) & ~(size_t) 3))
+
+/* A record returned by lkb_readlog. The record's bytes follow the
+ * header, and the next header follows them at
+ * LKB_LOG_RECORD_SIZE(llr_size) bytes from the start of this one.
+ */
+typedef struct
+{
+	uint32_t	llr_size;
+} lockbox_log_record;
+
+#define	LKB_LOG_RECORD_SIZE(s)	(sizeof(lockbox_log_record) + \
+				 (((s) + 3) & ~(size_t) 3))
+
+/* A key returned by lkb_mapkeys, with the size of its value and the
+ * version of the entry. The key follows the header, and the next
+ * header follows it at LKB_MAP_KEY_SIZE(lmk_keysize) bytes from the
+ * start of this one.
+ */
+typedef struct
+{
+	uint32_t	lmk_keysize;
+	uint32_t	lmk_valsize;
+	uint32_t	lmk_version_lo;
+	uint32_t	lmk_version_hi;
+} lockbox_map_key;
+
+#define	LKB_MAP_KEY_SIZE(s)	(sizeof(lockbox_map_key) + \
+				 (((s) + 3) & ~(size_t) 3))
+
+/* An event read from the vault file descriptor with read(). A shelf
+ * event is followed by le_namesize bytes holding the name of the
+ * lockbox, with its terminating null, and the next event follows at
+ * LKB_EVENT_SIZE(le_namesize) bytes from the start of this one.
+ * Lockbox events have no name, and le_id is the handle that asked
+ * for them with lkb_watchbox.
+ */
+typedef struct
+{
+	uint32_t	le_type;	/* LKB_EVENT_*			*/
+	uint32_t	le_shelf;
+	lockbox_t	le_id;		/* LOCKBOX_ERROR for shelf events */
+	uint32_t	le_namesize;
+	uint64_t	le_value;	/* See the LKB_EVENT_* values	*/
+	uint64_t	le_time;	/* CLOCK_MONOTONIC nanoseconds	*/
+} lockbox_event;
+
+#define	LKB_EVENT_SIZE(s)	(sizeof(lockbox_event) + \
+				 (((s) + 7) & ~(size_t) 7))
+
+/* The result of a command written to the vault file descriptor, from
+ * an LKB_EVENT_COMPLETED event.
+ */
+#define	LKB_COMPLETION_TAG(e)		((uint32_t) ((e)->le_value >> 32))
+#define	LKB_COMPLETION_STATUS(e)	((int32_t) (e)->le_value)
+
+/* A command written to the vault file descriptor with write(). The
+ * command is followed by lc_size bytes of data, and the next command
+ * follows at LKB_COMMAND_SIZE(lc_size) bytes from the start of this
+ * one.
+ */
+typedef struct
+{
+	uint32_t	lc_op;		/* LKB_CMD_*			*/
+	lockbox_t	lc_id;
+	uint32_t	lc_flags;	/* LKB_CMD_REPORT		*/
+	uint32_t	lc_tag;		/* Returned in the completion	*/
+	uint32_t	lc_value;	/* State, or offset for SETDATA	*/
+	uint32_t	lc_size;	/* Bytes of data		*/
+} lockbox_command;
+
+#define	LKB_COMMAND_SIZE(s)	(sizeof(lockbox_command) + \
+				 (((s) + 7) & ~(size_t) 7))
+
+/* The outcome of a state change applied to a whole shelf */
+typedef struct
+{
+	uint32_t	lsr_boxes;	/* Lockboxes changed		*/
+	uint32_t	lsr_denied;	/* No LKB_ACCESS_SETSTATE	*/
+	uint32_t	lsr_busy;	/* State locked by a handle	*/
+	uint32_t	lsr_oldbits;	/* OR of their previous states	*/
+} lockbox_shelf_result;
+
 #define	LKB_ACL_SIZE(e)	(sizeof(lockbox_acl_header) + \
 			 (e) * sizeof(lockbox_acl_entry))
 
@@ -97,9 +219,91 @@ typedef struct
 #define	LKB_LOCK_ACL		0x00000008
 
 #define LKB_LOCK_NOBLOCK	0x40000000
+#define	LKB_LOCK_SPIN		0x20000000
+#define	LKB_LOCK_NOSPIN		0x10000000
 
 #define LKB_LOCK_ALL		0x0000000f
 
+#define	LKB_RANGE_SHARED	0x00000001
+#define	LKB_RANGE_EXCLUSIVE	0x00000002
+
+#define	LKB_MULTI_SETDATA	1
+#define	LKB_MULTI_SETSTATE	2
+
+/* Most lockboxes that can be named in one multi-box call */
+#define	LKB_MULTI_MAX		64
+
+/* Lockbox types for lkb_createtyped */
+#define	LKB_TYPE_DATA		0
+#define	LKB_TYPE_QUEUE		1
+#define	LKB_TYPE_LOG		2
+#define	LKB_TYPE_MAP		3
+#define	LKB_TYPE_COUNTER	4
+#define	LKB_TYPE_SEMAPHORE	5
+
+/* Largest message in an LKB_TYPE_QUEUE or LKB_TYPE_LOG lockbox */
+#define	LKB_QUEUE_MSG_MAX	65536
+
+/* Most records an LKB_TYPE_LOG lockbox can hold */
+#define	LKB_LOG_MAX		65536
+
+/* Limits on an LKB_TYPE_MAP lockbox: entries, and the size of each
+ * key and value.
+ */
+#define	LKB_MAP_MAX		65536
+#define	LKB_MAP_KEY_MAX		256
+#define	LKB_MAP_VALUE_MAX	65536
+
+/* Most counters an LKB_TYPE_COUNTER lockbox can hold */
+#define	LKB_COUNTER_MAX		4096
+
+/* Most units an LKB_TYPE_SEMAPHORE lockbox can have available */
+#define	LKB_SEMAPHORE_MAX	0x7fffffff
+
+/* A timeout, in milliseconds, that never expires */
+#define	LKB_WAIT_FOREVER	0xffffffff
+
+/* Events read from the vault file descriptor. lkb_watchshelf asks for
+ * the shelf events, and lkb_watchbox for the lockbox events.
+ */
+#define	LKB_EVENT_CREATED	0x00000001
+#define	LKB_EVENT_DESTROYED	0x00000002
+#define	LKB_EVENT_SHELF		0x00000003
+
+#define	LKB_EVENT_STATE_SET	0x00000004	/* le_value new state	*/
+#define	LKB_EVENT_STATE_CLEARED	0x00000008	/* le_value new state	*/
+#define	LKB_EVENT_USERS		0x00000010	/* le_value new users	*/
+#define	LKB_EVENT_UNLOCKED	0x00000020	/* le_value locks freed	*/
+#define	LKB_EVENT_DATA		0x00000040	/* le_value new version	*/
+
+/* State changes, coalesced over the window set with lkb_setcoalesce.
+ * le_value holds the bits changed since the last such event in its
+ * high 32 bits and the new state in its low 32 bits.
+ */
+#define	LKB_EVENT_STATE_CHANGES	0x00000100
+#define	LKB_EVENT_BOX		0x0000017c
+
+/* The completion of a command written to the vault file descriptor.
+ * le_id is the lockbox, and le_value holds the command's tag and
+ * status (see LKB_COMPLETION_TAG and LKB_COMPLETION_STATUS).
+ */
+#define	LKB_EVENT_COMPLETED	0x00000080
+
+/* Commands written to the vault file descriptor */
+#define	LKB_CMD_SETSTATE	1	/* Set the state to lc_value	*/
+#define	LKB_CMD_SETDATA		2	/* Write the data at lc_value	*/
+#define	LKB_CMD_APPEND		3	/* Append the data		*/
+
+/* Queue a completion even if the command succeeds; failures always
+ * queue one.
+ */
+#define	LKB_CMD_REPORT		0x00000001
+
+#define	LKB_EVENT_OVERFLOW	0x80000000	/* le_value events lost	*/
+
+/* Most events queued for reading on one vault file descriptor */
+#define	LKB_EVENT_QUEUE_MAX	1024
+
 /* From the API definition, a process can only access one
  * vault at a time. The file descriptor returned by openvault
  * is primarily for use in a call to select(), where it can
@@ -130,6 +334,24 @@ int		lkb_listboxes(	int		shelf,
 				size_t		bufsize,
 				size_t		*sizeneeded);
 
+/* Report the creation and destruction of lockboxes on a shelf, as
+ * LKB_EVENT_CREATED and LKB_EVENT_DESTROYED events read from the
+ * vault file descriptor. events is the events wanted; 0 stops
+ * watching the shelf.
+ */
+
+int		lkb_watchshelf(	int		shelf,
+				uint32_t	events);
+
+/* Report changes to a lockbox as events read from the vault file
+ * descriptor, each carrying id and the time of the change. events is
+ * a combination of the LKB_EVENT_BOX values; 0 stops the reports.
+ * The reports stop when id is closed.
+ */
+
+int		lkb_watchbox(	lockbox_t	id,
+				uint32_t	events);
+
 /* Create, open, close.
  * If "name" NULL, the kernel will allocate
  * a lockbox name of the form "#nnnnnnnn", where 'n' is
@@ -149,14 +371,97 @@ lockbox_t	lkb_create(	int		shelf,
 				lockbox_acl const *acl);
 lockbox_t	lkb_open(	int		shelf,
 				char const *	name);
+
+/* Create a lockbox of one of the LKB_TYPE_* types, which holds its
+ * contents in a particular way instead of as plain data. capacity
+ * limits how much it can hold; what that means depends on the type.
+ */
+
+lockbox_t	lkb_createtyped(int		shelf,
+				char const *	name,
+				uint32_t	type,
+				uint32_t	capacity,
+				lockbox_acl const *acl);
 int		lkb_close(	lockbox_t	id);
 
+/* Close all of the caller's handles to lockboxes on a shelf,
+ * returning the number closed.
+ */
+int		lkb_closeshelf(	int		shelf);
+
 /* Lock and unlock a lockbox */
 
 int		lkb_lock(	lockbox_t	id,
 				uint32_t	flags);
 int		lkb_unlock(	lockbox_t	id);
 
+/* Set how long lkb_lock will spin waiting for a busy lock whose holder
+ * is running before going to sleep. LKB_LOCK_SPIN and LKB_LOCK_NOSPIN
+ * override this for a single call.
+ */
+
+int		lkb_setspin(	lockbox_t	id,
+				uint32_t	usecs);
+
+/* Hold back the wakeups that state and data changes to a lockbox
+ * cause for up to msecs milliseconds, so that a burst of changes wakes
+ * each sleeper and selector once. 0 wakes them at once. Windows longer
+ * than the module's coalesce_max_msecs fail with EINVAL.
+ */
+
+int		lkb_setcoalesce(	lockbox_t	id,
+					uint32_t	msecs);
+
+/* Put a lockbox into (or take it out of) priority inheritance mode.
+ * In this mode a process waiting in lkb_lock boosts the priority of
+ * the threads holding the locks it wants, and locks must be released
+ * by the thread that acquired them.
+ */
+
+int		lkb_setpi(	lockbox_t	id,
+				int		enable);
+
+/* Let lkb_lock and lkb_unlock on a handle take and release free locks
+ * with an atomic operation on a word shared with the kernel, only
+ * making a system call when the lock is busy or has waiters.
+ */
+
+int		lkb_setfast(	lockbox_t	id,
+				int		enable);
+
+/* Lock several lockboxes at once. The lockboxes are locked in an order
+ * fixed by the kernel, so two processes locking overlapping sets cannot
+ * deadlock, and either every lock is obtained or none is.
+ */
+
+int		lkb_lockmulti(	lockbox_multilock_entry const *entries,
+				size_t		count,
+				uint32_t	flags);
+
+/* Apply a list of lkb_setdata and lkb_setstate operations to several
+ * lockboxes so that no other process sees some of them without the
+ * rest. Either every operation is applied or none is.
+ */
+
+int		lkb_writemulti(	lockbox_multiwrite_entry const *entries,
+				size_t		count);
+
+/* Lock and unlock a byte range of the data in a lockbox. A shared
+ * range lock prevents other users from writing to the range or
+ * locking it exclusively. An exclusive range lock prevents other
+ * users from writing to the range or locking any part of it. Range
+ * locks also conflict with LKB_LOCK_DATA held by another user.
+ * LKB_LOCK_NOBLOCK may be combined with the range lock type.
+ */
+
+int		lkb_lockrange(	lockbox_t	id,
+				off_t		offset,
+				size_t		size,
+				uint32_t	flags);
+int		lkb_unlockrange(lockbox_t	id,
+				off_t		offset,
+				size_t		size);
+
 /* Get and set various things about a lockbox */
 
 	/* The name of the lockbox. Primarily useful
@@ -185,6 +490,160 @@ int		lkb_setdata(	lockbox_t	id,
 				size_t		bufsize,
 				off_t		offset);
 
+	/* Write to the end of the data in the lockbox,
+	 * storing the offset written at in *offset. This
+	 * is atomic with respect to other writers, so
+	 * several processes can append without locking.
+	 */
+
+int		lkb_append(	lockbox_t	id,
+				void const *	buffer,
+				size_t		bufsize,
+				off_t		*offset);
+
+	/* Add a message to the end of an LKB_TYPE_QUEUE
+	 * lockbox, and take the one at the head. lkb_push
+	 * waits while the queue holds capacity messages and
+	 * lkb_pop waits while it is empty, unless flags has
+	 * LKB_LOCK_NOBLOCK. Each message is taken by exactly
+	 * one lkb_pop.
+	 */
+
+int		lkb_push(	lockbox_t	id,
+				void const *	buffer,
+				size_t		size,
+				uint32_t	flags);
+int		lkb_pop(	lockbox_t	id,
+				void *		buffer,
+				size_t		bufsize,
+				uint32_t	flags,
+				size_t		*sizeneeded);
+
+	/* lkb_push on an LKB_TYPE_LOG lockbox adds a record,
+	 * overwriting the oldest once there are capacity of
+	 * them. Each handle on the log reads the records in
+	 * order with lkb_readlog, which returns as many as fit
+	 * in the buffer as lockbox_log_record entries, waiting
+	 * for one unless flags has LKB_LOCK_NOBLOCK. *lost is
+	 * set to the number of records the handle missed
+	 * because they were overwritten before it read them.
+	 */
+
+int		lkb_readlog(	lockbox_t	id,
+				void *		buffer,
+				size_t		bufsize,
+				uint32_t	flags,
+				size_t		*sizeneeded,
+				uint32_t	*lost);
+
+	/* Entries in an LKB_TYPE_MAP lockbox. Each entry has a
+	 * version that changes whenever lkb_mapput replaces it.
+	 * lkb_mapget copies the value of a key, unless *version
+	 * is not 0 and is still the version of the entry, in
+	 * which case it fails with EALREADY; it sets *version
+	 * to the version copied. lkb_mapput sets *version to
+	 * the new version of the entry. lkb_mapkeys lists the
+	 * keys as lockbox_map_key entries, a few at a time:
+	 * start with *cookie 0 and call it until it returns 0.
+	 * A missing key is reported with ENOKEY.
+	 */
+
+int		lkb_mapget(	lockbox_t	id,
+				void const *	key,
+				size_t		keysize,
+				void *		buffer,
+				size_t		bufsize,
+				uint64_t	*version,
+				size_t		*sizeneeded);
+int		lkb_mapput(	lockbox_t	id,
+				void const *	key,
+				size_t		keysize,
+				void const *	value,
+				size_t		valsize,
+				uint64_t	*version);
+int		lkb_mapdelete(	lockbox_t	id,
+				void const *	key,
+				size_t		keysize);
+int		lkb_mapkeys(	lockbox_t	id,
+				void *		buffer,
+				size_t		bufsize,
+				uint32_t	*cookie,
+				size_t		*sizeneeded);
+
+	/* Counters in an LKB_TYPE_COUNTER lockbox. Each CPU keeps
+	 * its own share of every counter, so lkb_counteradd does
+	 * not contend with other CPUs; lkb_counterread adds the
+	 * shares up.
+	 */
+
+int		lkb_counteradd(	lockbox_t	id,
+				uint32_t	index,
+				int64_t		delta);
+int		lkb_counterread(lockbox_t	id,
+				uint32_t	index,
+				uint32_t	count,
+				int64_t		*values);
+
+	/* The semaphore of an LKB_TYPE_SEMAPHORE lockbox, which
+	 * starts with the number of units given as its capacity.
+	 * lkb_semwait takes a unit, waiting up to timeout
+	 * milliseconds for one; waiters get units in the order
+	 * they asked. lkb_sempost gives back units taken through
+	 * the same handle, and fails with EINVAL for more than
+	 * that. Units taken through a handle are given back when
+	 * the handle is closed.
+	 */
+
+int		lkb_semwait(	lockbox_t	id,
+				uint32_t	timeout);
+int		lkb_sempost(	lockbox_t	id,
+				uint32_t	units);
+
+	/* Wait until the state of a lockbox, masked with mask, is
+	 * value, or its user count is below users_lt or above
+	 * users_gt (LKB_SELECT_DISABLE_USERS_LT and _GT turn those
+	 * off), for up to timeout milliseconds. The state and user
+	 * count that ended the wait are stored in *state and *users.
+	 */
+
+int		lkb_waitstate(	lockbox_t	id,
+				uint32_t	mask,
+				uint32_t	value,
+				uint32_t	users_lt,
+				uint32_t	users_gt,
+				uint32_t	timeout,
+				uint32_t	*state,
+				uint32_t	*users);
+
+	/* Every change to the data of a lockbox increases its
+	 * version. lkb_getdataif only copies the data if the
+	 * version has changed from *version, failing with
+	 * EALREADY otherwise, and updates *version to the
+	 * version of the data copied.
+	 */
+
+int		lkb_getversion(	lockbox_t	id,
+				uint64_t	*version);
+int		lkb_getdataif(	lockbox_t	id,
+				void *		buffer,
+				size_t		bufsize,
+				off_t		offset,
+				uint64_t	*version);
+
+	/* Get the changes to the data of a lockbox since *version
+	 * as a list of lockbox_delta_extent entries, and update
+	 * *version to the version they bring the caller up to. A
+	 * lockbox only remembers its most recent changes; if some
+	 * of those since *version have been forgotten this fails
+	 * with ESTALE and the caller should read the whole lockbox.
+	 */
+
+int		lkb_getdelta(	lockbox_t	id,
+				void *		buffer,
+				size_t		bufsize,
+				uint64_t	*version,
+				size_t		*sizeneeded);
+
 	/* Set the state of a lockbox. This is a single
 	 * number that can be used for signalling. Select
 	 * will return when any bit in the state transitions
@@ -196,6 +655,89 @@ int		lkb_setstate(	lockbox_t	id,
 int		lkb_getstate(	lockbox_t	id,
 				uint32_t	*state);
 
+	/* Get the state of a lockbox together with a count of the
+	 * times each bit has gone from 0 to 1 (setcounts[n] for bit
+	 * n, which wraps) and the number of changes made to the
+	 * state (*sequence). A watcher that saw the state with
+	 * earlier counts can tell how many transitions it missed.
+	 * setcounts and sequence may be null.
+	 */
+
+#define	LKB_STATE_BITS	32
+
+int		lkb_getstatecounts(	lockbox_t	id,
+					uint32_t	*state,
+					uint32_t	*setcounts,
+					uint64_t	*sequence);
+
+	/* Atomically change some bits of the state of a lockbox,
+	 * returning the previous state in *old (if old is not
+	 * null). lkb_casstate only sets the state to newstate if
+	 * it was expected; compare *old to find out whether it
+	 * did.
+	 */
+
+int		lkb_orstate(	lockbox_t	id,
+				uint32_t	bits,
+				uint32_t	*old);
+int		lkb_andnotstate(lockbox_t	id,
+				uint32_t	bits,
+				uint32_t	*old);
+int		lkb_xorstate(	lockbox_t	id,
+				uint32_t	bits,
+				uint32_t	*old);
+int		lkb_casstate(	lockbox_t	id,
+				uint32_t	expected,
+				uint32_t	newstate,
+				uint32_t	*old);
+
+	/* Change the state of every lockbox on a shelf, whether or
+	 * not the caller has it open. Lockboxes that the caller may
+	 * not set the state of, or whose state is locked, are skipped
+	 * and counted in *result (which may be null), along with the
+	 * number changed and the OR of their previous states.
+	 */
+
+int		lkb_shelforstate(	int		shelf,
+					uint32_t	bits,
+					lockbox_shelf_result *result);
+int		lkb_shelfandnotstate(	int		shelf,
+					uint32_t	bits,
+					lockbox_shelf_result *result);
+
+	/* Atomic operations on naturally aligned 32 and 64 bit
+	 * words in the data of a lockbox, for counters and
+	 * sequence numbers. Each returns the previous value of
+	 * the word in *old (if old is not null).
+	 */
+
+int		lkb_fetchadd32(	lockbox_t	id,
+				off_t		offset,
+				uint32_t	value,
+				uint32_t	*old);
+int		lkb_fetchadd64(	lockbox_t	id,
+				off_t		offset,
+				uint64_t	value,
+				uint64_t	*old);
+int		lkb_exchange32(	lockbox_t	id,
+				off_t		offset,
+				uint32_t	value,
+				uint32_t	*old);
+int		lkb_exchange64(	lockbox_t	id,
+				off_t		offset,
+				uint64_t	value,
+				uint64_t	*old);
+int		lkb_cas32(	lockbox_t	id,
+				off_t		offset,
+				uint32_t	expected,
+				uint32_t	value,
+				uint32_t	*old);
+int		lkb_cas64(	lockbox_t	id,
+				off_t		offset,
+				uint64_t	expected,
+				uint64_t	value,
+				uint64_t	*old);
+
 	/* Gets or sets the file associated with a lockbox.
 	 * Useful for passing file descriptors across process
 	 * boundaries.
@@ -230,14 +772,35 @@ int		lkb_getacl(	lockbox_t	id,
 #define	LKB_SELECT_USERS_GREATER_THAN	1
 #define	LKB_SELECT_FLAGS		2
 #define	LKB_SELECT_LOCKAVAIL		3
+#define	LKB_SELECT_MESSAGES		4
+#define	LKB_SELECT_LOG			5
+#define	LKB_SELECT_DATA_CHANGED		6
+#define	LKB_SELECT_ALL			7
 
 #define	LKB_SELECT_DISABLE_USERS_LT	0
 #define LKB_SELECT_DISABLE_USERS_GT	(~(uint32_t)0)
 #define	LKB_SELECT_ALL_FLAGS		(~(uint32_t)0)
 
+/* Comparisons of a word of lockbox data for lkb_setselectdata. The
+ * word and the value are compared as unsigned numbers.
+ */
+#define	LKB_CMP_EQ			1
+#define	LKB_CMP_NE			2
+#define	LKB_CMP_LT			3
+#define	LKB_CMP_LE			4
+#define	LKB_CMP_GT			5
+#define	LKB_CMP_GE			6
+#define	LKB_CMP_ANYBITS			7
+#define	LKB_CMP_ALLBITS			8
+
 int		lkb_setselectcriterion(	lockbox_t	id,
 					uint32_t	type,
 					uint32_t	value);
+int		lkb_setselectdata(	lockbox_t	id,
+					uint32_t	offset,
+					uint32_t	width,
+					uint32_t	op,
+					uint64_t	value);
 int		lkb_getselectableboxes(	size_t		arraysize,
 					lockbox_t	*array);
 int		lkb_resetallselects(	void);
@@ -245,5 +808,12 @@ int		lkb_resetallselects(	void);
 int		lkb_createselectfd(	lockbox_select_fd_entry const *entries,
 					size_t		count);
 
+/* Signal the eventfd fd whenever the select criteria of id are met,
+ * instead of having to find the handle with lkb_getselectableboxes.
+ * An fd of -1 removes the binding, as does closing id.
+ */
+int		lkb_bindeventfd(	lockbox_t	id,
+					int		fd);
+
 #endif
 
@@ -21,6 +21,183 @@
 
 #define	LKB_ALLOCATION_UNIT	128
 
+/* Handles are bigger than shelves, so are allocated in bigger blocks
+ * to keep a useful number of them in each.
+ */
+#define	LKB_HANDLE_ALLOCATION_UNIT	1024
+
+/* Number of distinct lock types in LKB_LOCK_ALL */
+#define	LKB_LOCK_TYPES		4
+
+/* Number of data changes remembered for lkb_getdelta */
+#define	LKB_DIRTY_HISTORY	64
+
+struct lockbox_boxuse_;
+
+/* A byte range lock held on the data of a lock box. Range locks
+ * are kept on an unordered list hanging off the box and are
+ * protected by the box's lkb_b_lock.
+ */
+typedef struct lockbox_range_
+{
+	struct	lockbox_range_ *lkb_r_next;	/* next range lock on the box	*/
+	struct	lockbox_boxuse_ *lkb_r_owner;	/* handle holding the lock	*/
+	uint32_t	lkb_r_offset;		/* first byte locked		*/
+	uint32_t	lkb_r_size;		/* number of bytes locked	*/
+	uint32_t	lkb_r_flags;		/* LKB_RANGE_SHARED/EXCLUSIVE	*/
+} lockbox_range;
+
+/* A process waiting for a range lock. Each waiter sleeps on its
+ * own queue so that releasing a range only wakes the waiters whose
+ * ranges overlap it.
+ */
+typedef struct lockbox_rangewait_
+{
+	struct	lockbox_rangewait_ *lkb_rw_next;
+	struct	lockbox_boxuse_ *lkb_rw_owner;	/* handle that is waiting	*/
+	uint32_t	lkb_rw_offset;
+	uint32_t	lkb_rw_size;
+	int		lkb_rw_queued;		/* on the box's waiter list	*/
+	wait_queue_head_t lkb_rw_waitq;
+} lockbox_rangewait;
+
+/* A process waiting for a unit of a semaphore. Waiters are granted
+ * units in the order they queued, by whoever posts them, and each
+ * sleeps on its own queue so that a post only wakes the waiters it
+ * hands units to.
+ */
+typedef struct lockbox_semwait_
+{
+	struct	lockbox_semwait_ *lkb_sw_next;
+	struct	lockbox_boxuse_ *lkb_sw_owner;	/* handle that is waiting	*/
+	int		lkb_sw_queued;		/* on the semaphore's list	*/
+	int		lkb_sw_granted;		/* has been given a unit	*/
+	wait_queue_head_t lkb_sw_waitq;
+} lockbox_semwait;
+
+/* A change to the data of a lock box, remembered so that a reader
+ * can ask for just the bytes changed since the version it has.
+ */
+typedef struct
+{
+	uint64_t	lkb_d_version;		/* Version the change made	*/
+	uint32_t	lkb_d_offset;
+	uint32_t	lkb_d_size;
+} lockbox_dirty;
+
+/* A message waiting in a queue box */
+typedef struct lockbox_message_
+{
+	struct	lockbox_message_ *lkb_m_next;
+	uint32_t	lkb_m_size;
+	char		lkb_m_data[0];
+} lockbox_message;
+
+/* The messages of a box of type LKB_TYPE_QUEUE. Consumers sleep on
+ * lkb_q_popq and producers waiting for space on lkb_q_pushq, both
+ * exclusively, so that each message or free slot wakes one process.
+ * Protected by the box's lkb_b_lock.
+ */
+typedef struct
+{
+	lockbox_message	*lkb_q_head;
+	lockbox_message	*lkb_q_tail;
+	uint32_t	lkb_q_count;
+	uint32_t	lkb_q_capacity;		/* Most messages held at once	*/
+	wait_queue_head_t lkb_q_popq;
+	wait_queue_head_t lkb_q_pushq;
+} lockbox_queue;
+
+/* The records of a box of type LKB_TYPE_LOG, kept in a ring of
+ * lkb_l_capacity slots. Record n is in slot n % lkb_l_capacity until
+ * record n + lkb_l_capacity replaces it. Readers sleep on lkb_l_waitq
+ * and are all woken by each new record. Protected by the box's
+ * lkb_b_lock.
+ */
+typedef struct
+{
+	lockbox_message	**lkb_l_records;
+	uint32_t	lkb_l_capacity;
+	uint64_t	lkb_l_head;		/* Number of the next record	*/
+	wait_queue_head_t lkb_l_waitq;
+} lockbox_log;
+
+/* An entry in a box of type LKB_TYPE_MAP. The key is followed by the
+ * value in lkb_me_data.
+ */
+typedef struct lockbox_mapentry_
+{
+	struct	lockbox_mapentry_ *lkb_me_next;	/* next entry in the bucket	*/
+	uint64_t	lkb_me_version;		/* Map version of last change	*/
+	uint32_t	lkb_me_hash;
+	uint32_t	lkb_me_keysize;
+	uint32_t	lkb_me_valsize;
+	char		lkb_me_data[0];
+} lockbox_mapentry;
+
+/* The entries of a box of type LKB_TYPE_MAP, in a hash table with a
+ * power of two number of buckets. Protected by the box's lkb_b_lock.
+ */
+typedef struct
+{
+	lockbox_mapentry **lkb_mp_buckets;
+	uint32_t	lkb_mp_nbuckets;
+	uint32_t	lkb_mp_count;
+	uint32_t	lkb_mp_capacity;	/* Most entries held at once	*/
+	uint64_t	lkb_mp_version;		/* Bumped on each change	*/
+} lockbox_map;
+
+/* One CPU's share of the counters of a box of type LKB_TYPE_COUNTER.
+ * Only that CPU changes it, with preemption disabled, bumping
+ * lkb_cs_seq before and after so that a reader on another CPU can
+ * tell that it saw a value that was being changed.
+ */
+typedef struct
+{
+	uint32_t	lkb_cs_seq;
+	int64_t		lkb_cs_values[0];
+} lockbox_countershard;
+
+/* The counters of a box of type LKB_TYPE_COUNTER, split up by CPU.
+ * A CPU's shard is allocated (under the box's lkb_b_lock) the first
+ * time it adds to a counter; the value of a counter is the sum of
+ * its shares in all of the shards.
+ */
+typedef struct
+{
+	lockbox_countershard **lkb_c_shards;	/* Indexed by CPU		*/
+	uint32_t	lkb_c_capacity;		/* Number of counters		*/
+} lockbox_counter;
+
+/* The semaphore of a box of type LKB_TYPE_SEMAPHORE. There are only
+ * waiters while lkb_sm_count is 0.
+ */
+typedef struct
+{
+	uint32_t	lkb_sm_count;		/* Units available		*/
+	lockbox_semwait	*lkb_sm_waiters;	/* Oldest first			*/
+} lockbox_semaphore;
+
+/* The rt-mutex used to wait for a lock type on a box that is in
+ * priority inheritance mode. A waiter holds a reference while it is
+ * queued on the mutex, so that the box can abandon a mutex that can
+ * never be released (because its owner is not the task closing the
+ * handle) without freeing it out from under the waiters. An abandoned
+ * mutex keeps a reference to its owner, since the waiters' priority
+ * chains still lead to it.
+ */
+typedef struct
+{
+	struct	rt_mutex lkb_pl_mutex;
+	atomic_t	lkb_pl_refs;
+	struct task_struct *lkb_pl_owner;	/* Owner when abandoned	*/
+} lockbox_pilock;
+
+/* Wakeups held back in lkb_b_deferred */
+#define	LKB_DEFER_WAKE		0x00000001	/* wake_box_sleepers	*/
+#define	LKB_DEFER_DATA		0x00000002	/* Data change waiters	*/
+#define	LKB_DEFER_QUEUED	0x80000000	/* lkb_b_flush is queued */
+
 typedef struct lockbox_box_
 {
 	struct 	lockbox_box_ *lkb_b_next;	/* link to the next lock box	*/
@@ -33,21 +210,205 @@ typedef struct lockbox_box_
 	uint32_t	lkb_b_holders;		/* Still need the pointer	*/
 	uint32_t	lkb_b_userlocks;	/* User level lock bits 	*/
 	uint32_t	lkb_b_state;		/* State bits			*/
+	uint64_t	lkb_b_stateseq;		/* Changes to lkb_b_state	*/
+	uint32_t	lkb_b_setcounts[LKB_STATE_BITS]; /* 0 to 1 per bit	*/
 	uint32_t	lkb_b_shelf;		/* The shelf we are on		*/
 	struct 		semaphore lkb_b_lock;	/* Exclusive access control	*/
 	wait_queue_head_t lkb_b_waitq;
+	wait_queue_head_t lkb_b_statewaitq;	/* lkb_waitstate callers	*/
+	wait_queue_head_t lkb_b_datawaitq;	/* Selecting on data changes	*/
+	lockbox_range	*lkb_b_ranges;		/* Byte range locks on the data	*/
+	lockbox_rangewait *lkb_b_rangewaiters;	/* Waiters for range locks	*/
+	uint32_t	lkb_b_spin_usecs;	/* Spin this long before sleep	*/
+	uint64_t	lkb_b_version;		/* Bumped on each data change	*/
+
+	/* A ring of the last LKB_DIRTY_HISTORY data changes, allocated
+	 * on the first change. lkb_b_dirtybase is the oldest version
+	 * from which the ring still holds every later change.
+	 */
+	lockbox_dirty	*lkb_b_dirty;
+	uint32_t	lkb_b_ndirty;		/* Entries in use		*/
+	uint32_t	lkb_b_dirtynext;	/* Entry to use next		*/
+	uint64_t	lkb_b_dirtybase;
+
+	/* The task that acquired each of the user level locks, indexed
+	 * by the lock's bit number. Protected by lkb_b_ownerlock rather
+	 * than lkb_b_lock so that spinning lockers can look at it.
+	 */
+	spinlock_t	lkb_b_ownerlock;
+	struct task_struct *lkb_b_lockowners[LKB_LOCK_TYPES];
+
+	int		lkb_b_pi;		/* Priority inheritance mode	*/
+	lockbox_pilock	*lkb_b_pilocks[LKB_LOCK_TYPES];
+
+	/* The page holding the lock words for the user space fast path,
+	 * allocated the first time a handle asks for it. Once it exists
+	 * the lock words, not lkb_b_userlocks, say which handles hold the
+	 * whole box locks; processes that have it mapped update them
+	 * without calling into the kernel.
+	 */
+	struct page	*lkb_b_fastpage;
+	lockbox_fastlock *lkb_b_fast;
+
+	uint32_t	lkb_b_type;		/* LKB_TYPE_*			*/
+	lockbox_queue	*lkb_b_queue;		/* For LKB_TYPE_QUEUE		*/
+	lockbox_log	*lkb_b_log;		/* For LKB_TYPE_LOG		*/
+	lockbox_map	*lkb_b_map;		/* For LKB_TYPE_MAP		*/
+	lockbox_counter	*lkb_b_counter;		/* For LKB_TYPE_COUNTER		*/
+	lockbox_semaphore *lkb_b_sem;		/* For LKB_TYPE_SEMAPHORE	*/
+
+	uint32_t	lkb_b_aclgen;		/* Bumped when the ACL changes	*/
+
+	/* Handles watching this box with lkb_watchbox */
+	struct lockbox_boxwatch_ *lkb_b_watches;
+
+	/* Eventfds bound to handles with lkb_bindeventfd */
+	struct lockbox_eventfd_ *lkb_b_eventfds;
+
+	/* With a coalescing window set by lkb_setcoalesce, the wakeups
+	 * from state and data changes are held back in lkb_b_deferred,
+	 * and the state bits changed in lkb_b_changed, until
+	 * lkb_b_flush runs.
+	 */
+	struct lockbox_vault_ *lkb_b_vault;
+	uint32_t	lkb_b_coalesce;		/* Window in milliseconds	*/
+	uint32_t	lkb_b_deferred;		/* LKB_DEFER_* bits		*/
+	uint32_t	lkb_b_changed;
+	struct delayed_work lkb_b_flush;
 } lockbox_box;
 
-typedef struct
+typedef struct lockbox_boxuse_
 {
 	lockbox_box	*lkb_bu_box;
 	uint32_t	lkb_bu_select_users_lt;
 	uint32_t	lkb_bu_select_users_gt;
 	uint32_t	lkb_bu_select_flags;
 	uint32_t	lkb_bu_select_wantlock;
+	uint32_t	lkb_bu_select_messages;
+	uint32_t	lkb_bu_select_log;
+	uint32_t	lkb_bu_select_data;
+	uint64_t	lkb_bu_seenversion;	/* Data version last read	*/
+	uint32_t	lkb_bu_select_all;	/* AND the criteria, not OR	*/
+
+	/* Compare a word of the data with lkb_bu_select_cmpvalue */
+	uint32_t	lkb_bu_select_cmpop;	/* LKB_CMP_*, or 0 for none	*/
+	uint32_t	lkb_bu_select_cmpoffset;
+	uint32_t	lkb_bu_select_cmpwidth;	/* 4 or 8			*/
+	uint64_t	lkb_bu_select_cmpvalue;
 	uint32_t	lkb_bu_locks_held;
+	uint32_t	lkb_bu_pi_held;		/* Held locks with an rt-mutex	*/
+	uint32_t	lkb_bu_token;		/* Owner value in lock words	*/
+	uint64_t	lkb_bu_cursor;		/* Next log record to read	*/
+
+	/* Whether the handle may write, as of lkb_b_aclgen being
+	 * lkb_bu_aclgen, for a caller with the credentials below. This
+	 * is for calls that take no locks, so lkb_bu_wseq is odd while
+	 * it changes. A reference is held on lkb_bu_groups so that the
+	 * pointer cannot be reused for a different set of groups.
+	 */
+	uint32_t	lkb_bu_wseq;
+	uint32_t	lkb_bu_aclgen;
+	pid_t		lkb_bu_tgid;
+	uid_t		lkb_bu_euid;
+	gid_t		lkb_bu_egid;
+	struct group_info *lkb_bu_groups;
+	int		lkb_bu_canwrite;
+
+	uint32_t	lkb_bu_semheld;		/* Semaphore units taken	*/
+
+	/* Reference to the lock words page, left by LKBCALL_FASTMAP for
+	 * mmap to take, since mmap runs with mmap_sem held and may not
+	 * take lkb_pf_lock or lkb_b_lock.
+	 */
+	struct page	*lkb_bu_fastpage;
 } lockbox_boxuse;
 
+/* A lock box being locked by lkb_lockmulti */
+typedef struct
+{
+	lockbox_box	*lkb_ml_box;
+	lockbox_t	lkb_ml_id;
+	uint32_t	lkb_ml_flags;
+	uint32_t	lkb_ml_taken;		/* Locks this call obtained	*/
+} lockbox_multilock;
+
+/* An operation in an lkb_writemulti call, with its data copied in */
+typedef struct
+{
+	lockbox_boxuse	*lkb_mw_bu;
+	lockbox_box	*lkb_mw_box;
+	lockbox_t	lkb_mw_id;
+	uint32_t	lkb_mw_op;
+	char		*lkb_mw_data;
+	uint32_t	lkb_mw_size;
+	uint32_t	lkb_mw_offset;
+	uint32_t	lkb_mw_state;
+
+	/* Only used in the first operation on each box */
+	char		*lkb_mw_newdata;	/* Box data, grown to fit	*/
+	uint32_t	lkb_mw_newsize;
+	int		lkb_mw_wake;		/* New state bits were set	*/
+} lockbox_multiwrite;
+
+struct lockbox_perfile_;
+
+/* An event waiting to be read from a vault file descriptor, followed
+ * by le_namesize bytes of name.
+ */
+typedef struct lockbox_pendingevent_
+{
+	struct lockbox_pendingevent_ *lkb_pe_next;
+	lockbox_event	lkb_pe_event;
+	char		lkb_pe_name[0];
+} lockbox_pendingevent;
+
+/* The events waiting to be read from a vault file descriptor. Events
+ * are queued by other processes while they hold box and shelf locks,
+ * so the queue has a spinlock of its own.
+ */
+typedef struct
+{
+	spinlock_t	lkb_eq_lock;
+	lockbox_pendingevent *lkb_eq_head;
+	lockbox_pendingevent *lkb_eq_tail;
+	uint32_t	lkb_eq_count;
+	uint32_t	lkb_eq_lost;		/* Dropped since last read	*/
+	wait_queue_head_t lkb_eq_waitq;
+} lockbox_eventqueue;
+
+/* A file descriptor watching a shelf for the events in lkb_w_events.
+ * Watches hang off the vault, under its lkb_v_watchlock.
+ */
+typedef struct lockbox_watch_
+{
+	struct lockbox_watch_ *lkb_w_next;
+	struct lockbox_perfile_ *lkb_w_pf;
+	uint32_t	lkb_w_shelf;
+	uint32_t	lkb_w_events;		/* LKB_EVENT_* bits		*/
+} lockbox_watch;
+
+/* A handle watching a box for the events in lkb_bw_events. Box
+ * watches hang off the box, under its lkb_b_lock.
+ */
+typedef struct lockbox_boxwatch_
+{
+	struct lockbox_boxwatch_ *lkb_bw_next;
+	struct lockbox_perfile_ *lkb_bw_pf;
+	lockbox_boxuse	*lkb_bw_bu;		/* The handle watching		*/
+	lockbox_t	lkb_bw_id;
+	uint32_t	lkb_bw_events;		/* LKB_EVENT_* bits		*/
+} lockbox_boxwatch;
+
+/* An eventfd signalled when the select criteria of a handle are met.
+ * These hang off the box, under its lkb_b_lock.
+ */
+typedef struct lockbox_eventfd_
+{
+	struct lockbox_eventfd_ *lkb_ef_next;
+	lockbox_boxuse	*lkb_ef_bu;
+	struct eventfd_ctx *lkb_ef_ctx;
+} lockbox_eventfd;
+
 typedef struct
 {
 	lockbox_box	*lkb_s_boxlist;
@@ -65,7 +426,8 @@ typedef struct lockbox_shelflist_
 
 #define	IN_VAULT_SHELVES ((LKB_ALLOCATION_UNIT - \
 			   sizeof(struct semaphore) - \
-			   sizeof(void *) * 3 - \
+			   sizeof(spinlock_t) - \
+			   sizeof(void *) * 4 - \
 			   sizeof(uint32_t)) / sizeof(lockbox_shelf))
 typedef struct lockbox_vault_
 {
@@ -77,10 +439,14 @@ typedef struct lockbox_vault_
 	 */
 	lockbox_shelflist *lkb_v_shelflist;
 	struct	semaphore lkb_v_lock;
+
+	/* Shelf watches, taken after any box or shelf lock */
+	spinlock_t	lkb_v_watchlock;
+	lockbox_watch	*lkb_v_watches;
 	lockbox_shelf lkb_v_shelves[IN_VAULT_SHELVES];
 } lockbox_vault;
 
-#define	IN_BOXLIST_BOXES ((LKB_ALLOCATION_UNIT - \
+#define	IN_BOXLIST_BOXES ((LKB_HANDLE_ALLOCATION_UNIT - \
 			   sizeof(void *)) / sizeof(lockbox_boxuse))
 typedef struct lockbox_boxlist_
 {
@@ -88,14 +454,16 @@ typedef struct lockbox_boxlist_
 	lockbox_boxuse	lkb_bl_boxes[IN_BOXLIST_BOXES];
 } lockbox_boxlist;
 
-#define	IN_PERFILE_BOXES ((LKB_ALLOCATION_UNIT - \
+#define	IN_PERFILE_BOXES ((LKB_HANDLE_ALLOCATION_UNIT - \
 			   sizeof(struct semaphore) - \
+			   sizeof(lockbox_eventqueue) - \
 			   sizeof(void *) * 2) / sizeof(lockbox_boxuse))
-typedef struct
+typedef struct lockbox_perfile_
 {
 	struct	semaphore lkb_pf_lock;
 	lockbox_vault *lkb_pf_vault;
 	lockbox_boxlist *lkb_pf_boxlist;
+	lockbox_eventqueue lkb_pf_events;	/* For read()			*/
 	lockbox_boxuse	lkb_pf_boxes[IN_PERFILE_BOXES];
 } lockbox_perfile;
 
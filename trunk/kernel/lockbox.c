@@ -19,7 +19,6 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
-#include <linux/config.h>
 #include <linux/version.h>
 #include <linux/kmod.h>
 #include <linux/proc_fs.h>
@@ -30,10 +29,50 @@
 #include <linux/vmalloc.h>
 #include <linux/init.h>
 #include <linux/file.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/rtmutex.h>
+#include <linux/hrtimer.h>
+#include <linux/jhash.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#include <linux/cred.h>
+#endif
 
 #include "../include/linux/lockbox.h"
 #include "lockbox-internal.h"
 
+/* Modules can only use eventfds through an eventfd_ctx, which came in
+ * 2.6.31. Before that lkb_bindeventfd fails with ENOSYS.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,31)
+#define	eventfd_ctx_fdget(fd)		ERR_PTR(-ENOSYS)
+#define	eventfd_signal(ctx, n)		((void) (ctx), 0)
+#define	eventfd_ctx_put(ctx)		do { } while (0)
+#endif
+
+/* Credentials moved from the task into struct cred in 2.6.29 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,29)
+#define	current_euid()		(current->euid)
+#define	current_egid()		(current->egid)
+#define	lkb_current_groups()	(current->group_info)
+#else
+#define	lkb_current_groups()	(current_cred()->group_info)
+#endif
+
+/* hrtimer expiry times became private in 2.6.28 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+#define	hrtimer_set_expires(timer, time)	((timer)->expires = (time))
+#endif
+
+#ifndef ACCESS_ONCE
+#define	ACCESS_ONCE(x)	(*(volatile typeof(x) *) &(x))
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Troy Rollo <linux@troy.rollo.name>");
 MODULE_DESCRIPTION("Kernel implementation of the lockbox API");
@@ -41,10 +80,33 @@ MODULE_DESCRIPTION("Kernel implementation of the lockbox API");
 static 	lockbox_vault *vault_list = 0;
 struct semaphore vaultlist_lock;
 
+static	unsigned int spin_usecs = 20;
+module_param(spin_usecs, uint, 0644);
+MODULE_PARM_DESC(spin_usecs, "Default time to spin on a busy lock before sleeping");
+
+static	unsigned int spin_max_usecs = 1000;
+module_param(spin_max_usecs, uint, 0644);
+MODULE_PARM_DESC(spin_max_usecs, "Longest time to spin on a busy lock before sleeping");
+
+static	unsigned int coalesce_max_msecs = 1000;
+module_param(coalesce_max_msecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_max_msecs, "Longest window for coalescing lockbox wakeups");
+
+/* How often a task waiting on a priority inheritance lock checks
+ * whether the lock has been abandoned.
+ */
+#define	LKB_PI_POLL_NSECS	(100 * 1000 * 1000)
+
+/* Source of the tokens that identify handles in fast path lock words */
+static	atomic_t next_token = ATOMIC_INIT(0);
+
 static int is_lockbox_file(struct file *f);
+static void signal_eventfds(lockbox_box *b, lockbox_boxuse *bu);
+static void flush_box_wakeups(struct work_struct *work);
 
 #ifndef __x86_64__
 typedef int	lockbox32_select_fd_entry;
+typedef int	lockbox32_multiwrite_entry;
 #else
 static void *
 uint32_to_ptr(uint32_t u)
@@ -148,7 +210,7 @@ get_user_acl(	lockbox_acl const *pacl,
 		pkacl->la_header.lah_version = LKB_ACL_VERSION;
 		pkacl->la_header.lah_n_entries = 2;
 		pkacl->la_entries[0].lae_idtype = LKB_IDTYPE_USER;
-		pkacl->la_entries[0].lae_id = current->euid;
+		pkacl->la_entries[0].lae_id = current_euid();
 		pkacl->la_entries[0].lae_access = LKB_ACCESS_ALL;
 		pkacl->la_entries[1].lae_idtype = LKB_IDTYPE_WORLD;
 		pkacl->la_entries[1].lae_id = 0;
@@ -159,32 +221,219 @@ get_user_acl(	lockbox_acl const *pacl,
 	}
 }
 
+static lockbox_queue *
+new_queue(uint32_t capacity)
+{
+	lockbox_queue *q = kmalloc(sizeof(lockbox_queue), GFP_KERNEL);
+
+	if (q)
+	{
+		memset(q, 0, sizeof(lockbox_queue));
+		q->lkb_q_capacity = capacity;
+		init_waitqueue_head(&q->lkb_q_popq);
+		init_waitqueue_head(&q->lkb_q_pushq);
+	}
+	return q;
+}
+
+static void
+free_queue(lockbox_queue *q)
+{
+	while (q->lkb_q_head)
+	{
+		lockbox_message *m = q->lkb_q_head;
+
+		q->lkb_q_head = m->lkb_m_next;
+		kfree(m);
+	}
+	kfree(q);
+}
+
+static lockbox_log *
+new_log(uint32_t capacity)
+{
+	lockbox_log *l = kmalloc(sizeof(lockbox_log), GFP_KERNEL);
+
+	if (l)
+	{
+		memset(l, 0, sizeof(lockbox_log));
+		l->lkb_l_capacity = capacity;
+		l->lkb_l_records = opt_alloc(capacity * sizeof(lockbox_message *));
+		if (!l->lkb_l_records)
+		{
+			kfree(l);
+			return 0;
+		}
+		memset(l->lkb_l_records, 0, capacity * sizeof(lockbox_message *));
+		init_waitqueue_head(&l->lkb_l_waitq);
+	}
+	return l;
+}
+
+static void
+free_log(lockbox_log *l)
+{
+	uint32_t i;
+
+	for (i = 0; i < l->lkb_l_capacity; ++i)
+	{
+		if (l->lkb_l_records[i])
+			kfree(l->lkb_l_records[i]);
+	}
+	opt_free(l->lkb_l_records, l->lkb_l_capacity * sizeof(lockbox_message *));
+	kfree(l);
+}
+
+/* The number of the oldest record still in the log */
+static uint64_t
+log_oldest(lockbox_log *l)
+{
+	if (l->lkb_l_head > l->lkb_l_capacity)
+		return l->lkb_l_head - l->lkb_l_capacity;
+	return 0;
+}
+
+static lockbox_map *
+new_map(uint32_t capacity)
+{
+	lockbox_map *mp = kmalloc(sizeof(lockbox_map), GFP_KERNEL);
+	uint32_t nbuckets = 1;
+
+	while (nbuckets < capacity)
+		nbuckets <<= 1;
+	if (mp)
+	{
+		memset(mp, 0, sizeof(lockbox_map));
+		mp->lkb_mp_capacity = capacity;
+		mp->lkb_mp_nbuckets = nbuckets;
+		mp->lkb_mp_buckets = opt_alloc(nbuckets * sizeof(lockbox_mapentry *));
+		if (!mp->lkb_mp_buckets)
+		{
+			kfree(mp);
+			return 0;
+		}
+		memset(mp->lkb_mp_buckets, 0, nbuckets * sizeof(lockbox_mapentry *));
+	}
+	return mp;
+}
+
+static void
+free_map(lockbox_map *mp)
+{
+	uint32_t i;
+
+	for (i = 0; i < mp->lkb_mp_nbuckets; ++i)
+	{
+		while (mp->lkb_mp_buckets[i])
+		{
+			lockbox_mapentry *e = mp->lkb_mp_buckets[i];
+
+			mp->lkb_mp_buckets[i] = e->lkb_me_next;
+			kfree(e);
+		}
+	}
+	opt_free(mp->lkb_mp_buckets, mp->lkb_mp_nbuckets * sizeof(lockbox_mapentry *));
+	kfree(mp);
+}
+
+static lockbox_counter *
+new_counter(uint32_t capacity)
+{
+	lockbox_counter *c = kmalloc(sizeof(lockbox_counter), GFP_KERNEL);
+
+	if (c)
+	{
+		c->lkb_c_capacity = capacity;
+		c->lkb_c_shards = opt_alloc(NR_CPUS * sizeof(lockbox_countershard *));
+		if (!c->lkb_c_shards)
+		{
+			kfree(c);
+			return 0;
+		}
+		memset(c->lkb_c_shards, 0, NR_CPUS * sizeof(lockbox_countershard *));
+	}
+	return c;
+}
+
+static void
+free_counter(lockbox_counter *c)
+{
+	int	cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		if (c->lkb_c_shards[cpu])
+			kfree(c->lkb_c_shards[cpu]);
+	}
+	opt_free(c->lkb_c_shards, NR_CPUS * sizeof(lockbox_countershard *));
+	kfree(c);
+}
+
+static lockbox_semaphore *
+new_semaphore(uint32_t count)
+{
+	lockbox_semaphore *sm = kmalloc(sizeof(lockbox_semaphore), GFP_KERNEL);
+
+	if (sm)
+	{
+		sm->lkb_sm_count = count;
+		sm->lkb_sm_waiters = 0;
+	}
+	return sm;
+}
+
 static int
 new_box(	char	*name,
 		char const *data,
 		size_t	size,
 		lockbox_acl const *pacl,
 		uint32_t shelf,
+		uint32_t type,
+		uint32_t capacity,
 		lockbox_box **ppbox)
 {
 	char	*box_mem = 0;
 	lockbox_acl *pkacl = 0;
+	lockbox_queue *queue = 0;
+	lockbox_log *log = 0;
+	lockbox_map *map = 0;
+	lockbox_counter *counter = 0;
+	lockbox_semaphore *sem = 0;
 	lockbox_box *newbox;
 	int status = -ENOMEM;
 
 	if ((newbox = kmalloc(sizeof(lockbox_box), GFP_KERNEL)) != 0 &&
 	    (!size || (status = copy_user_data(data, size, (void **) &box_mem)) == 0) &&
-	    (status = get_user_acl(pacl, &pkacl)) == 0)
+	    (status = get_user_acl(pacl, &pkacl)) == 0 &&
+	    (type != LKB_TYPE_QUEUE || (queue = new_queue(capacity)) != 0) &&
+	    (type != LKB_TYPE_LOG || (log = new_log(capacity)) != 0) &&
+	    (type != LKB_TYPE_MAP || (map = new_map(capacity)) != 0) &&
+	    (type != LKB_TYPE_COUNTER || (counter = new_counter(capacity)) != 0) &&
+	    (type != LKB_TYPE_SEMAPHORE || (sem = new_semaphore(capacity)) != 0))
 	{
 		memset(newbox, 0, sizeof(lockbox_box));
 		newbox->lkb_b_name = name;
 		newbox->lkb_b_data = box_mem;
 		newbox->lkb_b_acl = pkacl;
 		newbox->lkb_b_size = size;
+		newbox->lkb_b_type = type;
+		newbox->lkb_b_queue = queue;
+		newbox->lkb_b_log = log;
+		newbox->lkb_b_map = map;
+		newbox->lkb_b_counter = counter;
+		newbox->lkb_b_sem = sem;
+		newbox->lkb_b_aclgen = 1;
 		newbox->lkb_b_users = 1;
 		newbox->lkb_b_shelf = shelf;
-		init_MUTEX(&newbox->lkb_b_lock);
+		newbox->lkb_b_spin_usecs = spin_usecs;
+		newbox->lkb_b_version = 1;
+		newbox->lkb_b_dirtybase = 1;
+		sema_init(&newbox->lkb_b_lock, 1);
+		spin_lock_init(&newbox->lkb_b_ownerlock);
 		init_waitqueue_head(&newbox->lkb_b_waitq);
+		init_waitqueue_head(&newbox->lkb_b_statewaitq);
+		init_waitqueue_head(&newbox->lkb_b_datawaitq);
+		INIT_DELAYED_WORK(&newbox->lkb_b_flush, flush_box_wakeups);
 		*ppbox = newbox;
 	}
 	else
@@ -195,19 +444,72 @@ new_box(	char	*name,
 			kfree(newbox);
 		if (pkacl)
 			opt_free(pkacl, LKB_ACL_SIZE(pkacl->la_header.lah_n_entries));
+		if (queue)
+			free_queue(queue);
+		if (log)
+			free_log(log);
+		if (map)
+			free_map(map);
+		if (counter)
+			free_counter(counter);
+		if (status >= 0)
+			status = -ENOMEM;
 	}
 	return status;
 }
 
+static void
+put_pilock(lockbox_pilock *p)
+{
+	if (atomic_dec_and_test(&p->lkb_pl_refs))
+	{
+		if (p->lkb_pl_owner)
+			put_task_struct(p->lkb_pl_owner);
+		kfree(p);
+	}
+}
+
 static void
 free_box(lockbox_box *b)
 {
+	int	i;
+
 	kfree(b->lkb_b_name);
 	if (b->lkb_b_file)
 		fput(b->lkb_b_file);
 	opt_free(b->lkb_b_acl, LKB_ACL_SIZE(b->lkb_b_acl->la_header.lah_n_entries));
 	if (b->lkb_b_data)
 		opt_free(b->lkb_b_data, b->lkb_b_size);
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if (b->lkb_b_pilocks[i])
+			put_pilock(b->lkb_b_pilocks[i]);
+	}
+
+	/* Any process that still has the lock words mapped holds its
+	 * own reference to the page.
+	 */
+	if (b->lkb_b_fastpage)
+		__free_page(b->lkb_b_fastpage);
+	if (b->lkb_b_dirty)
+		kfree(b->lkb_b_dirty);
+	if (b->lkb_b_queue)
+		free_queue(b->lkb_b_queue);
+	if (b->lkb_b_log)
+		free_log(b->lkb_b_log);
+	if (b->lkb_b_map)
+		free_map(b->lkb_b_map);
+	if (b->lkb_b_counter)
+		free_counter(b->lkb_b_counter);
+	if (b->lkb_b_sem)
+		kfree(b->lkb_b_sem);
+	while (b->lkb_b_ranges)
+	{
+		lockbox_range *r = b->lkb_b_ranges;
+
+		b->lkb_b_ranges = r->lkb_r_next;
+		kfree(r);
+	}
 	kfree(b);
 }
 
@@ -215,7 +517,7 @@ static void
 init_shelf(lockbox_shelf *s)
 {
 	memset(s, 0, sizeof(lockbox_shelf));
-	init_MUTEX(&s->lkb_s_lock);
+	sema_init(&s->lkb_s_lock, 1);
 }
 
 static lockbox_shelflist *
@@ -244,7 +546,8 @@ new_vault(char *vault_name)
 		int	i;
 
 		memset(newvault, 0, sizeof(lockbox_vault));
-		init_MUTEX(&newvault->lkb_v_lock);
+		sema_init(&newvault->lkb_v_lock, 1);
+		spin_lock_init(&newvault->lkb_v_watchlock);
 		newvault->lkb_v_name = vault_name;
 		newvault->lkb_v_users = 1;
 		for (i = 0; i < IN_VAULT_SHELVES; ++i)
@@ -357,6 +660,15 @@ free_vault(lockbox_vault *v)
 	kfree(v);
 }
 
+/* Take another reference to a vault, dropped with release_vault */
+static void
+hold_vault(lockbox_vault *v)
+{
+	down(&vaultlist_lock);
+	++v->lkb_v_users;
+	up(&vaultlist_lock);
+}
+
 static void
 release_vault(lockbox_vault *v)
 {
@@ -453,434 +765,3895 @@ wake_box_sleepers(	lockbox_box *b,
 		wake_up_all(&b->lkb_b_waitq);
 	else
 		wake_up(&b->lkb_b_waitq);
+	wake_up_all(&b->lkb_b_statewaitq);
+	if (b->lkb_b_eventfds)
+	{
+		down(&b->lkb_b_lock);
+		signal_eventfds(b, 0);
+		up(&b->lkb_b_lock);
+	}
+}
+
+/* Whether changing the state of a box to state needs sleepers woken.
+ * Only bits that go from 0 to 1 wake selectors and lock waiters, but
+ * lkb_waitstate callers may be waiting for bits to be cleared, so any
+ * change wakes the sleepers if there are any of those. Call with the
+ * box locked.
+ */
+static int
+state_change_wakes(	lockbox_box	*b,
+			uint32_t	state)
+{
+	return (state & ~b->lkb_b_state) ||
+	       (state != b->lkb_b_state && waitqueue_active(&b->lkb_b_statewaitq));
+}
+
+static int
+ranges_overlap(	uint32_t	offset1,
+		uint32_t	size1,
+		uint32_t	offset2,
+		uint32_t	size2)
+{
+	return (uint64_t) offset1 < (uint64_t) offset2 + size2 &&
+	       (uint64_t) offset2 < (uint64_t) offset1 + size1;
+}
+
+/* Returns non-zero if a range lock held through a handle other than
+ * bu prevents bu from obtaining a lock of type flags on the range. A
+ * writer is treated as wanting an exclusive lock. Call with the box
+ * locked.
+ */
+static int
+range_conflict(	lockbox_box	*b,
+		lockbox_boxuse	*bu,
+		uint32_t	offset,
+		uint32_t	size,
+		uint32_t	flags)
+{
+	lockbox_range *r;
+
+	for (r = b->lkb_b_ranges; r; r = r->lkb_r_next)
+	{
+		if (r->lkb_r_owner != bu &&
+		    ((flags | r->lkb_r_flags) & LKB_RANGE_EXCLUSIVE) &&
+		    ranges_overlap(offset, size, r->lkb_r_offset, r->lkb_r_size))
+			return 1;
+	}
+	return 0;
 }
 
+/* Wake the range lock waiters whose ranges overlap a range that has
+ * just been released. Call with the box locked.
+ */
 static void
-clean_box_holder(lockbox_vault *v,
-		lockbox_box *b)
+wake_range_waiters(	lockbox_box	*b,
+			uint32_t	offset,
+			uint32_t	size)
 {
-	int need_free;
+	lockbox_rangewait *w;
 
-	down(&b->lkb_b_lock);
-	need_free = (!--b->lkb_b_holders &&
-		     !b->lkb_b_users);
-	up(&b->lkb_b_lock);
-	if (need_free)
+	for (w = b->lkb_b_rangewaiters; w; w = w->lkb_rw_next)
 	{
-		lockbox_shelf *s;
+		if (ranges_overlap(offset, size, w->lkb_rw_offset, w->lkb_rw_size))
+			wake_up(&w->lkb_rw_waitq);
+	}
+}
 
-		find_shelf(v, b->lkb_b_shelf, 0, &s, 0);
-		down(&s->lkb_s_lock);
-		down(&b->lkb_b_lock);
-		if (!b->lkb_b_users && !b->lkb_b_holders)
+static void
+unqueue_range_waiter(	lockbox_box	*b,
+			lockbox_rangewait *w)
+{
+	lockbox_rangewait **ploc;
+
+	for (ploc = &b->lkb_b_rangewaiters; *ploc; ploc = &(*ploc)->lkb_rw_next)
+	{
+		if (*ploc == w)
 		{
-			lockbox_box **ploc;
+			*ploc = w->lkb_rw_next;
+			break;
+		}
+	}
+	w->lkb_rw_queued = 0;
+}
 
-			for (ploc = &s->lkb_s_boxlist;
-			     *ploc;
-			     ploc = &(*ploc)->lkb_b_next)
-			{
-				if (b == *ploc)
-				{
-					*ploc = b->lkb_b_next;
-					break;
-				}
-			}
+/* Drop every range lock held through bu, and wake any waiters that
+ * were waiting through bu so that they notice the handle has gone.
+ * Call with the box locked.
+ */
+static void
+release_ranges(	lockbox_box	*b,
+		lockbox_boxuse	*bu)
+{
+	lockbox_range **ploc = &b->lkb_b_ranges;
+	lockbox_rangewait *w;
+
+	while (*ploc)
+	{
+		lockbox_range *r = *ploc;
+
+		if (r->lkb_r_owner == bu)
+		{
+			*ploc = r->lkb_r_next;
+			wake_range_waiters(b, r->lkb_r_offset, r->lkb_r_size);
+			kfree(r);
 		}
 		else
 		{
-			need_free = 0;
+			ploc = &r->lkb_r_next;
 		}
-		up(&b->lkb_b_lock);
-		up(&s->lkb_s_lock);
-		if (need_free)
-			free_box(b);
+	}
+	for (w = b->lkb_b_rangewaiters; w; w = w->lkb_rw_next)
+	{
+		if (w->lkb_rw_owner == bu)
+			wake_up(&w->lkb_rw_waitq);
 	}
 }
 
+/* Make units available on a semaphore, handing them to the oldest
+ * waiters first. Call with the box locked.
+ */
 static void
-release_box(	lockbox_vault *v,
-		lockbox_box *b,
-		uint32_t locks)
+grant_semaphore(	lockbox_semaphore *sm,
+			uint32_t	units)
 {
-	int	clean;
+	sm->lkb_sm_count += units;
+	while (sm->lkb_sm_count && sm->lkb_sm_waiters)
+	{
+		lockbox_semwait *w = sm->lkb_sm_waiters;
+
+		sm->lkb_sm_waiters = w->lkb_sw_next;
+		w->lkb_sw_queued = 0;
+		w->lkb_sw_granted = 1;
+		++w->lkb_sw_owner->lkb_bu_semheld;
+		--sm->lkb_sm_count;
+		wake_up(&w->lkb_sw_waitq);
+	}
+}
 
-	down(&b->lkb_b_lock);
-	clean = !--b->lkb_b_users;
-	++b->lkb_b_holders;
-	b->lkb_b_userlocks &= ~ locks;
-	up(&b->lkb_b_lock);
+static void
+unqueue_sem_waiter(	lockbox_semaphore *sm,
+			lockbox_semwait *w)
+{
+	lockbox_semwait **ploc;
 
-	wake_box_sleepers(b, clean);
-	clean_box_holder(v, b);
+	for (ploc = &sm->lkb_sm_waiters; *ploc; ploc = &(*ploc)->lkb_sw_next)
+	{
+		if (*ploc == w)
+		{
+			*ploc = w->lkb_sw_next;
+			break;
+		}
+	}
+	w->lkb_sw_queued = 0;
 }
 
+/* Give back the semaphore units taken through bu, and wake any
+ * waiters that were waiting through bu so that they notice the
+ * handle has gone. Call with the box locked.
+ */
 static void
-free_perfile(lockbox_perfile *pf)
+release_semaphore(	lockbox_semaphore *sm,
+			lockbox_boxuse	*bu)
 {
-	int	i;
-	lockbox_boxlist *l, *n;
+	lockbox_semwait **ploc = &sm->lkb_sm_waiters;
 
-	if (pf->lkb_pf_vault)
+	while (*ploc)
 	{
-		release_vault(pf->lkb_pf_vault);
-		for (i = 0; i < IN_PERFILE_BOXES; ++i)
+		lockbox_semwait *w = *ploc;
+
+		if (w->lkb_sw_owner == bu)
 		{
-			if (pf->lkb_pf_boxes[i].lkb_bu_box)
-				release_box(pf->lkb_pf_vault,
-					    pf->lkb_pf_boxes[i].lkb_bu_box,
-					    pf->lkb_pf_boxes[i].lkb_bu_locks_held);
+			*ploc = w->lkb_sw_next;
+			w->lkb_sw_queued = 0;
+			wake_up(&w->lkb_sw_waitq);
 		}
-		for (l = pf->lkb_pf_boxlist; l; l = n)
+		else
 		{
-			n = l->lkb_bl_next;
-	
-			for (i = 0; i < IN_BOXLIST_BOXES; ++i)
-			{
-				if (l->lkb_bl_boxes[i].lkb_bu_box)
-					release_box(pf->lkb_pf_vault,
-						    l->lkb_bl_boxes[i].lkb_bu_box,
-						    l->lkb_bl_boxes[i].lkb_bu_locks_held);
-			}
+			ploc = &w->lkb_sw_next;
 		}
 	}
-	kfree(pf);
+	if (bu->lkb_bu_semheld)
+	{
+		grant_semaphore(sm, bu->lkb_bu_semheld);
+		bu->lkb_bu_semheld = 0;
+	}
 }
 
+/* Record the current task as the owner of newly acquired locks.
+ * Call with the box locked.
+ */
 static void
-reset_boxuse_selects(lockbox_boxuse *bu)
+set_lock_owners(	lockbox_box	*b,
+			uint32_t	locks)
 {
-	bu->lkb_bu_select_users_lt = LKB_SELECT_DISABLE_USERS_LT;
-	bu->lkb_bu_select_users_gt = LKB_SELECT_DISABLE_USERS_GT;
-	bu->lkb_bu_select_flags = 0;
-	bu->lkb_bu_select_wantlock = 0;
+	int	i;
+
+	spin_lock(&b->lkb_b_ownerlock);
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if ((locks & (1 << i)) && !b->lkb_b_lockowners[i])
+		{
+			get_task_struct(current);
+			b->lkb_b_lockowners[i] = current;
+		}
+	}
+	spin_unlock(&b->lkb_b_ownerlock);
 }
 
+/* Forget the owners of locks that are being released. Call with the
+ * box locked.
+ */
 static void
-set_boxuse(	lockbox_boxuse *bu,
-		lockbox_box *b)
+clear_lock_owners(	lockbox_box	*b,
+			uint32_t	locks)
 {
-	bu->lkb_bu_box = b;
-	reset_boxuse_selects(bu);
+	struct task_struct *owners[LKB_LOCK_TYPES];
+	int	i;
+
+	spin_lock(&b->lkb_b_ownerlock);
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		owners[i] = 0;
+		if (locks & (1 << i))
+		{
+			owners[i] = b->lkb_b_lockowners[i];
+			b->lkb_b_lockowners[i] = 0;
+		}
+	}
+	spin_unlock(&b->lkb_b_ownerlock);
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if (owners[i])
+			put_task_struct(owners[i]);
+	}
 }
 
+/* Returns non-zero if every task holding one of the locks is
+ * runnable, which makes it worth spinning in the hope that the lock
+ * will be released shortly. A lock held by the current task through
+ * another handle will not be released while we spin on it.
+ */
 static int
-add_box_to_perfile(	lockbox_perfile *pf,
-			lockbox_box *b,
+lock_owners_running(	lockbox_box	*b,
+			uint32_t	locks)
+{
+	int	i;
+	int	running = 1;
+
+	spin_lock(&b->lkb_b_ownerlock);
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if ((locks & (1 << i)) &&
+		    (!b->lkb_b_lockowners[i] ||
+		     b->lkb_b_lockowners[i] == current ||
+		     b->lkb_b_lockowners[i]->state != TASK_RUNNING))
+		{
+			running = 0;
+			break;
+		}
+	}
+	spin_unlock(&b->lkb_b_ownerlock);
+	return running;
+}
+
+/* Returns the rt-mutex for lock type i on the box, with a reference
+ * held for the caller. Call with the box locked.
+ */
+static lockbox_pilock *
+get_pilock(	lockbox_box	*b,
+		int		i)
+{
+	lockbox_pilock *p = b->lkb_b_pilocks[i];
+
+	if (!p)
+	{
+		p = kmalloc(sizeof(lockbox_pilock), GFP_KERNEL);
+		if (!p)
+			return 0;
+		rt_mutex_init(&p->lkb_pl_mutex);
+		atomic_set(&p->lkb_pl_refs, 1);
+		p->lkb_pl_owner = 0;
+		b->lkb_b_pilocks[i] = p;
+	}
+	atomic_inc(&p->lkb_pl_refs);
+	return p;
+}
+
+/* Returns non-zero if the current task acquired all of the
+ * priority inheritance locks of the types in locks held through bu,
+ * and can therefore release their rt-mutexes. Call with the box
+ * locked.
+ */
+static int
+pi_locks_owned(	lockbox_box	*b,
+		lockbox_boxuse	*bu,
+		uint32_t	locks)
+{
+	int	i;
+
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if ((bu->lkb_bu_pi_held & locks & (1 << i)) &&
+		    b->lkb_b_lockowners[i] != current)
+			return 0;
+	}
+	return 1;
+}
+
+/* Release the rt-mutexes behind the priority inheritance locks of the
+ * types in locks held through bu. An rt-mutex can only be released by
+ * the task that owns it, so lkb_unlock and lkb_close refuse other
+ * tasks. When the vault file is closed by some other task the mutex is
+ * abandoned instead: the box gets a fresh one on next use, and tasks
+ * waiting on the old one notice when they next poll it. Call with the
+ * box locked, before the lock owners are cleared.
+ */
+static void
+release_pi_locks(	lockbox_box	*b,
+			lockbox_boxuse	*bu,
+			uint32_t	locks)
+{
+	int	i;
+
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		lockbox_pilock *p = b->lkb_b_pilocks[i];
+
+		if (!(bu->lkb_bu_pi_held & locks & (1 << i)) || !p)
+			continue;
+		if (b->lkb_b_lockowners[i] == current)
+		{
+			rt_mutex_unlock(&p->lkb_pl_mutex);
+		}
+		else
+		{
+			p->lkb_pl_owner = b->lkb_b_lockowners[i];
+			if (p->lkb_pl_owner)
+				get_task_struct(p->lkb_pl_owner);
+			b->lkb_b_pilocks[i] = 0;
+			put_pilock(p);
+		}
+	}
+	bu->lkb_bu_pi_held &= ~locks;
+}
+
+static uint32_t
+new_token(void)
+{
+	uint32_t token;
+
+	do
+	{
+		token = atomic_inc_return(&next_token) & LKB_FAST_TOKEN_MASK;
+	} while (!token);
+	return token;
+}
+
+/* Returns the lock types whose fast path lock words are held by a
+ * handle other than bu, or by any handle if bu is null. Words held
+ * through the kernel or marked for range locks are not counted; the
+ * box's lkb_b_userlocks and range list already account for those.
+ */
+static uint32_t
+fast_locks_held(	lockbox_box	*b,
+			lockbox_boxuse	*bu)
+{
+	lockbox_fastlock *f = ACCESS_ONCE(b->lkb_b_fast);
+	uint32_t held = 0;
+	int	i;
+
+	if (!f)
+		return 0;
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		uint32_t owner = ACCESS_ONCE(f->lkf_words[i]) & ~LKB_FAST_WAITERS;
+
+		if (owner &&
+		    owner != LKB_FAST_RANGES &&
+		    owner != LKB_FAST_KERNEL &&
+		    (!bu || owner != bu->lkb_bu_token))
+			held |= 1 << i;
+	}
+	return held;
+}
+
+/* Returns the whole box locks held through handles other than bu,
+ * whether they were taken through the kernel or the fast path.
+ */
+static uint32_t
+locks_held_by_others(	lockbox_box	*b,
+			lockbox_boxuse	*bu)
+{
+	return (ACCESS_ONCE(b->lkb_b_userlocks) & ~bu->lkb_bu_locks_held) |
+		fast_locks_held(b, bu);
+}
+
+/* Release the lock words for the lock types in mask that are held by
+ * bu, and return the lock types released. Call with the box locked.
+ */
+static uint32_t
+fast_release(	lockbox_box	*b,
+		lockbox_boxuse	*bu,
+		uint32_t	mask)
+{
+	lockbox_fastlock *f = b->lkb_b_fast;
+	uint32_t released = 0;
+	int	i;
+
+	if (!f)
+		return 0;
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		uint32_t *w = &f->lkf_words[i];
+		uint32_t old, owner, new;
+
+		if (!(mask & (1 << i)))
+			continue;
+		new = ((1 << i) == LKB_LOCK_DATA && b->lkb_b_ranges) ?
+			LKB_FAST_RANGES : 0;
+		do
+		{
+			old = ACCESS_ONCE(*w);
+			owner = old & ~LKB_FAST_WAITERS;
+			if (owner != bu->lkb_bu_token &&
+			    (owner != LKB_FAST_KERNEL ||
+			     !(bu->lkb_bu_locks_held & (1 << i))))
+				break;
+		} while (cmpxchg(w, old, new) != old);
+		if (owner == bu->lkb_bu_token ||
+		    (owner == LKB_FAST_KERNEL &&
+		     (bu->lkb_bu_locks_held & (1 << i))))
+			released |= 1 << i;
+	}
+	return released;
+}
+
+/* Set the lock words for the lock types in flags to bu's token.
+ * Returns zero, having claimed nothing, if a process took one of them
+ * through the fast path since the caller looked. Call with the box
+ * locked.
+ */
+static int
+fast_claim(	lockbox_box	*b,
+		lockbox_boxuse	*bu,
+		uint32_t	flags)
+{
+	lockbox_fastlock *f = b->lkb_b_fast;
+	uint32_t claimed = 0;
+	int	i;
+
+	if (!f)
+		return 1;
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		uint32_t *w = &f->lkf_words[i];
+
+		if (!(flags & (1 << i)))
+			continue;
+		while (1)
+		{
+			uint32_t old = ACCESS_ONCE(*w);
+			uint32_t owner = old & ~LKB_FAST_WAITERS;
+
+			if (owner == bu->lkb_bu_token)
+				break;
+			if (owner && owner != LKB_FAST_RANGES)
+			{
+				fast_release(b, bu, claimed);
+				return 0;
+			}
+			if (cmpxchg(w, old, bu->lkb_bu_token | (old & LKB_FAST_WAITERS)) == old)
+			{
+				claimed |= 1 << i;
+				break;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Mark the lock words for the lock types in busy as having waiters,
+ * so that the processes holding them come into the kernel to release
+ * them and wake us. Returns zero if one of them has been released in
+ * the meantime, in which case the caller should look again rather
+ * than sleep.
+ */
+static int
+fast_mark_waiters(	lockbox_box	*b,
+			lockbox_boxuse	*bu,
+			uint32_t	busy)
+{
+	lockbox_fastlock *f = b->lkb_b_fast;
+	int	i;
+
+	if (!f)
+		return 1;
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		uint32_t *w = &f->lkf_words[i];
+
+		if (!(busy & (1 << i)))
+			continue;
+		while (1)
+		{
+			uint32_t old = ACCESS_ONCE(*w);
+			uint32_t owner = old & ~LKB_FAST_WAITERS;
+
+			if (!owner)
+				return 0;
+			if (owner == LKB_FAST_RANGES ||
+			    owner == LKB_FAST_KERNEL ||
+			    (bu && owner == bu->lkb_bu_token) ||
+			    (old & LKB_FAST_WAITERS) ||
+			    cmpxchg(w, old, old | LKB_FAST_WAITERS) == old)
+				break;
+		}
+	}
+	return 1;
+}
+
+/* Mark the data lock word while range locks are held, so that the
+ * fast path cannot take the whole box data lock over them. Returns
+ * zero if another handle holds the data lock. Call with the box
+ * locked.
+ */
+static int
+fast_claim_ranges(	lockbox_box	*b,
+			lockbox_boxuse	*bu)
+{
+	lockbox_fastlock *f = b->lkb_b_fast;
+	uint32_t *w;
+
+	if (!f)
+		return 1;
+	w = &f->lkf_words[0];
+	while (1)
+	{
+		uint32_t old = ACCESS_ONCE(*w);
+		uint32_t owner = old & ~LKB_FAST_WAITERS;
+
+		if (owner == LKB_FAST_RANGES ||
+		    owner == bu->lkb_bu_token ||
+		    (owner == LKB_FAST_KERNEL &&
+		     (bu->lkb_bu_locks_held & LKB_LOCK_DATA)))
+			return 1;
+		if (owner)
+			return 0;
+		if (cmpxchg(w, old, LKB_FAST_RANGES | (old & LKB_FAST_WAITERS)) == old)
+			return 1;
+	}
+}
+
+/* Clear the range lock marker once the last range lock has gone.
+ * Call with the box locked.
+ */
+static void
+fast_drop_ranges(lockbox_box *b)
+{
+	lockbox_fastlock *f = b->lkb_b_fast;
+	uint32_t old;
+
+	if (!f || b->lkb_b_ranges)
+		return;
+	do
+	{
+		old = ACCESS_ONCE(f->lkf_words[0]);
+		if ((old & ~LKB_FAST_WAITERS) != LKB_FAST_RANGES)
+			return;
+	} while (cmpxchg(&f->lkf_words[0], old, 0) != old);
+}
+
+/* Start an event of the given type, stamped with the current time */
+static void
+init_event(	lockbox_event	*e,
+		uint32_t	type,
+		uint32_t	shelf)
+{
+	memset(e, 0, sizeof(*e));
+	e->le_type = type;
+	e->le_shelf = shelf;
+	e->le_id = LOCKBOX_ERROR;
+	e->le_time = ktime_to_ns(ktime_get());
+}
+
+/* Queue an event for reading from the file descriptor of pf, or count
+ * it as lost if the queue is full. This may be called with box and
+ * shelf locks held, so it cannot sleep.
+ */
+static void
+queue_event(	lockbox_perfile	*pf,
+		lockbox_event const *e,
+		char const	*name)
+{
+	lockbox_eventqueue *q = &pf->lkb_pf_events;
+	lockbox_pendingevent *pe = 0;
+
+	if (q->lkb_eq_count < LKB_EVENT_QUEUE_MAX)
+		pe = kmalloc(sizeof(lockbox_pendingevent) + e->le_namesize, GFP_ATOMIC);
+	spin_lock(&q->lkb_eq_lock);
+	if (!pe || q->lkb_eq_count >= LKB_EVENT_QUEUE_MAX)
+	{
+		++q->lkb_eq_lost;
+	}
+	else
+	{
+		pe->lkb_pe_next = 0;
+		pe->lkb_pe_event = *e;
+		memcpy(pe->lkb_pe_name, name, e->le_namesize);
+		if (q->lkb_eq_tail)
+			q->lkb_eq_tail->lkb_pe_next = pe;
+		else
+			q->lkb_eq_head = pe;
+		q->lkb_eq_tail = pe;
+		++q->lkb_eq_count;
+		pe = 0;
+	}
+	spin_unlock(&q->lkb_eq_lock);
+	if (pe)
+		kfree(pe);
+	wake_up_interruptible(&q->lkb_eq_waitq);
+}
+
+/* Tell the watchers of a shelf that the box b has been created or
+ * destroyed. Call with the shelf locked, so that the events for a
+ * box come out in order.
+ */
+static void
+shelf_event(	lockbox_vault	*v,
+		lockbox_box	*b,
+		uint32_t	type)
+{
+	lockbox_watch *w;
+	lockbox_event e;
+
+	if (!v->lkb_v_watches)
+		return;
+	init_event(&e, type, b->lkb_b_shelf);
+	e.le_namesize = strlen(b->lkb_b_name) + 1;
+	spin_lock(&v->lkb_v_watchlock);
+	for (w = v->lkb_v_watches; w; w = w->lkb_w_next)
+	{
+		if (w->lkb_w_shelf == b->lkb_b_shelf && (w->lkb_w_events & type))
+			queue_event(w->lkb_w_pf, &e, b->lkb_b_name);
+	}
+	spin_unlock(&v->lkb_v_watchlock);
+}
+
+static int
+lockbox_watch_shelf(	lockbox_perfile	*pf,
+			uint32_t	shelfid,
+			uint32_t	events)
+{
+	lockbox_vault *v = pf->lkb_pf_vault;
+	lockbox_watch *w = 0;
+	lockbox_watch **ploc;
+
+	if (!v)
+		return -EINVAL;
+	if (events & ~LKB_EVENT_SHELF)
+		return -EINVAL;
+	if (events)
+	{
+		w = kmalloc(sizeof(lockbox_watch), GFP_KERNEL);
+		if (!w)
+			return -ENOMEM;
+		w->lkb_w_pf = pf;
+		w->lkb_w_shelf = shelfid;
+		w->lkb_w_events = events;
+	}
+
+	spin_lock(&v->lkb_v_watchlock);
+	for (ploc = &v->lkb_v_watches; *ploc; ploc = &(*ploc)->lkb_w_next)
+	{
+		if ((*ploc)->lkb_w_pf == pf && (*ploc)->lkb_w_shelf == shelfid)
+			break;
+	}
+	if (*ploc && w)
+	{
+		(*ploc)->lkb_w_events = events;
+	}
+	else if (*ploc)
+	{
+		w = *ploc;
+		*ploc = w->lkb_w_next;
+	}
+	else if (w)
+	{
+		w->lkb_w_next = 0;
+		*ploc = w;
+		w = 0;
+	}
+	spin_unlock(&v->lkb_v_watchlock);
+	if (w)
+		kfree(w);
+	return 0;
+}
+
+/* Stop all of the shelf watches of pf */
+static void
+unwatch_shelves(lockbox_perfile *pf)
+{
+	lockbox_vault *v = pf->lkb_pf_vault;
+	lockbox_watch **ploc;
+	lockbox_watch *gone = 0;
+
+	spin_lock(&v->lkb_v_watchlock);
+	ploc = &v->lkb_v_watches;
+	while (*ploc)
+	{
+		lockbox_watch *w = *ploc;
+
+		if (w->lkb_w_pf == pf)
+		{
+			*ploc = w->lkb_w_next;
+			w->lkb_w_next = gone;
+			gone = w;
+		}
+		else
+		{
+			ploc = &w->lkb_w_next;
+		}
+	}
+	spin_unlock(&v->lkb_v_watchlock);
+	while (gone)
+	{
+		lockbox_watch *w = gone;
+
+		gone = w->lkb_w_next;
+		kfree(w);
+	}
+}
+
+/* Tell the handles watching b about a change to it. Call with the box
+ * locked.
+ */
+static void
+box_event(	lockbox_box	*b,
+		uint32_t	type,
+		uint64_t	value)
+{
+	lockbox_boxwatch *w;
+	lockbox_event e;
+
+	if (!b->lkb_b_watches)
+		return;
+	init_event(&e, type, b->lkb_b_shelf);
+	e.le_value = value;
+	for (w = b->lkb_b_watches; w; w = w->lkb_bw_next)
+	{
+		if (w->lkb_bw_events & type)
+		{
+			e.le_id = w->lkb_bw_id;
+			queue_event(w->lkb_bw_pf, &e, 0);
+		}
+	}
+}
+
+/* Report the state of b changing to state. Call with the box locked,
+ * before storing the new state.
+ */
+static void
+state_events(	lockbox_box	*b,
+		uint32_t	state)
+{
+	if (state & ~b->lkb_b_state)
+		box_event(b, LKB_EVENT_STATE_SET, state);
+	if (b->lkb_b_state & ~state)
+		box_event(b, LKB_EVENT_STATE_CLEARED, state);
+}
+
+/* Queue flush_box_wakeups to deliver the wakeups in what, and any
+ * state changes, once the coalescing window of b has passed. The
+ * queued flush holds the box and its vault. Call with the box locked.
+ */
+static void
+defer_wakeups(	lockbox_box	*b,
+		uint32_t	what)
+{
+	b->lkb_b_deferred |= what;
+	if (!(b->lkb_b_deferred & LKB_DEFER_QUEUED) &&
+	    (b->lkb_b_deferred || b->lkb_b_changed))
+	{
+		b->lkb_b_deferred |= LKB_DEFER_QUEUED;
+		++b->lkb_b_holders;
+		hold_vault(b->lkb_b_vault);
+		schedule_delayed_work(&b->lkb_b_flush,
+				      msecs_to_jiffies(min_t(uint32_t,
+							     b->lkb_b_coalesce,
+							     coalesce_max_msecs)));
+	}
+}
+
+/* Change the state of b to state and report it to the box's watchers.
+ * Returns nonzero if the caller should take a holder and wake the
+ * box's sleepers once it has unlocked the box. If the box has a
+ * coalescing window the wakeup and LKB_EVENT_STATE_CHANGES event are
+ * deferred to flush_box_wakeups instead. Call with the box locked.
+ */
+static int
+change_state(	lockbox_box	*b,
+		uint32_t	state)
+{
+	int	wake = state_change_wakes(b, state);
+	uint32_t set = state & ~b->lkb_b_state;
+	int	bit;
+
+	state_events(b, state);
+	if (state != b->lkb_b_state)
+		++b->lkb_b_stateseq;
+	for (bit = 0; set; ++bit, set >>= 1)
+	{
+		if (set & 1)
+			++b->lkb_b_setcounts[bit];
+	}
+	if (b->lkb_b_coalesce)
+	{
+		b->lkb_b_changed |= b->lkb_b_state ^ state;
+		defer_wakeups(b, wake ? LKB_DEFER_WAKE : 0);
+		wake = 0;
+	}
+	else if (state != b->lkb_b_state)
+	{
+		box_event(b,
+			  LKB_EVENT_STATE_CHANGES,
+			  ((uint64_t) (b->lkb_b_state ^ state) << 32) | state);
+	}
+	b->lkb_b_state = state;
+	return wake;
+}
+
+/* Drop the watches and eventfd binding that bu has on its box. Call
+ * with the box locked.
+ */
+static void
+unwatch_box(	lockbox_box	*b,
+		lockbox_boxuse	*bu)
+{
+	lockbox_boxwatch **ploc = &b->lkb_b_watches;
+	lockbox_eventfd **peloc = &b->lkb_b_eventfds;
+
+	while (*ploc)
+	{
+		lockbox_boxwatch *w = *ploc;
+
+		if (w->lkb_bw_bu == bu)
+		{
+			*ploc = w->lkb_bw_next;
+			kfree(w);
+		}
+		else
+		{
+			ploc = &w->lkb_bw_next;
+		}
+	}
+	for (; *peloc; peloc = &(*peloc)->lkb_ef_next)
+	{
+		lockbox_eventfd *ef = *peloc;
+
+		if (ef->lkb_ef_bu == bu)
+		{
+			*peloc = ef->lkb_ef_next;
+			eventfd_ctx_put(ef->lkb_ef_ctx);
+			kfree(ef);
+			break;
+		}
+	}
+}
+
+static void
+clean_box_holder(lockbox_vault *v,
+		lockbox_box *b)
+{
+	int need_free;
+
+	down(&b->lkb_b_lock);
+	need_free = (!--b->lkb_b_holders &&
+		     !b->lkb_b_users);
+	up(&b->lkb_b_lock);
+	if (need_free)
+	{
+		lockbox_shelf *s;
+
+		find_shelf(v, b->lkb_b_shelf, 0, &s, 0);
+		down(&s->lkb_s_lock);
+		down(&b->lkb_b_lock);
+		if (!b->lkb_b_users && !b->lkb_b_holders)
+		{
+			lockbox_box **ploc;
+
+			for (ploc = &s->lkb_s_boxlist;
+			     *ploc;
+			     ploc = &(*ploc)->lkb_b_next)
+			{
+				if (b == *ploc)
+				{
+					*ploc = b->lkb_b_next;
+					break;
+				}
+			}
+			shelf_event(v, b, LKB_EVENT_DESTROYED);
+		}
+		else
+		{
+			need_free = 0;
+		}
+		up(&b->lkb_b_lock);
+		up(&s->lkb_s_lock);
+		if (need_free)
+		{
+			/* Counter adds look at whatever box a handle names
+			 * before they know its type, so any box may still
+			 * be in use by one.
+			 */
+			synchronize_rcu();
+			free_box(b);
+		}
+	}
+}
+
+static void
+release_box(	lockbox_vault *v,
+		lockbox_box *b,
+		lockbox_boxuse *bu)
+{
+	struct page *page;
+	int	clean;
+	uint32_t locks = bu ? bu->lkb_bu_locks_held : 0;
+	uint32_t released = locks;
+
+	down(&b->lkb_b_lock);
+	clean = !--b->lkb_b_users;
+	++b->lkb_b_holders;
+	if (bu)
+	{
+		unwatch_box(b, bu);
+
+		/* Locks taken through the fast path die with the handle */
+		released |= fast_release(b, bu, LKB_LOCK_ALL);
+		release_pi_locks(b, bu, LKB_LOCK_ALL);
+		page = xchg(&bu->lkb_bu_fastpage, 0);
+		if (page)
+			put_page(page);
+	}
+	box_event(b, LKB_EVENT_USERS, b->lkb_b_users);
+	if (released)
+		box_event(b, LKB_EVENT_UNLOCKED, released);
+	b->lkb_b_userlocks &= ~ locks;
+	clear_lock_owners(b, locks);
+	if (released & LKB_LOCK_DATA)
+		wake_range_waiters(b, 0, ~(uint32_t) 0);
+	if (bu)
+	{
+		release_ranges(b, bu);
+		fast_drop_ranges(b);
+		if (b->lkb_b_sem)
+			release_semaphore(b->lkb_b_sem, bu);
+	}
+	up(&b->lkb_b_lock);
+
+	wake_box_sleepers(b, clean);
+
+	/* Queue waiters sleep exclusively, so wake them all to let any
+	 * that were waiting through this handle find out it has gone.
+	 */
+	if (b->lkb_b_queue)
+	{
+		wake_up_all(&b->lkb_b_queue->lkb_q_popq);
+		wake_up_all(&b->lkb_b_queue->lkb_q_pushq);
+	}
+	if (b->lkb_b_log)
+		wake_up_all(&b->lkb_b_log->lkb_l_waitq);
+	clean_box_holder(v, b);
+}
+
+/* Deliver the wakeups and state changes held back by defer_wakeups */
+static void
+flush_box_wakeups(struct work_struct *work)
+{
+	lockbox_box *b = container_of(work, lockbox_box, lkb_b_flush.work);
+	lockbox_vault *v = b->lkb_b_vault;
+	uint32_t deferred;
+
+	down(&b->lkb_b_lock);
+	deferred = b->lkb_b_deferred;
+	b->lkb_b_deferred = 0;
+	if (b->lkb_b_changed)
+	{
+		box_event(b,
+			  LKB_EVENT_STATE_CHANGES,
+			  ((uint64_t) b->lkb_b_changed << 32) | b->lkb_b_state);
+		b->lkb_b_changed = 0;
+	}
+	if (deferred & LKB_DEFER_DATA)
+	{
+		wake_up_all(&b->lkb_b_datawaitq);
+		if (b->lkb_b_eventfds && !(deferred & LKB_DEFER_WAKE))
+			signal_eventfds(b, 0);
+	}
+	up(&b->lkb_b_lock);
+
+	if (deferred & LKB_DEFER_WAKE)
+		wake_box_sleepers(b, 0);
+	clean_box_holder(v, b);
+	release_vault(v);
+}
+
+static void
+free_perfile(lockbox_perfile *pf)
+{
+	int	i;
+	lockbox_boxlist *l, *n;
+	lockbox_pendingevent *pe;
+
+	if (pf->lkb_pf_vault)
+	{
+		unwatch_shelves(pf);
+		for (i = 0; i < IN_PERFILE_BOXES; ++i)
+		{
+			if (pf->lkb_pf_boxes[i].lkb_bu_box)
+				release_box(pf->lkb_pf_vault,
+					    pf->lkb_pf_boxes[i].lkb_bu_box,
+					    pf->lkb_pf_boxes + i);
+			if (pf->lkb_pf_boxes[i].lkb_bu_groups)
+				put_group_info(pf->lkb_pf_boxes[i].lkb_bu_groups);
+		}
+		for (l = pf->lkb_pf_boxlist; l; l = n)
+		{
+			n = l->lkb_bl_next;
+	
+			for (i = 0; i < IN_BOXLIST_BOXES; ++i)
+			{
+				if (l->lkb_bl_boxes[i].lkb_bu_box)
+					release_box(pf->lkb_pf_vault,
+						    l->lkb_bl_boxes[i].lkb_bu_box,
+						    l->lkb_bl_boxes + i);
+				if (l->lkb_bl_boxes[i].lkb_bu_groups)
+					put_group_info(l->lkb_bl_boxes[i].lkb_bu_groups);
+			}
+			kfree(l);
+		}
+
+		/* The boxes need the vault until they are released */
+		release_vault(pf->lkb_pf_vault);
+	}
+	while ((pe = pf->lkb_pf_events.lkb_eq_head) != 0)
+	{
+		pf->lkb_pf_events.lkb_eq_head = pe->lkb_pe_next;
+		kfree(pe);
+	}
+	kfree(pf);
+}
+
+static void
+reset_boxuse_selects(lockbox_boxuse *bu)
+{
+	bu->lkb_bu_select_users_lt = LKB_SELECT_DISABLE_USERS_LT;
+	bu->lkb_bu_select_users_gt = LKB_SELECT_DISABLE_USERS_GT;
+	bu->lkb_bu_select_flags = 0;
+	bu->lkb_bu_select_wantlock = 0;
+	bu->lkb_bu_select_messages = 0;
+	bu->lkb_bu_select_log = 0;
+	bu->lkb_bu_select_data = 0;
+	bu->lkb_bu_select_all = 0;
+	bu->lkb_bu_select_cmpop = 0;
+}
+
+static void
+set_boxuse(	lockbox_boxuse *bu,
+		lockbox_box *b)
+{
+	/* Counter adds look at the slot without lkb_pf_lock, so forget
+	 * what was cached for the last box before the new one shows.
+	 */
+	++bu->lkb_bu_wseq;
+	smp_wmb();
+	bu->lkb_bu_aclgen = 0;
+	smp_wmb();
+	++bu->lkb_bu_wseq;
+	smp_wmb();
+	bu->lkb_bu_box = b;
+	bu->lkb_bu_token = new_token();
+	bu->lkb_bu_cursor = b->lkb_b_log ? log_oldest(b->lkb_b_log) : 0;
+	bu->lkb_bu_semheld = 0;
+	reset_boxuse_selects(bu);
+}
+
+static int
+add_box_to_perfile(	lockbox_perfile *pf,
+			lockbox_box *b,
 			int	prelocked)
 {
-	int status = 0;
-	int found = 0;
+	int status = 0;
+	int found = 0;
+
+	if (prelocked)
+		status = 0;
+	else
+		status = down_interruptible(&pf->lkb_pf_lock);
+	if (status >= 0)
+	{
+		int	i;
+
+		for (i = 0; i < IN_PERFILE_BOXES; ++i)
+		{
+			if (!pf->lkb_pf_boxes[i].lkb_bu_box)
+			{
+				set_boxuse(pf->lkb_pf_boxes + i, b);
+				status = i;
+				found = 1;
+				break;
+			}
+		}
+		if (!found)
+		{
+			lockbox_boxlist **bl = &pf->lkb_pf_boxlist;
+			int	offset = IN_PERFILE_BOXES;
+
+			while (*bl)
+			{
+				for (i = 0; i < IN_BOXLIST_BOXES; ++i)
+				{
+					if (!(*bl)->lkb_bl_boxes[i].lkb_bu_box)
+					{
+						set_boxuse((*bl)->lkb_bl_boxes + i, b);
+						status = offset + i;
+						found = 1;
+						break;
+					}
+				}
+				if (found)
+					break;
+				bl = &(*bl)->lkb_bl_next;
+				offset += IN_BOXLIST_BOXES;
+			}
+
+			if (!found)
+			{
+				lockbox_boxlist *newbl = kmalloc(sizeof(lockbox_boxlist), GFP_KERNEL);
+
+				if (newbl)
+				{
+					memset(newbl, 0, sizeof(lockbox_boxlist));
+					status = offset;
+					set_boxuse(newbl->lkb_bl_boxes, b);
+					rcu_assign_pointer(*bl, newbl);
+				}
+				else
+				{
+					status = -ENOMEM;
+				}
+			}
+		}
+		if (!prelocked)
+			up(&pf->lkb_pf_lock);
+	}
+
+	if (status < 0)
+		release_box(pf->lkb_pf_vault, b, 0);
+	return status;
+}
+
+static int
+lockbox_access_ok(	lockbox_acl const *acl,
+			int		flag)
+{
+	int	i;
+
+	for (i = 0; i < acl->la_header.lah_n_entries; ++i)
+	{
+		if ((acl->la_entries[i].lae_access & flag) != flag)
+			continue;
+		switch (acl->la_entries[i].lae_idtype)
+		{
+		case LKB_IDTYPE_USER:
+			if (acl->la_entries[i].lae_id != current_euid())
+				continue;
+			break;
+
+		case LKB_IDTYPE_GROUP:
+			if (!in_egroup_p(acl->la_entries[i].lae_id))
+				continue;
+			break;
+
+		case LKB_IDTYPE_WORLD:
+			break;
+
+		case LKB_IDTYPE_PROCESS:
+			if (acl->la_entries[i].lae_id != current->tgid)
+				continue;
+			break;
+
+		default:
+			continue;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int
+lockbox_create_new(	lockbox_perfile *pf,
+			uint32_t	shelfid,
+			char const	*name,
+			void const	*data,
+			size_t		size,
+			lockbox_acl const *acl,
+			uint32_t	type,
+			uint32_t	capacity)
+{
+	lockbox_box **b;
+	lockbox_vault *v = pf->lkb_pf_vault;
+	lockbox_shelf *s;
+	char	*kname;
+	int	status;
+
+	if (!v)
+		return -EINVAL;
+	if (type > LKB_TYPE_SEMAPHORE ||
+	    (type != LKB_TYPE_DATA && !capacity) ||
+	    (type == LKB_TYPE_LOG && capacity > LKB_LOG_MAX) ||
+	    (type == LKB_TYPE_MAP && capacity > LKB_MAP_MAX) ||
+	    (type == LKB_TYPE_COUNTER && capacity > LKB_COUNTER_MAX) ||
+	    (type == LKB_TYPE_SEMAPHORE && capacity > LKB_SEMAPHORE_MAX))
+		return -EINVAL;
+	status = find_shelf(v, shelfid, 1, &s, 1);
+	if (status < 0)
+		return status;
+	if (name)
+	{
+		status = get_user_string(name, &kname);
+		if (status >= 0 && !*kname)
+		{
+			/* Empty strings not allowed */
+			kfree(kname);
+			return -EINVAL;
+		}
+	}
+	if (!name)
+	{
+		kname = kmalloc(10, GFP_KERNEL);
+		if (!kname)
+			return -ENOMEM;
+		*kname = 0;
+	}
+	if (status >= 0)
+	{
+		status = down_interruptible(&s->lkb_s_lock);
+
+		if (status >= 0)
+		{
+			b = &s->lkb_s_boxlist;
+			if (!*kname)
+				sprintf(kname, "#%08x", s->lkb_s_seqno++);
+
+			while (1)
+			{
+				if (!*b)
+				{
+					/* We have reached the end of the list, so
+					 * this name is OK to create
+					 */
+					status = new_box(kname, data, size, acl, shelfid, type, capacity, b);
+					/* new_box takes ownership of kname, succeed or fail */
+					kname = 0;
+					if (status >= 0)
+					{
+						(*b)->lkb_b_vault = v;
+						shelf_event(v, *b, LKB_EVENT_CREATED);
+					}
+					break;
+				}
+				else if (strcmp((*b)->lkb_b_name, kname))
+				{
+					/* This name doesn't match, move on to the
+					 * next one.
+					 */
+					b = &(*b)->lkb_b_next;
+				}
+				else if (unlikely(!name))
+				{
+					/* We're generating a name, but we've wrapped
+					 * around and encountered this generated name.
+					 * Move to the next sequence number and try
+					 * again.
+					 */
+					sprintf(kname, "#%08x", s->lkb_s_seqno++);
+					b = &s->lkb_s_boxlist;
+				}
+				else
+				{
+					/* The user-supplied name already exists */
+					status = -EEXIST;
+					break;
+				}
+			}
+			up(&s->lkb_s_lock);
+			/* Now we have created the lockbox on the shelf, we need to
+			 * put it in the perfile's list
+			 */
+			if (status >= 0)
+				status = add_box_to_perfile(pf, *b, 0);
+		}
+		if (kname)
+			kfree(kname);
+	}
+	return status;
+}
+
+static int
+lockbox_open_existing(	lockbox_perfile *pf,
+			uint32_t	shelfid,
+			char const	*name)
+{
+	int	status;
+	lockbox_shelf *s;
+	lockbox_vault *v = pf->lkb_pf_vault;
+	char	*kname;
+
+	if (!v)
+		return -EINVAL;
+	if (!name)
+		return -EINVAL;
+	status = find_shelf(v, shelfid, 1, &s, 0);
+	if (status < 0)
+		return status;
+	status = get_user_string(name, &kname);
+	if (status >= 0)
+	{
+		status = down_interruptible(&s->lkb_s_lock);
+
+		if (status >= 0)
+		{
+			lockbox_box *b;
+
+			status = -ENOENT;
+
+			for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
+			{
+				if (!strcmp(b->lkb_b_name, kname))
+				{
+					status = down_interruptible(&b->lkb_b_lock);
+					if (status >= 0)
+					{
+						if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_OPEN))
+						{
+							status = -EPERM;
+						}
+						else
+						{
+							++b->lkb_b_users;
+							status = add_box_to_perfile(pf, b, 0);
+							if (status >= 0)
+							{
+								++b->lkb_b_holders;
+								box_event(b, LKB_EVENT_USERS, b->lkb_b_users);
+							}
+							else
+							{
+								--b->lkb_b_users;
+							}
+						}
+						up(&b->lkb_b_lock);
+					}
+					break;
+				}
+			}
+
+			up(&s->lkb_s_lock);
+
+			if (status >= 0)
+			{
+				wake_box_sleepers(b, 0);
+				clean_box_holder(v, b);
+			}
+		}
+		kfree(kname);
+	}
+	return status;
+}
+
+static int
+lockbox_find_box(lockbox_perfile *pf,
+		lockbox_t id,
+		lockbox_boxuse **bu)
+{
+	int	status = -ENOENT;
+
+	if (id < IN_PERFILE_BOXES)
+	{
+		if (pf->lkb_pf_boxes[id].lkb_bu_box)
+		{
+			*bu = pf->lkb_pf_boxes + id;
+			status = 0;
+		}
+	}
+	else
+	{
+		lockbox_boxlist *bl;
+		status = -ENOENT;
+
+		id -= IN_PERFILE_BOXES;
+
+		for (bl = rcu_dereference(pf->lkb_pf_boxlist);
+		     bl;
+		     bl = rcu_dereference(bl->lkb_bl_next))
+		{
+			if (id < IN_BOXLIST_BOXES)
+			{
+				if (bl->lkb_bl_boxes[id].lkb_bu_box)
+				{
+					*bu = bl->lkb_bl_boxes + id;
+					status = 0;
+				}
+				break;
+			}
+			id -= IN_BOXLIST_BOXES;
+		}
+	}
+	return status;
+}
+
+/* Returns non-zero unless bu holds priority inheritance locks taken
+ * by another task, whose rt-mutexes the caller could not release.
+ */
+static int
+may_close_handle(lockbox_boxuse *bu)
+{
+	lockbox_box *b = bu->lkb_bu_box;
+	int	ok;
+
+	if (!bu->lkb_bu_pi_held)
+		return 1;
+	down(&b->lkb_b_lock);
+	ok = pi_locks_owned(b, bu, LKB_LOCK_ALL);
+	up(&b->lkb_b_lock);
+	return ok;
+}
+
+static int
+lockbox_close_box(	lockbox_perfile *pf,
+			lockbox_t	id)
+{
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		if (!may_close_handle(bu))
+			status = -EPERM;
+	}
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		bu->lkb_bu_box = 0;
+		release_box(pf->lkb_pf_vault, b, bu);
+		status = 0;
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Set the bit for id in the caller's bitmap of closed handles, if the
+ * bitmap covers it. The bitmap was cleared before any handle was
+ * closed, so this can only fail if the caller unmaps it meanwhile,
+ * and the handles are closed either way.
+ */
+static void
+mark_closed(	uint32_t	*closed,
+		uint32_t	nbits,
+		uint32_t	id)
+{
+	uint32_t word;
+
+	if (!closed || id >= nbits)
+		return;
+	if (!get_user(word, closed + id / 32))
+		put_user(word | (1U << (id % 32)), closed + id / 32);
+}
+
+/* Close every handle of pf to a box on the given shelf, returning the
+ * number closed. The ids of the handles closed are set in the first
+ * nbits bits of closed, so the library knows which fast paths to drop.
+ * As with lockbox_close_box, handles holding priority inheritance
+ * locks of another task are left open.
+ */
+static int
+lockbox_close_shelf(	lockbox_perfile *pf,
+			uint32_t	shelfid,
+			uint32_t	*closed,
+			uint32_t	nbits)
+{
+	lockbox_boxlist *bl;
+	lockbox_boxuse *bu;
+	uint32_t base;
+	int	nclosed = 0;
+	int	i;
+	int	status;
+
+	/* Fail before anything is closed if the bitmap cannot be written */
+	if (closed)
+	{
+		size_t	size = ((size_t) nbits + 31) / 32 * sizeof(uint32_t);
+
+		if (!access_ok(VERIFY_WRITE, closed, size) ||
+		    clear_user(closed, size))
+			return -EFAULT;
+	}
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+	if (status < 0)
+		return status;
+
+	for (i = 0, bu = pf->lkb_pf_boxes; i < IN_PERFILE_BOXES; ++i, ++bu)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		if (b && b->lkb_b_shelf == shelfid && may_close_handle(bu))
+		{
+			bu->lkb_bu_box = 0;
+			release_box(pf->lkb_pf_vault, b, bu);
+			mark_closed(closed, nbits, i);
+			++nclosed;
+		}
+	}
+	for (bl = pf->lkb_pf_boxlist, base = IN_PERFILE_BOXES;
+	     bl;
+	     bl = bl->lkb_bl_next, base += IN_BOXLIST_BOXES)
+	{
+		for (i = 0, bu = bl->lkb_bl_boxes; i < IN_BOXLIST_BOXES; ++i, ++bu)
+		{
+			lockbox_box *b = bu->lkb_bu_box;
+
+			if (b && b->lkb_b_shelf == shelfid && may_close_handle(bu))
+			{
+				bu->lkb_bu_box = 0;
+				release_box(pf->lkb_pf_vault, b, bu);
+				mark_closed(closed, nbits, base + i);
+				++nclosed;
+			}
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return nclosed;
+}
+
+static int
+lockbox_size(	lockbox_perfile *pf,
+		lockbox_t	id)
+{
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+				status = -EPERM;
+			else
+				status = b->lkb_b_size;
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_get_data(lockbox_perfile *pf,
+		lockbox_t	id,
+		char		*buffer,
+		size_t		size,
+		off_t		offset,
+		uint64_t	*version)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	if (offset < 0)
+		return -EINVAL;
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			{
+				status = -EPERM;
+			}
+			else if (version && *version == b->lkb_b_version)
+			{
+				/* The caller already has this version */
+				status = -EALREADY;
+			}
+			else if (offset >= b->lkb_b_size)
+			{
+				status = 0;
+			}
+			else
+			{
+				if (offset + size > b->lkb_b_size)
+					size = b->lkb_b_size - offset;
+				if (copy_to_user(buffer, b->lkb_b_data + offset, size))
+					status = -EFAULT;
+				else
+					status = size;
+			}
+			if (version && status >= 0)
+				*version = b->lkb_b_version;
+			if (status >= 0 || status == -EALREADY)
+				bu->lkb_bu_seenversion = b->lkb_b_version;
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_get_version(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint64_t	*version)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				*version = b->lkb_b_version;
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Copy the data changed in the box since version since to buffer as
+ * a list of extents, each a lockbox_delta_extent followed by its bytes
+ * padded to LKB_DELTA_SIZE. Overlapping and adjacent changes are
+ * merged. Fails with ESTALE when the box no longer remembers every
+ * change since that version, in which case the caller must read the
+ * whole box again.
+ */
+static int
+lockbox_get_delta(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char		*buffer,
+			size_t		size,
+			uint64_t	*version,
+			size_t		*sizeneeded)
+{
+	lockbox_boxuse *bu;
+	lockbox_delta_extent *ext;
+	int status;
+
+	ext = kmalloc(sizeof(lockbox_delta_extent) * LKB_DIRTY_HISTORY, GFP_KERNEL);
+	if (!ext)
+		return -ENOMEM;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+	{
+		kfree(ext);
+		return status;
+	}
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			uint64_t since = *version;
+
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			{
+				status = -EPERM;
+			}
+			else if (since > b->lkb_b_version)
+			{
+				status = -EINVAL;
+			}
+			else if (since < b->lkb_b_dirtybase)
+			{
+				status = -ESTALE;
+			}
+			else
+			{
+				int	n = 0;
+				int	i, j;
+				size_t	needed = 0;
+
+				/* Collect the changes sorted by offset,
+				 * merging as we go.
+				 */
+				for (i = 0; i < b->lkb_b_ndirty; ++i)
+				{
+					lockbox_dirty *d = b->lkb_b_dirty + i;
+					uint32_t start = d->lkb_d_offset;
+					uint32_t end = start + d->lkb_d_size;
+
+					if (d->lkb_d_version <= since || !d->lkb_d_size)
+						continue;
+					for (j = 0; j < n && ext[j].lde_offset + ext[j].lde_size < start; ++j)
+						;
+					if (j < n && ext[j].lde_offset <= end)
+					{
+						/* Absorb every extent it touches */
+						int k = j;
+
+						while (k < n && ext[k].lde_offset <= end)
+						{
+							if (ext[k].lde_offset < start)
+								start = ext[k].lde_offset;
+							if (ext[k].lde_offset + ext[k].lde_size > end)
+								end = ext[k].lde_offset + ext[k].lde_size;
+							++k;
+						}
+						memmove(ext + j + 1, ext + k, (n - k) * sizeof(*ext));
+						n -= k - j - 1;
+					}
+					else
+					{
+						memmove(ext + j + 1, ext + j, (n - j) * sizeof(*ext));
+						++n;
+					}
+					ext[j].lde_offset = start;
+					ext[j].lde_size = end - start;
+				}
+				for (i = 0; i < n; ++i)
+					needed += LKB_DELTA_SIZE(ext[i].lde_size);
+				*sizeneeded = needed;
+				if (size < needed)
+					status = -ENOMEM;
+				for (i = 0; i < n && status >= 0; ++i)
+				{
+					size_t	pad = LKB_DELTA_SIZE(ext[i].lde_size) -
+						      sizeof(lockbox_delta_extent) -
+						      ext[i].lde_size;
+
+					if (copy_to_user(buffer, ext + i, sizeof(lockbox_delta_extent)) ||
+					    copy_to_user(buffer + sizeof(lockbox_delta_extent),
+							 b->lkb_b_data + ext[i].lde_offset,
+							 ext[i].lde_size) ||
+					    clear_user(buffer + LKB_DELTA_SIZE(ext[i].lde_size) - pad,
+						       pad))
+						status = -EFAULT;
+					buffer += LKB_DELTA_SIZE(ext[i].lde_size);
+				}
+				if (status >= 0)
+				{
+					*version = b->lkb_b_version;
+					bu->lkb_bu_seenversion = b->lkb_b_version;
+					status = needed;
+				}
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	kfree(ext);
+	return status;
+}
+
+/* Give the box a new version for a change to size bytes at offset in
+ * its data, remember the change for lkb_getdelta, and wake anybody
+ * selecting on data changes. Call with the box locked.
+ */
+static void
+note_data_change(	lockbox_box	*b,
+			uint32_t	offset,
+			uint32_t	size)
+{
+	lockbox_dirty *d;
+
+	++b->lkb_b_version;
+	box_event(b, LKB_EVENT_DATA, b->lkb_b_version);
+	if (b->lkb_b_coalesce)
+	{
+		defer_wakeups(b, LKB_DEFER_DATA);
+	}
+	else
+	{
+		if (waitqueue_active(&b->lkb_b_datawaitq))
+			wake_up_all(&b->lkb_b_datawaitq);
+		if (b->lkb_b_eventfds)
+			signal_eventfds(b, 0);
+	}
+	if (!b->lkb_b_dirty)
+	{
+		b->lkb_b_dirty = kmalloc(sizeof(lockbox_dirty) * LKB_DIRTY_HISTORY,
+					GFP_KERNEL);
+		if (!b->lkb_b_dirty)
+		{
+			/* Readers behind this version must resync */
+			b->lkb_b_dirtybase = b->lkb_b_version;
+			return;
+		}
+	}
+	d = b->lkb_b_dirty + b->lkb_b_dirtynext;
+	if (b->lkb_b_ndirty == LKB_DIRTY_HISTORY)
+		b->lkb_b_dirtybase = d->lkb_d_version;
+	else
+		++b->lkb_b_ndirty;
+	d->lkb_d_version = b->lkb_b_version;
+	d->lkb_d_offset = offset;
+	d->lkb_d_size = size;
+	b->lkb_b_dirtynext = (b->lkb_b_dirtynext + 1) % LKB_DIRTY_HISTORY;
+}
+
+/* Check whether bu may write size bytes at offset in the box. Call
+ * with the box locked.
+ */
+static int
+set_data_allowed(	lockbox_box	*b,
+			lockbox_boxuse	*bu,
+			off_t		offset,
+			size_t		size)
+{
+	if (b->lkb_b_type != LKB_TYPE_DATA)
+		return -EINVAL;
+	if (locks_held_by_others(b, bu) & LKB_LOCK_DATA)
+		return -EBUSY;
+	if ((uint64_t) offset + size > ~(uint32_t) 0)
+		return -EINVAL;
+	if (range_conflict(b, bu, offset, size, LKB_RANGE_EXCLUSIVE))
+		return -EBUSY;
+	if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_WRITE))
+		return -EPERM;
+	return 0;
+}
+
+/* Write size bytes from buffer at offset in the data of the box,
+ * growing it if need be. Call with the box locked.
+ */
+static int
+write_data(	lockbox_box	*b,
+		lockbox_boxuse	*bu,
+		char const	*buffer,
+		size_t		size,
+		off_t		offset)
+{
+	size_t new_size = offset + size;
+	int status;
+
+	status = set_data_allowed(b, bu, offset, size);
+	if (status < 0)
+	{
+		/* Not allowed */
+	}
+	else if (new_size > b->lkb_b_size)
+	{
+		char *new_data = opt_alloc(new_size);
+
+		if (!new_data)
+		{
+			status = -ENOMEM;
+		}
+		else
+		{
+			if (copy_from_user(new_data + offset,
+						buffer,
+						size))
+			{
+				opt_free(new_data, new_size);
+				status = -EFAULT;
+			}
+			else
+			{
+				int copy_size = b->lkb_b_size;
+
+				if (copy_size > offset)
+					copy_size = offset;
+				memcpy(new_data,
+				       b->lkb_b_data,
+				       copy_size);
+				if (offset > copy_size)
+					memset(new_data + copy_size,
+					       0,
+					       offset - copy_size);
+				opt_free(b->lkb_b_data,
+					b->lkb_b_size);
+				b->lkb_b_data = new_data;
+				b->lkb_b_size = new_size;
+				note_data_change(b,
+						 copy_size,
+						 new_size - copy_size);
+				status = size;
+			}
+		}
+	}
+	else if (copy_from_user(b->lkb_b_data + offset, buffer, size))
+	{
+		status = -EFAULT;
+	}
+	else
+	{
+		note_data_change(b, offset, size);
+		status = 0;
+	}
+	return status;
+}
+
+static int
+lockbox_set_data(lockbox_perfile *pf,
+		lockbox_t	id,
+		char const	*buffer,
+		size_t		size,
+		off_t		offset)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	if (offset < 0)
+		return -EINVAL;
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			status = write_data(b, bu, buffer, size, offset);
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Write size bytes from buffer at the end of the data of the box,
+ * storing the offset they were written at in *offset.
+ */
+static int
+lockbox_append_data(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char const	*buffer,
+			size_t		size,
+			uint32_t	*offset)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			*offset = b->lkb_b_size;
+			status = write_data(b, bu, buffer, size, b->lkb_b_size);
+			if (status > 0)
+				status = 0;
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_set_state(lockbox_perfile *pf,
+		lockbox_t	id,
+		uint32_t	state)
+{
+	lockbox_boxuse *bu;
+	int status;
+	int need_wakeups = 0;
+	lockbox_box *b = 0;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE))
+			{
+				status = -EPERM;
+			}
+			else if (locks_held_by_others(b, bu) & LKB_LOCK_STATE)
+			{
+				status = -EBUSY;
+			}
+			else
+			{
+				if (change_state(b, state))
+				{
+					need_wakeups = 1;
+					++b->lkb_b_holders;
+				}
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	if (need_wakeups)
+	{
+		wake_box_sleepers(b, 0);
+		clean_box_holder(pf->lkb_pf_vault, b);
+	}
+	return status;
+}
+
+/* Get the state of a box along with its change sequence and per-bit
+ * set counts, all as of the same moment.
+ */
+static int
+lockbox_get_state_counts(	lockbox_perfile *pf,
+				lockbox_getstatecounts_struct *sc)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, sc->lockboxid, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				sc->state = b->lkb_b_state;
+				sc->sequence_lo = (uint32_t) b->lkb_b_stateseq;
+				sc->sequence_hi = (uint32_t) (b->lkb_b_stateseq >> 32);
+				memcpy(sc->setcounts,
+				       b->lkb_b_setcounts,
+				       sizeof(sc->setcounts));
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Apply op to the state of every box on a shelf, checking the ACL of
+ * each box. Boxes are changed one at a time under the shelf lock, so
+ * none can be added or freed part way through.
+ */
+static int
+lockbox_shelf_state_op(	lockbox_perfile *pf,
+			uint32_t	shelfid,
+			uint32_t	op,
+			uint32_t	operand,
+			lockbox_shelf_result *result)
+{
+	lockbox_vault *v = pf->lkb_pf_vault;
+	lockbox_shelf *s;
+	lockbox_box *b;
+	int	status;
+
+	if (!v)
+		return -EINVAL;
+	if (op != LKB_STATEOP_OR && op != LKB_STATEOP_ANDNOT)
+		return -EINVAL;
+	memset(result, 0, sizeof(*result));
+	status = find_shelf(v, shelfid, 1, &s, 0);
+	if (status < 0)
+		return status;
+	status = down_interruptible(&s->lkb_s_lock);
+	if (status < 0)
+		return status;
+
+	for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
+	{
+		uint32_t state;
+		int	wake = 0;
+
+		down(&b->lkb_b_lock);
+		state = b->lkb_b_state;
+		if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE))
+		{
+			++result->lsr_denied;
+		}
+		else if ((b->lkb_b_userlocks | fast_locks_held(b, 0)) & LKB_LOCK_STATE)
+		{
+			/* There is no handle here to tell the caller's own
+			 * locks from anybody else's, so any holder counts.
+			 */
+			++result->lsr_busy;
+		}
+		else
+		{
+			++result->lsr_boxes;
+
+			/* Only report states the caller could read */
+			if (lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE))
+				result->lsr_oldbits |= state;
+			if (op == LKB_STATEOP_OR)
+				state |= operand;
+			else
+				state &= ~operand;
+			wake = change_state(b, state);
+		}
+		up(&b->lkb_b_lock);
+
+		/* The shelf lock keeps the box from being freed */
+		if (wake)
+			wake_box_sleepers(b, 0);
+	}
+	up(&s->lkb_s_lock);
+	return 0;
+}
+
+/* Atomically change the state of a box, returning the old state.
+ * Wakeups follow the same rule as lockbox_set_state (see
+ * state_change_wakes).
+ */
+static int
+lockbox_state_op(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	op,
+			uint32_t	operand,
+			uint32_t	compare,
+			uint32_t	*old)
+{
+	lockbox_boxuse *bu;
+	int status;
+	int need_wakeups = 0;
+	lockbox_box *b = 0;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			uint32_t state = b->lkb_b_state;
+
+			/* The old state is returned, so reading it must be
+			 * allowed as well as writing it.
+			 */
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE) ||
+			    !lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE))
+			{
+				status = -EPERM;
+			}
+			else if (locks_held_by_others(b, bu) & LKB_LOCK_STATE)
+			{
+				status = -EBUSY;
+			}
+			else
+			{
+				status = 0;
+				switch (op)
+				{
+				case LKB_STATEOP_OR:
+					state |= operand;
+					break;
+
+				case LKB_STATEOP_ANDNOT:
+					state &= ~operand;
+					break;
+
+				case LKB_STATEOP_XOR:
+					state ^= operand;
+					break;
+
+				case LKB_STATEOP_CAS:
+					if (state == compare)
+						state = operand;
+					break;
+
+				default:
+					status = -EINVAL;
+					break;
+				}
+			}
+			if (status >= 0)
+			{
+				*old = b->lkb_b_state;
+				if (change_state(b, state))
+				{
+					need_wakeups = 1;
+					++b->lkb_b_holders;
+				}
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	if (need_wakeups)
+	{
+		wake_box_sleepers(b, 0);
+		clean_box_holder(pf->lkb_pf_vault, b);
+	}
+	return status;
+}
+
+/* Atomically update a naturally aligned 32 or 64 bit word in the data
+ * of a box, returning its old value. The box semaphore serialises this
+ * against every other writer, so plain loads and stores are enough.
+ */
+static int
+lockbox_data_op(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	op,
+			uint32_t	width,
+			uint32_t	offset,
+			uint64_t	operand,
+			uint64_t	compare,
+			uint64_t	*old)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	if ((width != 4 && width != 8) || (offset & (width - 1)))
+		return -EINVAL;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			status = set_data_allowed(b, bu, offset, width);
+			if (status < 0)
+			{
+				/* Not allowed */
+			}
+			else if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			{
+				status = -EPERM;
+			}
+			else if ((uint64_t) offset + width > b->lkb_b_size)
+			{
+				status = -EINVAL;
+			}
+			else
+			{
+				void	*p = b->lkb_b_data + offset;
+				uint64_t value = (width == 4) ?
+						 *(uint32_t *) p : *(uint64_t *) p;
+
+				*old = value;
+				switch (op)
+				{
+				case LKB_DATAOP_ADD:
+					value += operand;
+					break;
+
+				case LKB_DATAOP_XCHG:
+					value = operand;
+					break;
+
+				case LKB_DATAOP_CAS:
+					if (value == compare)
+						value = operand;
+					break;
+
+				default:
+					status = -EINVAL;
+					break;
+				}
+				if (width == 4)
+					value = (uint32_t) value;
+				if (status >= 0 && value != *old)
+				{
+					if (width == 4)
+						*(uint32_t *) p = (uint32_t) value;
+					else
+						*(uint64_t *) p = value;
+					note_data_change(b, offset, width);
+				}
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Free the kernel's copy of an lkb_writemulti operation list */
+static void
+free_multiwrite(	lockbox_multiwrite *w,
+			size_t		count)
+{
+	size_t	i;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (w[i].lkb_mw_data)
+			opt_free(w[i].lkb_mw_data, w[i].lkb_mw_size);
+		if (w[i].lkb_mw_newdata)
+			opt_free(w[i].lkb_mw_newdata, w[i].lkb_mw_newsize);
+	}
+	kfree(w);
+}
+
+/* Copy in an lkb_writemulti operation list, including the data to be
+ * written, so that nothing can fault once the boxes are locked.
+ */
+static int
+get_user_multiwrite(	lockbox_multiwrite_entry const *entries,
+			lockbox32_multiwrite_entry const *entries32,
+			size_t		count,
+			lockbox_multiwrite *w)
+{
+	size_t	i;
+
+	for (i = 0; i < count; ++i)
+	{
+		lockbox_multiwrite_entry e;
+		int	status;
+
+#ifdef __x86_64__
+		if (entries32)
+		{
+			lockbox32_multiwrite_entry e32;
+
+			if (copy_from_user(&e32, entries32 + i, sizeof(e32)))
+				return -EFAULT;
+			e.lmw_id = e32.lmw_id;
+			e.lmw_op = e32.lmw_op;
+			e.lmw_data = uint32_to_ptr(e32.lmw_data);
+			e.lmw_size = e32.lmw_size;
+			e.lmw_offset = e32.lmw_offset;
+			e.lmw_state = e32.lmw_state;
+		}
+		else
+#endif
+		if (copy_from_user(&e, entries + i, sizeof(e)))
+		{
+			return -EFAULT;
+		}
+
+		w[i].lkb_mw_id = e.lmw_id;
+		w[i].lkb_mw_op = e.lmw_op;
+		w[i].lkb_mw_state = e.lmw_state;
+		if (e.lmw_op == LKB_MULTI_SETSTATE)
+			continue;
+		if (e.lmw_op != LKB_MULTI_SETDATA ||
+		    e.lmw_offset < 0 ||
+		    (uint64_t) e.lmw_offset + e.lmw_size > ~(uint32_t) 0)
+			return -EINVAL;
+		w[i].lkb_mw_offset = e.lmw_offset;
+		w[i].lkb_mw_size = e.lmw_size;
+		if (e.lmw_size &&
+		    (status = copy_user_data(e.lmw_data,
+					     e.lmw_size,
+					     (void **) &w[i].lkb_mw_data)) < 0)
+			return status;
+	}
+	return 0;
+}
+
+/* Apply a list of setdata and setstate operations to several boxes
+ * with all of them locked at once, so that nobody sees some of the
+ * changes without the rest. The boxes are locked in order of address
+ * so that concurrent callers cannot deadlock.
+ */
+static int
+lockbox_write_multi(	lockbox_perfile *pf,
+			lockbox_multiwrite_entry const *entries,
+			lockbox32_multiwrite_entry const *entries32,
+			size_t		count)
+{
+	lockbox_multiwrite *w;
+	size_t	i, j;
+	size_t	locked = 0;
+	int	status;
+
+	if (!count || count > LKB_MULTI_MAX)
+		return -EINVAL;
+
+	w = kmalloc(count * sizeof(lockbox_multiwrite), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+	memset(w, 0, count * sizeof(lockbox_multiwrite));
+
+	status = get_user_multiwrite(entries, entries32, count, w);
+	if (status < 0)
+	{
+		free_multiwrite(w, count);
+		return status;
+	}
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+	if (status < 0)
+	{
+		free_multiwrite(w, count);
+		return status;
+	}
+
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		status = lockbox_find_box(pf, w[i].lkb_mw_id, &w[i].lkb_mw_bu);
+		if (status >= 0)
+			w[i].lkb_mw_box = w[i].lkb_mw_bu->lkb_bu_box;
+	}
+
+	/* Sort by box, keeping the operations on each box in order */
+	for (i = 1; i < count && status >= 0; ++i)
+	{
+		lockbox_multiwrite t = w[i];
+
+		for (j = i;
+		     j > 0 && (unsigned long) w[j - 1].lkb_mw_box > (unsigned long) t.lkb_mw_box;
+		     --j)
+			w[j] = w[j - 1];
+		w[j] = t;
+	}
+
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		if (i && w[i].lkb_mw_box == w[i - 1].lkb_mw_box)
+			continue;
+		if (down_interruptible(&w[i].lkb_mw_box->lkb_b_lock) < 0)
+			status = -EINTR;
+		else
+			locked = i + 1;
+	}
+
+	/* Check everything before changing anything */
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		lockbox_box *b = w[i].lkb_mw_box;
+		lockbox_boxuse *bu = w[i].lkb_mw_bu;
+
+		if (w[i].lkb_mw_op == LKB_MULTI_SETSTATE)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE))
+				status = -EPERM;
+			else if (locks_held_by_others(b, bu) & LKB_LOCK_STATE)
+				status = -EBUSY;
+		}
+		else
+		{
+			status = set_data_allowed(b, bu, w[i].lkb_mw_offset, w[i].lkb_mw_size);
+		}
+	}
+
+	/* Allocate the grown data for each box up front, so that running
+	 * out of memory cannot leave the job half done.
+	 */
+	for (i = 0; i < count && status >= 0; i = j)
+	{
+		lockbox_box *b = w[i].lkb_mw_box;
+		uint32_t new_size = b->lkb_b_size;
+
+		for (j = i; j < count && w[j].lkb_mw_box == b; ++j)
+		{
+			if (w[j].lkb_mw_op == LKB_MULTI_SETDATA &&
+			    w[j].lkb_mw_offset + w[j].lkb_mw_size > new_size)
+				new_size = w[j].lkb_mw_offset + w[j].lkb_mw_size;
+		}
+		if (new_size > b->lkb_b_size)
+		{
+			w[i].lkb_mw_newdata = opt_alloc(new_size);
+			if (!w[i].lkb_mw_newdata)
+			{
+				status = -ENOMEM;
+				break;
+			}
+			w[i].lkb_mw_newsize = new_size;
+		}
+	}
+
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		lockbox_box *b = w[i].lkb_mw_box;
+		lockbox_multiwrite *first = w + i;
+
+		while (first > w && first[-1].lkb_mw_box == b)
+			--first;
+		if (first->lkb_mw_newdata)
+		{
+			memcpy(first->lkb_mw_newdata, b->lkb_b_data, b->lkb_b_size);
+			memset(first->lkb_mw_newdata + b->lkb_b_size,
+			       0,
+			       first->lkb_mw_newsize - b->lkb_b_size);
+			opt_free(b->lkb_b_data, b->lkb_b_size);
+			b->lkb_b_data = first->lkb_mw_newdata;
+			note_data_change(b,
+					 b->lkb_b_size,
+					 first->lkb_mw_newsize - b->lkb_b_size);
+			b->lkb_b_size = first->lkb_mw_newsize;
+			first->lkb_mw_newdata = 0;
+		}
+		if (w[i].lkb_mw_op == LKB_MULTI_SETSTATE)
+		{
+			if (change_state(b, w[i].lkb_mw_state) && !first->lkb_mw_wake)
+			{
+				first->lkb_mw_wake = 1;
+				++b->lkb_b_holders;
+			}
+		}
+		else
+		{
+			if (w[i].lkb_mw_size)
+				memcpy(b->lkb_b_data + w[i].lkb_mw_offset,
+				       w[i].lkb_mw_data,
+				       w[i].lkb_mw_size);
+			note_data_change(b, w[i].lkb_mw_offset, w[i].lkb_mw_size);
+		}
+	}
+
+	for (i = 0; i < locked; ++i)
+	{
+		if (!i || w[i].lkb_mw_box != w[i - 1].lkb_mw_box)
+			up(&w[i].lkb_mw_box->lkb_b_lock);
+	}
+	up(&pf->lkb_pf_lock);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (w[i].lkb_mw_wake)
+		{
+			wake_box_sleepers(w[i].lkb_mw_box, 0);
+			clean_box_holder(pf->lkb_pf_vault, w[i].lkb_mw_box);
+		}
+	}
+	free_multiwrite(w, count);
+	return status < 0 ? status : 0;
+}
+
+static int
+lockbox_get_state(lockbox_perfile *pf,
+		lockbox_t	id,
+		uint32_t	*state)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				*state = b->lkb_b_state;
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_set_file(lockbox_perfile *pf,
+		lockbox_t	id,
+		int		fd)
+{
+	lockbox_boxuse *bu;
+	int status;
+	struct file *f;
+	
+	if (fd < 0)
+	{
+		if (fd < -1)
+			return -EINVAL;
+		f = 0;
+	}
+	else
+	{
+		f = fget(fd);
+		if (!f)
+			return -ENOENT;
+	}
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status >= 0)
+	{
+		status = lockbox_find_box(pf, id, &bu);
+		if (status >= 0)
+		{
+			lockbox_box *b = bu->lkb_bu_box;
+
+			status = down_interruptible(&b->lkb_b_lock);
+
+			if (status >= 0)
+			{
+				if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETFD))
+				{
+					status = -EPERM;
+				}
+				else if (locks_held_by_others(b, bu) & LKB_LOCK_FILE)
+				{
+					status = -EBUSY;
+				}
+				else
+				{
+					if (b->lkb_b_file)
+						fput(b->lkb_b_file);
+					if (f)
+						get_file(f);
+					b->lkb_b_file = f;
+				}
+				up(&b->lkb_b_lock);
+			}
+		}
+		up(&pf->lkb_pf_lock);
+	}
+	if (f)
+		fput(f);
+	return status;
+}
+
+static int
+lockbox_get_file(lockbox_perfile *pf,
+		lockbox_t	id)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETFD))
+			{
+				status = -EPERM;
+			}
+			else if (!b->lkb_b_file)
+			{
+				status = -ENOENT;
+			}
+			else if ((status = get_unused_fd()) >= 0)
+			{
+				get_file(b->lkb_b_file);
+				fd_install(status, b->lkb_b_file);
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_get_users(lockbox_perfile *pf,
+		lockbox_t	id)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			status = b->lkb_b_users;
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_get_name(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char		*name,
+			size_t		bufsize,
+			size_t		*sizeneeded)
+{
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+		int len = strlen(b->lkb_b_name) + 1;
+
+		*sizeneeded = len;
+		if (len > bufsize)
+			status = -ENOMEM;
+		else if (copy_to_user(name, b->lkb_b_name, len))
+			status = -EFAULT;
+		else
+			status = 0;
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_set_acl(lockbox_perfile *pf,
+		lockbox_t	id,
+		lockbox_acl const *acl)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETACL))
+			{
+				status = -EPERM;
+			}
+			else if (locks_held_by_others(b, bu) & LKB_LOCK_ACL)
+			{
+				status = -EBUSY;
+			}
+			else
+			{
+				lockbox_acl *new_acl;
+
+				status = get_user_acl(acl, &new_acl);
+
+				if (status >= 0)
+				{
+					free_acl(b->lkb_b_acl);
+					b->lkb_b_acl = new_acl;
+					++b->lkb_b_aclgen;
+					status = 0;
+				}
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_get_acl(lockbox_perfile *pf,
+		lockbox_t	id,
+		lockbox_acl	*acl,
+		size_t		size,
+		size_t		*sizeneeded)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETACL))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				*sizeneeded = LKB_ACL_SIZE(b->lkb_b_acl->la_header.lah_n_entries);
+
+				if (size < *sizeneeded)
+					status = -ENOMEM;
+				else if (copy_to_user(acl,
+						b->lkb_b_acl,
+						*sizeneeded))
+					status = -EFAULT;
+				else
+					status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+static int
+lockbox_list_boxes(	lockbox_perfile *pf,
+			int	shelf,
+			char	*data,
+			int	buffersize,
+			size_t	*psizeneeded)
+{
+	int	status = 0;
+	lockbox_vault *v;
+	lockbox_shelf *s;
+
+	v = pf->lkb_pf_vault;
+	if (!v)
+		return -EINVAL;
+	status = find_shelf(v, shelf, 1, &s, 0);
+	if (status < 0)
+		return status;
+	if (s)
+		status = down_interruptible(&s->lkb_s_lock);
+	if (status >= 0)
+	{
+		lockbox_box *b;
+		int	sizeneeded = 1;
+
+		if (s)
+		{
+			for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
+				sizeneeded += strlen(b->lkb_b_name) + 1;
+		}
+		*psizeneeded = sizeneeded;
+		if (sizeneeded <= buffersize)
+		{
+			char c;
+
+			if (s)
+			{
+				for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
+				{
+					int len = strlen(b->lkb_b_name) + 1;
+
+					if (copy_to_user(data, b->lkb_b_name, len))
+					{
+						status = -EFAULT;
+						break;
+					}
+					data += len;
+				}
+			}
+			c = 0;
+			if (copy_to_user(data, &c, 1))
+				status = -EFAULT;
+
+		}
+		else
+		{
+			status = -ENOMEM;
+		}
+		if (s)
+			up(&s->lkb_s_lock);
+	}
+	return status;
+}
+
+static int
+lockbox_acquire_lock(	lockbox_perfile *pf,
+			lockbox_boxuse *bu,
+			lockbox_box	*b,
+			uint32_t	flags,
+			uint32_t	pi_taken,
+			int		*status)
+{
+	int	retval = 1;
+
+	if (bu->lkb_bu_box != b)
+	{
+		/* Somebody has closed the box on us! */
+		*status = -ENOENT;
+		return 1;
+	}
+
+	/* Most wakeups are for other reasons (state changes, users
+	 * coming and going). Don't bother with the semaphores if the
+	 * locks we want are visibly still held. This can't be done once
+	 * the box has fast path lock words, because a waiter must flag
+	 * itself in them before it sleeps.
+	 */
+	if (!ACCESS_ONCE(b->lkb_b_fast) &&
+	    (flags & ACCESS_ONCE(b->lkb_b_userlocks) & ~bu->lkb_bu_locks_held))
+	{
+		*status = -EWOULDBLOCK;
+		return 0;
+	}
+
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
+	{
+		*status = -EINTR;
+		return 1;
+	}
+	
+
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		*status = -EINTR;
+		retval = 1;
+	}
+	else
+	{
+		while (1)
+		{
+			uint32_t busy = flags & locks_held_by_others(b, bu);
+
+			if (busy ||
+			    ((flags & LKB_LOCK_DATA) &&
+			     range_conflict(b, bu, 0, ~(uint32_t) 0, LKB_RANGE_EXCLUSIVE)))
+			{
+				if (!fast_mark_waiters(b, bu, busy))
+					continue;
+				*status = -EWOULDBLOCK;
+				retval = 0;
+			}
+			else if (!fast_claim(b, bu, flags & ~bu->lkb_bu_locks_held))
+			{
+				continue;
+			}
+			else
+			{
+				set_lock_owners(b, flags & ~bu->lkb_bu_locks_held);
+				b->lkb_b_userlocks |= flags;
+				bu->lkb_bu_locks_held |= flags;
+				bu->lkb_bu_pi_held |= pi_taken;
+				*status = 0;
+				retval = 1;
+			}
+			break;
+		}
+		up(&b->lkb_b_lock);
+	}
+	up(&pf->lkb_pf_lock);
+	return retval;
+}
+
+/* Spin waiting for locks held by tasks that are currently running,
+ * on the basis that they will probably be released before we could
+ * get to sleep and be woken again. Returns non-zero if the lock was
+ * acquired (or the attempt failed outright), zero if the caller
+ * should fall back to sleeping.
+ */
+static int
+lockbox_spin_lock(	lockbox_perfile *pf,
+			lockbox_boxuse	*bu,
+			lockbox_box	*b,
+			uint32_t	flags,
+			uint32_t	usecs,
+			int		*status)
+{
+	ktime_t	start = ktime_get();
+	s64	limit = (s64) usecs * 1000;
+
+	while (1)
+	{
+		uint32_t busy = flags & locks_held_by_others(b, bu);
+
+		if (!busy)
+		{
+			if (lockbox_acquire_lock(pf, bu, b, flags, 0, status))
+				return 1;
+		}
+		else if (!lock_owners_running(b, busy))
+		{
+			return 0;
+		}
+		if (need_resched() || signal_pending(current))
+			return 0;
+		if (ktime_to_ns(ktime_sub(ktime_get(), start)) >= limit)
+			return 0;
+		cpu_relax();
+	}
+}
+
+static int
+lockbox_pi_timed_lock(	struct rt_mutex *m)
+{
+	struct hrtimer_sleeper to;
+	int	status;
+
+	hrtimer_init(&to.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_init_sleeper(&to, current);
+	hrtimer_set_expires(&to.timer, ktime_add_ns(ktime_get(), LKB_PI_POLL_NSECS));
+	status = rt_mutex_timed_lock(m, &to, 0);
+	hrtimer_cancel(&to.timer);
+	return status;
+}
+
+/* Release rt-mutexes taken by lockbox_pi_acquire that did not end up
+ * backing a lock, along with the references held on them.
+ */
+static void
+lockbox_pi_unwind(	lockbox_pilock	**pilocks,
+			uint32_t	taken)
+{
+	int	i;
+
+	for (i = 0; i < LKB_LOCK_TYPES; ++i)
+	{
+		if (taken & (1 << i))
+		{
+			rt_mutex_unlock(&pilocks[i]->lkb_pl_mutex);
+			put_pilock(pilocks[i]);
+		}
+	}
+}
+
+/* Take the rt-mutexes for the lock types in flags, in bit order so
+ * that two priority inheritance lockers cannot deadlock on each
+ * other. Waiting on the mutex boosts whichever task holds it. On
+ * success *taken is set to the lock types whose mutexes were taken,
+ * and pilocks holds a reference to each of them; the caller must
+ * still acquire the locks themselves, and must drop the references
+ * or unwind with lockbox_pi_unwind.
+ */
+static int
+lockbox_pi_acquire(	lockbox_boxuse	*bu,
+			lockbox_box	*b,
+			uint32_t	flags,
+			int		no_block,
+			lockbox_pilock	**pilocks,
+			uint32_t	*taken)
+{
+	int	i;
+	int	status = 0;
+
+	*taken = 0;
+	for (i = 0; i < LKB_LOCK_TYPES && status >= 0; ++i)
+	{
+		if (!(flags & (1 << i)) ||
+		    (bu->lkb_bu_locks_held & (1 << i)))
+			continue;
+		while (1)
+		{
+			lockbox_pilock *p;
+
+			if (down_interruptible(&b->lkb_b_lock) < 0)
+			{
+				status = -EINTR;
+				break;
+			}
+			p = get_pilock(b, i);
+			up(&b->lkb_b_lock);
+			if (!p)
+			{
+				status = -ENOMEM;
+				break;
+			}
+			if (no_block)
+				status = rt_mutex_trylock(&p->lkb_pl_mutex) ?
+					0 : -EWOULDBLOCK;
+			else
+				status = lockbox_pi_timed_lock(&p->lkb_pl_mutex);
+			if (status >= 0)
+			{
+				pilocks[i] = p;
+				break;
+			}
+			put_pilock(p);
+
+			/* On a timeout, go around again in case the
+			 * mutex has been abandoned.
+			 */
+			if (status != -ETIMEDOUT)
+				break;
+		}
+		if (status >= 0)
+			*taken |= 1 << i;
+	}
+	if (status < 0)
+	{
+		lockbox_pi_unwind(pilocks, *taken);
+		*taken = 0;
+	}
+	return status;
+}
+
+/* Obtain locks through a handle. If expect is not null the handle must
+ * still name that box, which lets a caller that resolved the handle
+ * earlier detect that it has since been closed and reused.
+ */
+static int
+lockbox_lock(	lockbox_perfile *pf,
+		lockbox_t id,
+		lockbox_box *expect,
+		uint32_t flags_in)
+{
+	lockbox_boxuse *bu;
+	int	status;
+	uint32_t flags = flags_in & LKB_LOCK_ALL;
+	int	no_block = (flags_in & LKB_LOCK_NOBLOCK) ? 1 : 0;
+	int	waiting;
+	uint32_t spin = 0;
+	int	pi = 0;
+	uint32_t pi_taken = 0;
+	lockbox_pilock *pilocks[LKB_LOCK_TYPES];
+	lockbox_box *b = 0;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	waiting = 0;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0 && expect && bu->lkb_bu_box != expect)
+		status = -ENOENT;
+
+	if (status >= 0)
+	{
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				++b->lkb_b_holders;
+				spin = b->lkb_b_spin_usecs;
+				pi = b->lkb_b_pi;
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+
+	up(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	if ((flags_in & LKB_LOCK_SPIN) && spin < spin_usecs)
+		spin = spin_usecs;
+	if (spin > spin_max_usecs)
+		spin = spin_max_usecs;
+	if (flags_in & LKB_LOCK_NOSPIN)
+		spin = 0;
+
+	status = 0;
+
+	/* In priority inheritance mode, queue on the rt-mutexes first.
+	 * Once we hold them the only things that can still be in the
+	 * way are range locks and lockers from before the box was put
+	 * into that mode, which we wait out in the normal way.
+	 */
+	if (pi)
+	{
+		status = lockbox_pi_acquire(bu, b, flags, no_block, pilocks, &pi_taken);
+		spin = 0;
+	}
+
+	if (status < 0)
+	{
+		/* Already failed */
+	}
+	else if (no_block)
+	{
+		lockbox_acquire_lock(pf, bu, b, flags, pi_taken, &status);
+	}
+	else if (!spin || !lockbox_spin_lock(pf, bu, b, flags, spin, &status))
+	{
+		status = -EWOULDBLOCK;
+
+		wait_event_interruptible(b->lkb_b_waitq,
+			   lockbox_acquire_lock(pf, bu, b, flags, pi_taken, &status));
+		if (status == -EWOULDBLOCK)
+			status = -EINTR;
+	}
+
+	if (status < 0)
+	{
+		lockbox_pi_unwind(pilocks, pi_taken);
+	}
+	else
+	{
+		int	i;
+
+		for (i = 0; i < LKB_LOCK_TYPES; ++i)
+		{
+			if (pi_taken & (1 << i))
+				put_pilock(pilocks[i]);
+		}
+	}
+
+	clean_box_holder(pf->lkb_pf_vault, b);
+	return status;
+}
+
+/* Release the locks of the types in locks held through a handle. As
+ * for lockbox_lock, expect may name the box the handle must still
+ * refer to.
+ */
+static int
+lockbox_unlock(	lockbox_perfile *pf,
+		lockbox_t id,
+		lockbox_box *expect,
+		uint32_t locks)
+{
+	lockbox_boxuse *bu;
+	int need_wakeup = 0;
+	lockbox_box *b = 0;
+	int status = down_interruptible(&pf->lkb_pf_lock);
 
-	if (prelocked)
-		status = 0;
-	else
-		status = down_interruptible(&pf->lkb_pf_lock);
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0 && expect && bu->lkb_bu_box != expect)
+		status = -ENOENT;
 	if (status >= 0)
 	{
-		int	i;
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
 
-		for (i = 0; i < IN_PERFILE_BOXES; ++i)
+		if (status >= 0 && !pi_locks_owned(b, bu, locks))
 		{
-			if (!pf->lkb_pf_boxes[i].lkb_bu_box)
+			/* Only the task that took an rt-mutex may release it */
+			status = -EPERM;
+			up(&b->lkb_b_lock);
+		}
+		else if (status >= 0)
+		{
+			/* Locks taken through the fast path come here to be
+			 * released when somebody is waiting for them.
+			 */
+			uint32_t held = bu->lkb_bu_locks_held & locks;
+			uint32_t released = held | fast_release(b, bu, locks);
+
+			if (released)
 			{
-				set_boxuse(pf->lkb_pf_boxes + i, b);
-				status = i;
-				found = 1;
-				break;
+				need_wakeup = 1;
+				release_pi_locks(b, bu, locks);
+				++b->lkb_b_holders;
+				b->lkb_b_userlocks &= ~held;
+				clear_lock_owners(b, held);
+				if (released & LKB_LOCK_DATA)
+					wake_range_waiters(b, 0, ~(uint32_t) 0);
+				bu->lkb_bu_locks_held &= ~locks;
+				box_event(b, LKB_EVENT_UNLOCKED, released);
 			}
+			up(&b->lkb_b_lock);
 		}
-		if (!found)
+	}
+	if (need_wakeup)
+	{
+		wake_box_sleepers(b, 0);
+		clean_box_holder(pf->lkb_pf_vault, b);
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Returns the locks held through bu, including those taken through
+ * the fast path.
+ */
+static uint32_t
+locks_held_through(	lockbox_box	*b,
+			lockbox_boxuse	*bu)
+{
+	lockbox_fastlock *f = ACCESS_ONCE(b->lkb_b_fast);
+	uint32_t held = bu->lkb_bu_locks_held;
+	int	i;
+
+	for (i = 0; f && i < LKB_LOCK_TYPES; ++i)
+	{
+		if ((ACCESS_ONCE(f->lkf_words[i]) & ~LKB_FAST_WAITERS) == bu->lkb_bu_token)
+			held |= 1 << i;
+	}
+	return held;
+}
+
+/* Lock several boxes, in order of address so that two callers locking
+ * overlapping sets of boxes cannot deadlock. If any of them cannot be
+ * locked, the locks already obtained by this call are given back.
+ */
+static int
+lockbox_lock_multi(	lockbox_perfile *pf,
+			lockbox_multilock_entry const *entries,
+			size_t		count,
+			uint32_t	flags)
+{
+	lockbox_multilock *m;
+	size_t	i, j;
+	size_t	held = 0;
+	int	status;
+
+	if (!count || count > LKB_MULTI_MAX)
+		return -EINVAL;
+
+	m = kmalloc(count * sizeof(lockbox_multilock), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+	if (status < 0)
+	{
+		kfree(m);
+		return status;
+	}
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		lockbox_multilock_entry e;
+		lockbox_boxuse *bu;
+
+		if (copy_from_user(&e, entries + i, sizeof(e)))
 		{
-			lockbox_boxlist **bl = &pf->lkb_pf_boxlist;
-			int	offset = IN_PERFILE_BOXES;
+			status = -EFAULT;
+			break;
+		}
+		status = lockbox_find_box(pf, e.lml_id, &bu);
+		if (status < 0)
+			break;
 
-			while (*bl)
+		/* Hold the box so that it outlives the handle if that is
+		 * closed before we get to locking it.
+		 */
+		down(&bu->lkb_bu_box->lkb_b_lock);
+		++bu->lkb_bu_box->lkb_b_holders;
+		up(&bu->lkb_bu_box->lkb_b_lock);
+		held = i + 1;
+		m[i].lkb_ml_box = bu->lkb_bu_box;
+		m[i].lkb_ml_id = e.lml_id;
+		m[i].lkb_ml_flags = e.lml_flags & LKB_LOCK_ALL;
+		m[i].lkb_ml_taken = m[i].lkb_ml_flags &
+				    ~locks_held_through(bu->lkb_bu_box, bu);
+	}
+	up(&pf->lkb_pf_lock);
+
+	for (i = 1; i < count && status >= 0; ++i)
+	{
+		lockbox_multilock t = m[i];
+
+		for (j = i;
+		     j > 0 && (unsigned long) m[j - 1].lkb_ml_box > (unsigned long) t.lkb_ml_box;
+		     --j)
+			m[j] = m[j - 1];
+		m[j] = t;
+	}
+
+	/* A box named twice, through different handles, would wait for
+	 * itself.
+	 */
+	for (i = 1; i < count && status >= 0; ++i)
+	{
+		if (m[i].lkb_ml_box == m[i - 1].lkb_ml_box)
+			status = -EINVAL;
+	}
+
+	for (i = 0; i < count && status >= 0; ++i)
+	{
+		status = lockbox_lock(pf,
+				      m[i].lkb_ml_id,
+				      m[i].lkb_ml_box,
+				      m[i].lkb_ml_flags | (flags & ~LKB_LOCK_ALL));
+		if (status < 0)
+		{
+			while (i--)
 			{
-				for (i = 0; i < IN_BOXLIST_BOXES; ++i)
-				{
-					if (!(*bl)->lkb_bl_boxes[i].lkb_bu_box)
-					{
-						set_boxuse((*bl)->lkb_bl_boxes + i, b);
-						status = offset + i;
-						found = 1;
-						break;
-					}
-				}
-				if (found)
-					break;
-				bl = &(*bl)->lkb_bl_next;
-				offset += IN_BOXLIST_BOXES;
+				if (m[i].lkb_ml_taken)
+					lockbox_unlock(pf,
+						       m[i].lkb_ml_id,
+						       m[i].lkb_ml_box,
+						       m[i].lkb_ml_taken);
 			}
+			break;
+		}
+	}
 
-			if (!found)
+	for (i = 0; i < held; ++i)
+		clean_box_holder(pf->lkb_pf_vault, m[i].lkb_ml_box);
+	kfree(m);
+	return status < 0 ? status : 0;
+}
+
+static int
+lockbox_set_spin(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	usecs)
+{
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
 			{
-				*bl = kmalloc(sizeof(lockbox_boxlist), GFP_KERNEL);
-				if (*bl)
-				{
-					memset(*bl, 0, sizeof(lockbox_boxlist));
-					status = offset;
-					set_boxuse((*bl)->lkb_bl_boxes, b);
-				}
-				else
-				{
-					status = -ENOMEM;
-				}
+				status = -EPERM;
+			}
+			else
+			{
+				if (usecs > spin_max_usecs)
+					usecs = spin_max_usecs;
+				b->lkb_b_spin_usecs = usecs;
+				status = 0;
 			}
+			up(&b->lkb_b_lock);
 		}
-		if (!prelocked)
-			up(&pf->lkb_pf_lock);
 	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Set the window, in milliseconds, over which the wakeups caused by
+ * state and data changes to a box are coalesced.
+ */
+static int
+lockbox_set_coalesce(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	msecs)
+{
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
 
 	if (status < 0)
-		release_box(pf->lkb_pf_vault, b, 0);
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE))
+			{
+				status = -EPERM;
+			}
+			else if (msecs > coalesce_max_msecs)
+			{
+				status = -EINVAL;
+			}
+			else
+			{
+				b->lkb_b_coalesce = msecs;
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
 	return status;
 }
 
 static int
-lockbox_access_ok(	lockbox_acl const *acl,
-			int		flag)
+lockbox_set_pi(	lockbox_perfile *pf,
+		lockbox_t	id,
+		uint32_t	enable)
 {
-	int	i;
+	lockbox_boxuse *bu;
+	int status = down_interruptible(&pf->lkb_pf_lock);
 
-	for (i = 0; i < acl->la_header.lah_n_entries; ++i)
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
 	{
-		if ((acl->la_entries[i].lae_access & flag) != flag)
-			continue;
-		switch (acl->la_entries[i].lae_idtype)
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
 		{
-		case LKB_IDTYPE_USER:
-			if (acl->la_entries[i].lae_id != current->euid)
-				continue;
-			break;
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				b->lkb_b_pi = enable ? 1 : 0;
 
-		case LKB_IDTYPE_GROUP:
-			if (!in_egroup_p(acl->la_entries[i].lae_id))
-				continue;
-			break;
+				/* Waiters could not boost holders that took
+				 * their locks without the kernel's knowledge.
+				 */
+				if (b->lkb_b_fast)
+				{
+					if (b->lkb_b_pi)
+						b->lkb_b_fast->lkf_flags |= LKB_FAST_SLOW;
+					else
+						b->lkb_b_fast->lkf_flags &= ~LKB_FAST_SLOW;
+				}
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
 
-		case LKB_IDTYPE_WORLD:
-			break;
 
-		case LKB_IDTYPE_PROCESS:
-			if (acl->la_entries[i].lae_id != current->tgid)
-				continue;
-			break;
+/* Set up the page of lock words for the user space fast path on a
+ * box, and return the token that identifies the handle in them. The
+ * caller then maps the page from the vault file. The access check is
+ * made here, and a reference to the page is left on the handle for
+ * mmap_lockbox to take.
+ */
+static int
+lockbox_fast_map(	lockbox_perfile *pf,
+			lockbox_t	id)
+{
+	lockbox_boxuse *bu;
+	struct page *page;
+	int status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
+			{
+				status = -EPERM;
+			}
+			else if (bu->lkb_bu_locks_held)
+			{
+				/* The library could not release them */
+				status = -EBUSY;
+			}
+			else if (!b->lkb_b_fast &&
+				 !(b->lkb_b_fastpage = alloc_page(GFP_KERNEL | __GFP_ZERO)))
+			{
+				status = -ENOMEM;
+			}
+			else
+			{
+				if (!b->lkb_b_fast)
+				{
+					lockbox_fastlock *f = page_address(b->lkb_b_fastpage);
+					int	i;
 
-		default:
-			continue;
+					/* Locks already held were taken through
+					 * the kernel and are released there.
+					 */
+					for (i = 0; i < LKB_LOCK_TYPES; ++i)
+					{
+						if (b->lkb_b_userlocks & (1 << i))
+							f->lkf_words[i] = LKB_FAST_KERNEL;
+					}
+					if (!f->lkf_words[0] && b->lkb_b_ranges)
+						f->lkf_words[0] = LKB_FAST_RANGES;
+					if (b->lkb_b_pi)
+						f->lkf_flags |= LKB_FAST_SLOW;
+					smp_wmb();
+					b->lkb_b_fast = f;
+				}
+				get_page(b->lkb_b_fastpage);
+				page = xchg(&bu->lkb_bu_fastpage, b->lkb_b_fastpage);
+				if (page)
+					put_page(page);
+				status = bu->lkb_bu_token;
+			}
+			up(&b->lkb_b_lock);
 		}
-		return 1;
 	}
-	return 0;
+	up(&pf->lkb_pf_lock);
+	return status;
 }
 
 static int
-lockbox_create_new(	lockbox_perfile *pf,
-			uint32_t	shelfid,
-			char const	*name,
-			void const	*data,
-			size_t		size,
-			lockbox_acl const *acl)
+lockbox_acquire_range(	lockbox_perfile *pf,
+			lockbox_boxuse	*bu,
+			lockbox_box	*b,
+			lockbox_range	*r,
+			lockbox_rangewait *w,
+			int		*status)
 {
-	lockbox_box **b;
-	lockbox_vault *v = pf->lkb_pf_vault;
-	lockbox_shelf *s;
-	char	*kname;
-	int	status;
+	int	retval = 1;
 
-	if (!v)
-		return -EINVAL;
-	status = find_shelf(v, shelfid, 1, &s, 1);
-	if (status < 0)
-		return status;
-	if (name)
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
 	{
-		status = get_user_string(name, &kname);
-		if (status >= 0 && !*kname)
-		{
-			/* Empty strings not allowed */
-			kfree(kname);
-			return -EINVAL;
-		}
+		*status = -EINTR;
+		return 1;
 	}
-	if (!name)
+
+	if (bu->lkb_bu_box != b)
 	{
-		kname = kmalloc(10, GFP_KERNEL);
-		if (!kname)
-			return -ENOMEM;
-		*kname = 0;
+		/* Somebody has closed the box on us! */
+		*status = -ENOENT;
+		retval = 1;
 	}
-	if (status >= 0)
+	else if (down_interruptible(&b->lkb_b_lock) < 0)
 	{
-		status = down_interruptible(&s->lkb_s_lock);
-
-		if (status >= 0)
+		*status = -EINTR;
+		retval = 1;
+	}
+	else
+	{
+		while (1)
 		{
-			b = &s->lkb_s_boxlist;
-			if (!*kname)
-				sprintf(kname, "#%08x", s->lkb_s_seqno++);
+			uint32_t busy = locks_held_by_others(b, bu) & LKB_LOCK_DATA;
 
-			while (1)
+			if (busy ||
+			    range_conflict(b, bu, r->lkb_r_offset, r->lkb_r_size, r->lkb_r_flags))
 			{
-				if (!*b)
-				{
-					/* We have reached the end of the list, so
-					 * this name is OK to create
-					 */
-					status = new_box(kname, data, size, acl, shelfid, b);
-					/* new_box takes ownership of kname, succeed or fail */
-					kname = 0;
-					break;
-				}
-				else if (strcmp((*b)->lkb_b_name, kname))
-				{
-					/* This name doesn't match, move on to the
-					 * next one.
-					 */
-					b = &(*b)->lkb_b_next;
-				}
-				else if (unlikely(!name))
-				{
-					/* We're generating a name, but we've wrapped
-					 * around and encountered this generated name.
-					 * Move to the next sequence number and try
-					 * again.
-					 */
-					sprintf(kname, "#%08x", s->lkb_s_seqno++);
-					b = &s->lkb_s_boxlist;
-				}
-				else
+				if (w && !fast_mark_waiters(b, bu, busy))
+					continue;
+				if (w && !w->lkb_rw_queued)
 				{
-					/* The user-supplied name already exists */
-					status = -EEXIST;
-					break;
+					w->lkb_rw_next = b->lkb_b_rangewaiters;
+					b->lkb_b_rangewaiters = w;
+					w->lkb_rw_queued = 1;
 				}
+				*status = -EWOULDBLOCK;
+				retval = 0;
 			}
-			up(&s->lkb_s_lock);
-			/* Now we have created the lockbox on the shelf, we need to
-			 * put it in the perfile's list
-			 */
-			if (status >= 0)
-				status = add_box_to_perfile(pf, *b, 0);
+			else if (!fast_claim_ranges(b, bu))
+			{
+				continue;
+			}
+			else
+			{
+				if (w && w->lkb_rw_queued)
+					unqueue_range_waiter(b, w);
+				r->lkb_r_next = b->lkb_b_ranges;
+				b->lkb_b_ranges = r;
+				*status = 0;
+				retval = 1;
+			}
+			break;
 		}
-		if (kname)
-			kfree(kname);
+		up(&b->lkb_b_lock);
 	}
-	return status;
+	up(&pf->lkb_pf_lock);
+	return retval;
 }
 
 static int
-lockbox_open_existing(	lockbox_perfile *pf,
-			uint32_t	shelfid,
-			char const	*name)
+lockbox_lock_range(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	offset,
+			uint32_t	size,
+			uint32_t	flags_in)
 {
+	lockbox_boxuse *bu;
 	int	status;
-	lockbox_shelf *s;
-	lockbox_vault *v = pf->lkb_pf_vault;
-	char	*kname;
+	uint32_t flags = flags_in & (LKB_RANGE_SHARED | LKB_RANGE_EXCLUSIVE);
+	int	no_block = (flags_in & LKB_LOCK_NOBLOCK) ? 1 : 0;
+	lockbox_box *b = 0;
+	lockbox_range *r;
+	lockbox_rangewait w;
 
-	if (!v)
+	if (flags != LKB_RANGE_SHARED && flags != LKB_RANGE_EXCLUSIVE)
 		return -EINVAL;
-	if (!name)
+	if (!size || (uint64_t) offset + size > ~(uint32_t) 0)
 		return -EINVAL;
-	status = find_shelf(v, shelfid, 1, &s, 0);
+
+	r = kmalloc(sizeof(lockbox_range), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
 	if (status < 0)
+	{
+		kfree(r);
 		return status;
-	status = get_user_string(name, &kname);
+	}
+
+	status = lockbox_find_box(pf, id, &bu);
+
 	if (status >= 0)
 	{
-		status = down_interruptible(&s->lkb_s_lock);
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
 
 		if (status >= 0)
 		{
-			lockbox_box *b;
-
-			status = -ENOENT;
-
-			for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
+			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
 			{
-				if (!strcmp(b->lkb_b_name, kname))
-				{
-					status = down_interruptible(&b->lkb_b_lock);
-					if (status >= 0)
-					{
-						if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_OPEN))
-						{
-							status = -EPERM;
-						}
-						else
-						{
-							++b->lkb_b_users;
-							status = add_box_to_perfile(pf, b, 0);
-							if (status >= 0)
-								++b->lkb_b_holders;
-							else
-								--b->lkb_b_users;
-						}
-						up(&b->lkb_b_lock);
-					}
-					break;
-				}
+				status = -EPERM;
 			}
-
-			up(&s->lkb_s_lock);
-
-			if (status >= 0)
+			else
 			{
-				wake_box_sleepers(b, 0);
-				clean_box_holder(v, b);
+				++b->lkb_b_holders;
+				status = 0;
 			}
+			up(&b->lkb_b_lock);
 		}
-		kfree(kname);
 	}
-	return status;
-}
 
-static int
-lockbox_find_box(lockbox_perfile *pf,
-		lockbox_t id,
-		lockbox_boxuse **bu)
-{
-	int	status = -ENOENT;
+	up(&pf->lkb_pf_lock);
 
-	if (id < IN_PERFILE_BOXES)
+	if (status < 0)
 	{
-		if (pf->lkb_pf_boxes[id].lkb_bu_box)
-		{
-			*bu = pf->lkb_pf_boxes + id;
-			status = 0;
-		}
+		kfree(r);
+		return status;
+	}
+
+	r->lkb_r_next = 0;
+	r->lkb_r_owner = bu;
+	r->lkb_r_offset = offset;
+	r->lkb_r_size = size;
+	r->lkb_r_flags = flags;
+
+	status = 0;
+
+	if (no_block)
+	{
+		lockbox_acquire_range(pf, bu, b, r, 0, &status);
 	}
 	else
 	{
-		lockbox_boxlist *bl;
-		status = -ENOENT;
+		memset(&w, 0, sizeof(w));
+		w.lkb_rw_owner = bu;
+		w.lkb_rw_offset = offset;
+		w.lkb_rw_size = size;
+		init_waitqueue_head(&w.lkb_rw_waitq);
 
-		id -= IN_PERFILE_BOXES;
+		status = -EWOULDBLOCK;
+
+		wait_event_interruptible(w.lkb_rw_waitq,
+			   lockbox_acquire_range(pf, bu, b, r, &w, &status));
 
-		for (bl = pf->lkb_pf_boxlist; bl; bl = bl->lkb_bl_next)
+		if (w.lkb_rw_queued)
 		{
-			if (id < IN_BOXLIST_BOXES)
-			{
-				if (bl->lkb_bl_boxes[id].lkb_bu_box)
-				{
-					*bu = bl->lkb_bl_boxes + id;
-					status = 0;
-				}
-				break;
-			}
-			id -= IN_BOXLIST_BOXES;
+			down(&b->lkb_b_lock);
+			unqueue_range_waiter(b, &w);
+			up(&b->lkb_b_lock);
 		}
+		if (status == -EWOULDBLOCK)
+			status = -EINTR;
 	}
+
+	if (status < 0)
+		kfree(r);
+
+	clean_box_holder(pf->lkb_pf_vault, b);
 	return status;
 }
 
 static int
-lockbox_close_box(	lockbox_perfile *pf,
-			lockbox_t	id)
+lockbox_unlock_range(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	offset,
+			uint32_t	size)
 {
 	lockbox_boxuse *bu;
+	int need_wakeup = 0;
+	lockbox_box *b = 0;
 	int status = down_interruptible(&pf->lkb_pf_lock);
 
 	if (status < 0)
@@ -889,39 +4662,84 @@ lockbox_close_box(	lockbox_perfile *pf,
 	status = lockbox_find_box(pf, id, &bu);
 	if (status >= 0)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		bu->lkb_bu_box = 0;
-		release_box(pf->lkb_pf_vault, b, bu->lkb_bu_locks_held);
-		status = 0;
+		b = bu->lkb_bu_box;
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			lockbox_range **ploc;
+
+			status = -ENOENT;
+			for (ploc = &b->lkb_b_ranges; *ploc; ploc = &(*ploc)->lkb_r_next)
+			{
+				lockbox_range *r = *ploc;
+
+				if (r->lkb_r_owner == bu &&
+				    r->lkb_r_offset == offset &&
+				    r->lkb_r_size == size)
+				{
+					*ploc = r->lkb_r_next;
+					wake_range_waiters(b, offset, size);
+					kfree(r);
+					status = 0;
+					break;
+				}
+			}
+
+			/* Whole box data lock waiters can only proceed once
+			 * the last range has gone.
+			 */
+			if (!status && !b->lkb_b_ranges)
+			{
+				fast_drop_ranges(b);
+				need_wakeup = 1;
+				++b->lkb_b_holders;
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
+	if (need_wakeup)
+	{
+		wake_box_sleepers(b, 0);
+		clean_box_holder(pf->lkb_pf_vault, b);
 	}
 	up(&pf->lkb_pf_lock);
 	return status;
 }
 
+/* Find a box of one of the types in the mask types (a bit for each
+ * type) that the caller may use with the given access, and hold it
+ * so that it stays around while the caller sleeps.
+ */
 static int
-lockbox_size(	lockbox_perfile *pf,
-		lockbox_t	id)
+hold_typed(	lockbox_perfile *pf,
+		lockbox_t	id,
+		uint32_t	types,
+		int		access,
+		lockbox_boxuse	**pbu)
 {
-	lockbox_boxuse *bu;
-	int status = down_interruptible(&pf->lkb_pf_lock);
+	int	status;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
 
 	if (status < 0)
 		return status;
 
-	status = lockbox_find_box(pf, id, &bu);
+	status = lockbox_find_box(pf, id, pbu);
 	if (status >= 0)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
+		lockbox_box *b = (*pbu)->lkb_bu_box;
 
 		status = down_interruptible(&b->lkb_b_lock);
 
 		if (status >= 0)
 		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			if (!(types & (1 << b->lkb_b_type)))
+				status = -EINVAL;
+			else if (!lockbox_access_ok(b->lkb_b_acl, access))
 				status = -EPERM;
 			else
-				status = b->lkb_b_size;
+				++b->lkb_b_holders;
 			up(&b->lkb_b_lock);
 		}
 	}
@@ -929,257 +4747,535 @@ lockbox_size(	lockbox_perfile *pf,
 	return status;
 }
 
+/* Add *pm to the end of the queue if there is room, in which case
+ * *pm is cleared. Returns zero if the caller should wait.
+ */
 static int
-lockbox_get_data(lockbox_perfile *pf,
-		lockbox_t	id,
-		char		*buffer,
-		size_t		size,
-		off_t		offset)
+queue_try_push(	lockbox_perfile *pf,
+		lockbox_boxuse	*bu,
+		lockbox_box	*b,
+		lockbox_message	**pm,
+		int		*status)
+{
+	lockbox_queue *q = b->lkb_b_queue;
+	int	retval = 1;
+
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
+	{
+		*status = -EINTR;
+		return 1;
+	}
+	if (bu->lkb_bu_box != b)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -ENOENT;
+		return 1;
+	}
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -EINTR;
+		return 1;
+	}
+	if (q->lkb_q_count >= q->lkb_q_capacity)
+	{
+		*status = -EWOULDBLOCK;
+		retval = 0;
+	}
+	else
+	{
+		if (q->lkb_q_tail)
+			q->lkb_q_tail->lkb_m_next = *pm;
+		else
+			q->lkb_q_head = *pm;
+		q->lkb_q_tail = *pm;
+		++q->lkb_q_count;
+		*pm = 0;
+		*status = 0;
+		wake_up(&q->lkb_q_popq);
+		if (b->lkb_b_eventfds)
+			signal_eventfds(b, 0);
+	}
+	up(&b->lkb_b_lock);
+	up(&pf->lkb_pf_lock);
+	return retval;
+}
+
+static int
+lockbox_queue_push(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char const	*buffer,
+			size_t		size,
+			uint32_t	flags)
 {
 	lockbox_boxuse *bu;
-	int status;
+	lockbox_box *b;
+	lockbox_queue *q;
+	lockbox_message *m;
+	int	status;
 
-	if (offset < 0)
-		return -EINVAL;
-	status = down_interruptible(&pf->lkb_pf_lock);
+	if (size > LKB_QUEUE_MSG_MAX)
+		return -EMSGSIZE;
+	m = kmalloc(sizeof(lockbox_message) + size, GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+	m->lkb_m_next = 0;
+	m->lkb_m_size = size;
+	if (copy_from_user(m->lkb_m_data, buffer, size))
+	{
+		kfree(m);
+		return -EFAULT;
+	}
 
+	status = hold_typed(pf,
+			    id,
+			    (1 << LKB_TYPE_QUEUE) | (1 << LKB_TYPE_LOG),
+			    LKB_ACCESS_WRITE,
+			    &bu);
 	if (status < 0)
+	{
+		kfree(m);
 		return status;
+	}
+	b = bu->lkb_bu_box;
+	q = b->lkb_b_queue;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	if (b->lkb_b_log)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
+		/* A log never fills up, it forgets its oldest record */
+		lockbox_log *l = b->lkb_b_log;
+		lockbox_message **slot;
 
-		status = down_interruptible(&b->lkb_b_lock);
+		down(&b->lkb_b_lock);
+		slot = l->lkb_l_records + l->lkb_l_head % l->lkb_l_capacity;
+		if (*slot)
+			kfree(*slot);
+		*slot = m;
+		++l->lkb_l_head;
+		if (b->lkb_b_eventfds)
+			signal_eventfds(b, 0);
+		up(&b->lkb_b_lock);
+		wake_up_all(&l->lkb_l_waitq);
+		clean_box_holder(pf->lkb_pf_vault, b);
+		return 0;
+	}
 
-		if (status >= 0)
-		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
-			{
-				status = -EPERM;
-			}
-			else if (offset >= b->lkb_b_size)
-			{
-				status = 0;
-			}
-			else
-			{
-				if (offset + size > b->lkb_b_size)
-					size = b->lkb_b_size - offset;
-				if (copy_to_user(buffer, b->lkb_b_data + offset, size))
-					status = -EFAULT;
-				else
-					status = size;
-			}
-			up(&b->lkb_b_lock);
-		}
+	if (flags & LKB_LOCK_NOBLOCK)
+	{
+		queue_try_push(pf, bu, b, &m, &status);
 	}
-	up(&pf->lkb_pf_lock);
+	else
+	{
+		status = -EWOULDBLOCK;
+		wait_event_interruptible_exclusive(q->lkb_q_pushq,
+				queue_try_push(pf, bu, b, &m, &status));
+		if (status == -EWOULDBLOCK)
+			status = -EINTR;
+	}
+
+	if (m)
+	{
+		/* We may have taken a wakeup meant for another producer */
+		kfree(m);
+		down(&b->lkb_b_lock);
+		if (q->lkb_q_count < q->lkb_q_capacity)
+			wake_up(&q->lkb_q_pushq);
+		up(&b->lkb_b_lock);
+	}
+	clean_box_holder(pf->lkb_pf_vault, b);
 	return status;
 }
 
+/* Take the message at the head of the queue if there is one and it
+ * fits in bufsize bytes. Returns zero if the caller should wait.
+ */
 static int
-lockbox_set_data(lockbox_perfile *pf,
-		lockbox_t	id,
-		char const	*buffer,
-		size_t		size,
-		off_t		offset)
+queue_try_pop(	lockbox_perfile *pf,
+		lockbox_boxuse	*bu,
+		lockbox_box	*b,
+		size_t		bufsize,
+		lockbox_message	**pm,
+		size_t		*sizeneeded,
+		int		*status)
 {
-	lockbox_boxuse *bu;
-	int status;
+	lockbox_queue *q = b->lkb_b_queue;
+	lockbox_message *m;
+	int	retval = 1;
 
-	if (offset < 0)
-		return -EINVAL;
-	status = down_interruptible(&pf->lkb_pf_lock);
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
+	{
+		*status = -EINTR;
+		return 1;
+	}
+	if (bu->lkb_bu_box != b)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -ENOENT;
+		return 1;
+	}
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -EINTR;
+		return 1;
+	}
+	m = q->lkb_q_head;
+	if (!m)
+	{
+		*status = -EWOULDBLOCK;
+		retval = 0;
+	}
+	else if (m->lkb_m_size > bufsize)
+	{
+		*sizeneeded = m->lkb_m_size;
+		*status = -ENOMEM;
+	}
+	else
+	{
+		q->lkb_q_head = m->lkb_m_next;
+		if (!q->lkb_q_head)
+			q->lkb_q_tail = 0;
+		--q->lkb_q_count;
+		*pm = m;
+		*status = 0;
+		wake_up(&q->lkb_q_pushq);
+	}
+	up(&b->lkb_b_lock);
+	up(&pf->lkb_pf_lock);
+	return retval;
+}
+
+static int
+lockbox_queue_pop(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char		*buffer,
+			size_t		bufsize,
+			uint32_t	flags,
+			size_t		*sizeneeded)
+{
+	lockbox_boxuse *bu;
+	lockbox_box *b;
+	lockbox_queue *q;
+	lockbox_message *m = 0;
+	int	status;
 
+	status = hold_typed(pf,
+			    id,
+			    1 << LKB_TYPE_QUEUE,
+			    LKB_ACCESS_READ | LKB_ACCESS_WRITE,
+			    &bu);
 	if (status < 0)
 		return status;
+	b = bu->lkb_bu_box;
+	q = b->lkb_b_queue;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	if (flags & LKB_LOCK_NOBLOCK)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		status = down_interruptible(&b->lkb_b_lock);
+		queue_try_pop(pf, bu, b, bufsize, &m, sizeneeded, &status);
+	}
+	else
+	{
+		status = -EWOULDBLOCK;
+		wait_event_interruptible_exclusive(q->lkb_q_popq,
+				queue_try_pop(pf, bu, b, bufsize, &m, sizeneeded, &status));
+		if (status == -EWOULDBLOCK)
+			status = -EINTR;
+	}
 
-		if (status >= 0)
+	if (m)
+	{
+		*sizeneeded = m->lkb_m_size;
+		if (copy_to_user(buffer, m->lkb_m_data, m->lkb_m_size))
+		{
+			/* Put it back for somebody else */
+			down(&b->lkb_b_lock);
+			m->lkb_m_next = q->lkb_q_head;
+			q->lkb_q_head = m;
+			if (!q->lkb_q_tail)
+				q->lkb_q_tail = m;
+			++q->lkb_q_count;
+			up(&b->lkb_b_lock);
+			status = -EFAULT;
+		}
+		else
 		{
-			size_t new_size = offset + size;
+			status = m->lkb_m_size;
+			kfree(m);
+			m = 0;
+		}
+	}
+	if (status < 0)
+	{
+		/* We may have taken a wakeup meant for another consumer */
+		down(&b->lkb_b_lock);
+		if (q->lkb_q_head)
+			wake_up(&q->lkb_q_popq);
+		up(&b->lkb_b_lock);
+	}
+	clean_box_holder(pf->lkb_pf_vault, b);
+	return status;
+}
 
-			if (b->lkb_b_userlocks & LKB_LOCK_DATA & ~bu->lkb_bu_locks_held)
-			{
-				status = -EBUSY;
-			}
-			else if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_WRITE))
-			{
-				status = -EPERM;
-			}
-			else if (new_size > b->lkb_b_size)
-			{
-				char *new_data = opt_alloc(new_size);
+/* Copy as many of the log records after the cursor of bu as fit in
+ * bufsize bytes, each a lockbox_log_record followed by the record's
+ * bytes padded to LKB_LOG_RECORD_SIZE, and move the cursor past them.
+ * If the oldest of those records have been overwritten, the copy
+ * starts at the oldest left and the number skipped is stored in
+ * *lost. Returns zero if the caller should wait for a record.
+ */
+static int
+log_try_read(	lockbox_perfile *pf,
+		lockbox_boxuse	*bu,
+		lockbox_box	*b,
+		char		*buffer,
+		size_t		bufsize,
+		size_t		*sizeneeded,
+		uint32_t	*lost,
+		int		*status)
+{
+	lockbox_log *l = b->lkb_b_log;
+	uint64_t cursor;
+	size_t	used = 0;
+	int	retval = 1;
 
-				if (!new_data)
-				{
-					status = -ENOMEM;
-				}
-				else
-				{
-					if (copy_from_user(new_data + offset,
-								buffer,
-								size))
-					{
-						opt_free(new_data, new_size);
-						status = -EFAULT;
-					}
-					else
-					{
-						int copy_size = b->lkb_b_size;
-
-						if (copy_size > offset)
-							copy_size = offset;
-						memcpy(new_data,
-						       b->lkb_b_data,
-						       copy_size);
-						if (offset > copy_size)
-							memset(new_data + copy_size,
-							       0,
-							       offset - copy_size);
-						opt_free(b->lkb_b_data,
-							b->lkb_b_size);
-						b->lkb_b_data = new_data;
-						b->lkb_b_size = new_size;
-						status = size;
-					}
-				}
-			}
-			else if (copy_from_user(b->lkb_b_data + offset, buffer, size))
-			{
-				status = -EFAULT;
-			}
-			else
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
+	{
+		*status = -EINTR;
+		return 1;
+	}
+	if (bu->lkb_bu_box != b)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -ENOENT;
+		return 1;
+	}
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -EINTR;
+		return 1;
+	}
+
+	cursor = log_oldest(l);
+	if (bu->lkb_bu_cursor < cursor)
+	{
+		uint64_t skipped = cursor - bu->lkb_bu_cursor;
+
+		*lost = skipped > ~(uint32_t) 0 ? ~(uint32_t) 0 : skipped;
+	}
+	else
+	{
+		cursor = bu->lkb_bu_cursor;
+	}
+
+	*status = 0;
+	while (cursor < l->lkb_l_head)
+	{
+		lockbox_message *m = l->lkb_l_records[cursor % l->lkb_l_capacity];
+		lockbox_log_record r;
+		size_t	rsize = LKB_LOG_RECORD_SIZE(m->lkb_m_size);
+		size_t	pad = rsize - sizeof(r) - m->lkb_m_size;
+
+		if (used + rsize > bufsize)
+		{
+			if (!used)
 			{
-				status = 0;
+				*sizeneeded = rsize;
+				*status = -ENOMEM;
 			}
-			up(&b->lkb_b_lock);
+			break;
+		}
+		r.llr_size = m->lkb_m_size;
+		if (copy_to_user(buffer + used, &r, sizeof(r)) ||
+		    copy_to_user(buffer + used + sizeof(r), m->lkb_m_data, m->lkb_m_size) ||
+		    clear_user(buffer + used + rsize - pad, pad))
+		{
+			*status = -EFAULT;
+			break;
+		}
+		used += rsize;
+		++cursor;
+	}
+	if (*status >= 0)
+	{
+		if (!used)
+		{
+			*status = -EWOULDBLOCK;
+			retval = 0;
+		}
+		else
+		{
+			*status = used;
+			bu->lkb_bu_cursor = cursor;
 		}
 	}
+	up(&b->lkb_b_lock);
 	up(&pf->lkb_pf_lock);
-	return status;
+	return retval;
 }
 
 static int
-lockbox_set_state(lockbox_perfile *pf,
-		lockbox_t	id,
-		uint32_t	state)
+lockbox_read_log(	lockbox_perfile *pf,
+			lockbox_t	id,
+			char		*buffer,
+			size_t		bufsize,
+			uint32_t	flags,
+			size_t		*sizeneeded,
+			uint32_t	*lost)
 {
 	lockbox_boxuse *bu;
-	int status;
-	int need_wakeups = 0;
-	lockbox_box *b = 0;
-
-	status = down_interruptible(&pf->lkb_pf_lock);
+	lockbox_box *b;
+	int	status;
 
+	*lost = 0;
+	status = hold_typed(pf, id, 1 << LKB_TYPE_LOG, LKB_ACCESS_READ, &bu);
 	if (status < 0)
 		return status;
+	b = bu->lkb_bu_box;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	if (flags & LKB_LOCK_NOBLOCK)
 	{
-		b = bu->lkb_bu_box;
-		status = down_interruptible(&b->lkb_b_lock);
-
-		if (status >= 0)
-		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETSTATE))
-			{
-				status = -EPERM;
-			}
-			else if (b->lkb_b_userlocks & LKB_LOCK_STATE & ~bu->lkb_bu_locks_held)
-			{
-				status = -EBUSY;
-			}
-			else
-			{
-				if (state & ~b->lkb_b_state)
-				{
-					need_wakeups = 1;
-					++b->lkb_b_holders;
-				}
-				b->lkb_b_state = state;
-				status = 0;
-			}
-			up(&b->lkb_b_lock);
-		}
+		log_try_read(pf, bu, b, buffer, bufsize, sizeneeded, lost, &status);
 	}
-	up(&pf->lkb_pf_lock);
-	if (need_wakeups)
+	else
 	{
-		wake_box_sleepers(b, 0);
-		clean_box_holder(pf->lkb_pf_vault, b);
+		status = -EWOULDBLOCK;
+		wait_event_interruptible(b->lkb_b_log->lkb_l_waitq,
+			log_try_read(pf, bu, b, buffer, bufsize, sizeneeded, lost, &status));
+		if (status == -EWOULDBLOCK)
+			status = -EINTR;
 	}
+	clean_box_holder(pf->lkb_pf_vault, b);
 	return status;
 }
 
-static int
-lockbox_get_state(lockbox_perfile *pf,
-		lockbox_t	id,
-		uint32_t	*state)
+/* Returns the link to the entry in the map with the key, or to the
+ * null pointer at the end of its bucket if there is none. Call with
+ * the box locked.
+ */
+static lockbox_mapentry **
+map_find(	lockbox_map	*mp,
+		char const	*key,
+		uint32_t	keysize,
+		uint32_t	hash)
 {
-	lockbox_boxuse *bu;
-	int status;
+	lockbox_mapentry **ploc;
 
-	status = down_interruptible(&pf->lkb_pf_lock);
+	for (ploc = mp->lkb_mp_buckets + (hash & (mp->lkb_mp_nbuckets - 1));
+	     *ploc;
+	     ploc = &(*ploc)->lkb_me_next)
+	{
+		if ((*ploc)->lkb_me_hash == hash &&
+		    (*ploc)->lkb_me_keysize == keysize &&
+		    !memcmp((*ploc)->lkb_me_data, key, keysize))
+			break;
+	}
+	return ploc;
+}
 
-	if (status < 0)
-		return status;
+/* Copy the keys in the buckets of the map from *cookie on to buffer,
+ * a whole bucket at a time, as lockbox_map_key entries each followed
+ * by its key padded to LKB_MAP_KEY_SIZE. *cookie is left at the first
+ * bucket not copied. Call with the box locked.
+ */
+static int
+map_keys(	lockbox_map	*mp,
+		char		*buffer,
+		size_t		bufsize,
+		uint32_t	*cookie,
+		size_t		*sizeneeded)
+{
+	uint32_t bucket;
+	size_t	used = 0;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	for (bucket = *cookie; bucket < mp->lkb_mp_nbuckets; ++bucket)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		status = down_interruptible(&b->lkb_b_lock);
+		lockbox_mapentry *e;
+		size_t	needed = 0;
 
-		if (status >= 0)
+		for (e = mp->lkb_mp_buckets[bucket]; e; e = e->lkb_me_next)
+			needed += LKB_MAP_KEY_SIZE(e->lkb_me_keysize);
+		if (used + needed > bufsize)
 		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE))
-			{
-				status = -EPERM;
-			}
-			else
+			if (!used)
 			{
-				*state = b->lkb_b_state;
-				status = 0;
+				*sizeneeded = needed;
+				return -ENOMEM;
 			}
-			up(&b->lkb_b_lock);
+			break;
+		}
+		for (e = mp->lkb_mp_buckets[bucket]; e; e = e->lkb_me_next)
+		{
+			lockbox_map_key k;
+			size_t	pad = LKB_MAP_KEY_SIZE(e->lkb_me_keysize) -
+				      sizeof(k) - e->lkb_me_keysize;
+
+			k.lmk_keysize = e->lkb_me_keysize;
+			k.lmk_valsize = e->lkb_me_valsize;
+			k.lmk_version_lo = (uint32_t) e->lkb_me_version;
+			k.lmk_version_hi = (uint32_t) (e->lkb_me_version >> 32);
+			if (copy_to_user(buffer + used, &k, sizeof(k)) ||
+			    copy_to_user(buffer + used + sizeof(k),
+					 e->lkb_me_data,
+					 e->lkb_me_keysize) ||
+			    clear_user(buffer + used + sizeof(k) + e->lkb_me_keysize,
+				       pad))
+				return -EFAULT;
+			used += LKB_MAP_KEY_SIZE(e->lkb_me_keysize);
 		}
 	}
-	up(&pf->lkb_pf_lock);
-	return status;
+	*cookie = bucket;
+	return used;
 }
 
 static int
-lockbox_set_file(lockbox_perfile *pf,
+lockbox_map_op(	lockbox_perfile *pf,
 		lockbox_t	id,
-		int		fd)
+		uint32_t	op,
+		char const	*key,
+		size_t		keysize,
+		char		*buffer,
+		size_t		bufsize,
+		uint64_t	*version,
+		size_t		*sizeneeded,
+		uint32_t	*cookie)
 {
 	lockbox_boxuse *bu;
-	int status;
-	struct file *f;
-	
-	if (fd < 0)
+	lockbox_mapentry *e = 0;
+	char	*kkey = 0;
+	uint32_t hash = 0;
+	int	status;
+
+	if (op != LKB_MAPOP_KEYS &&
+	    (!keysize || keysize > LKB_MAP_KEY_MAX))
+		return -EINVAL;
+	if (op == LKB_MAPOP_PUT)
 	{
-		if (fd < -1)
-			return -EINVAL;
-		f = 0;
+		if (bufsize > LKB_MAP_VALUE_MAX)
+			return -EMSGSIZE;
+		e = kmalloc(sizeof(lockbox_mapentry) + keysize + bufsize, GFP_KERNEL);
+		if (!e)
+			return -ENOMEM;
+		if (copy_from_user(e->lkb_me_data, key, keysize) ||
+		    copy_from_user(e->lkb_me_data + keysize, buffer, bufsize))
+		{
+			kfree(e);
+			return -EFAULT;
+		}
+		kkey = e->lkb_me_data;
+		e->lkb_me_keysize = keysize;
+		e->lkb_me_valsize = bufsize;
 	}
-	else
+	else if (op != LKB_MAPOP_KEYS)
 	{
-		f = fget(fd);
-		if (!f)
-			return -ENOENT;
+		status = copy_user_data(key, keysize, (void **) &kkey);
+		if (status < 0)
+			return status;
 	}
+	if (kkey)
+		hash = jhash(kkey, keysize, 0);
+	if (e)
+		e->lkb_me_hash = hash;
 
 	status = down_interruptible(&pf->lkb_pf_lock);
 
@@ -1194,141 +5290,246 @@ lockbox_set_file(lockbox_perfile *pf,
 
 			if (status >= 0)
 			{
-				if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETFD))
-				{
+				lockbox_map *mp = b->lkb_b_map;
+				int	writing = (op == LKB_MAPOP_PUT || op == LKB_MAPOP_DELETE);
+				lockbox_mapentry **ploc = 0;
+
+				if (!mp)
+					status = -EINVAL;
+				else if (!lockbox_access_ok(b->lkb_b_acl,
+							    writing ? LKB_ACCESS_WRITE : LKB_ACCESS_READ))
 					status = -EPERM;
+				else if (writing && (locks_held_by_others(b, bu) & LKB_LOCK_DATA))
+					status = -EBUSY;
+				else if (kkey)
+					ploc = map_find(mp, kkey, keysize, hash);
+
+				if (status < 0)
+				{
+					/* Not allowed */
 				}
-				else if (b->lkb_b_userlocks & LKB_LOCK_FILE & ~bu->lkb_bu_locks_held)
+				else if (op == LKB_MAPOP_GET)
 				{
-					status = -EBUSY;
+					lockbox_mapentry *found = *ploc;
+
+					if (!found)
+					{
+						status = -ENOKEY;
+					}
+					else if (*version && *version == found->lkb_me_version)
+					{
+						/* The caller already has this version */
+						status = -EALREADY;
+					}
+					else if (found->lkb_me_valsize > bufsize)
+					{
+						*sizeneeded = found->lkb_me_valsize;
+						status = -ENOMEM;
+					}
+					else if (copy_to_user(buffer,
+							      found->lkb_me_data + keysize,
+							      found->lkb_me_valsize))
+					{
+						status = -EFAULT;
+					}
+					else
+					{
+						*sizeneeded = found->lkb_me_valsize;
+						*version = found->lkb_me_version;
+						status = found->lkb_me_valsize;
+					}
+				}
+				else if (op == LKB_MAPOP_PUT)
+				{
+					if (*ploc)
+					{
+						e->lkb_me_next = (*ploc)->lkb_me_next;
+						kfree(*ploc);
+					}
+					else if (mp->lkb_mp_count >= mp->lkb_mp_capacity)
+					{
+						status = -ENOSPC;
+					}
+					else
+					{
+						e->lkb_me_next = 0;
+						++mp->lkb_mp_count;
+					}
+					if (status >= 0)
+					{
+						*ploc = e;
+						e->lkb_me_version = ++mp->lkb_mp_version;
+						*version = e->lkb_me_version;
+						e = 0;
+						kkey = 0;
+					}
+				}
+				else if (op == LKB_MAPOP_DELETE)
+				{
+					lockbox_mapentry *found = *ploc;
+
+					if (!found)
+					{
+						status = -ENOKEY;
+					}
+					else
+					{
+						*ploc = found->lkb_me_next;
+						kfree(found);
+						--mp->lkb_mp_count;
+						++mp->lkb_mp_version;
+					}
+				}
+				else if (op == LKB_MAPOP_KEYS)
+				{
+					status = map_keys(mp, buffer, bufsize, cookie, sizeneeded);
 				}
 				else
 				{
-					if (b->lkb_b_file)
-						fput(b->lkb_b_file);
-					if (f)
-						get_file(f);
-					b->lkb_b_file = f;
+					status = -EINVAL;
 				}
 				up(&b->lkb_b_lock);
 			}
 		}
 		up(&pf->lkb_pf_lock);
 	}
-	if (f)
-		fput(f);
+	if (e)
+		kfree(e);
+	else if (kkey)
+		opt_free(kkey, keysize);
 	return status;
 }
 
+/* Returns 1 or 0 according to the write permission cached in bu, or
+ * -1 if nothing is cached for the box's current ACL and the current
+ * task's credentials. Safe to call without any locks; the cache is
+ * only trusted if lkb_bu_wseq shows it was not changing as we read it.
+ */
 static int
-lockbox_get_file(lockbox_perfile *pf,
-		lockbox_t	id)
+cached_write_access(	lockbox_boxuse	*bu,
+			lockbox_box	*b)
 {
-	lockbox_boxuse *bu;
-	int status;
-
-	status = down_interruptible(&pf->lkb_pf_lock);
-
-	if (status < 0)
-		return status;
-
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
-	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		status = down_interruptible(&b->lkb_b_lock);
-
-		if (status >= 0)
-		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETFD))
-			{
-				status = -EPERM;
-			}
-			else if (!b->lkb_b_file)
-			{
-				status = -ENOENT;
-			}
-			else if ((status = get_unused_fd()) >= 0)
-			{
-				get_file(b->lkb_b_file);
-				fd_install(status, b->lkb_b_file);
-			}
-			up(&b->lkb_b_lock);
-		}
-	}
-	up(&pf->lkb_pf_lock);
-	return status;
+	uint32_t seq = ACCESS_ONCE(bu->lkb_bu_wseq);
+	int	canwrite;
+
+	smp_rmb();
+	if (bu->lkb_bu_aclgen != ACCESS_ONCE(b->lkb_b_aclgen) ||
+	    bu->lkb_bu_tgid != current->tgid ||
+	    bu->lkb_bu_euid != current_euid() ||
+	    bu->lkb_bu_egid != current_egid() ||
+	    bu->lkb_bu_groups != lkb_current_groups())
+		canwrite = -1;
+	else
+		canwrite = bu->lkb_bu_canwrite;
+	smp_rmb();
+	if ((seq & 1) || seq != ACCESS_ONCE(bu->lkb_bu_wseq))
+		return -1;
+	return canwrite;
 }
 
+/* Check whether the current task may write to b, and cache the answer
+ * in bu. Call with the box locked.
+ */
 static int
-lockbox_get_users(lockbox_perfile *pf,
-		lockbox_t	id)
+cache_write_access(	lockbox_boxuse	*bu,
+			lockbox_box	*b)
 {
-	lockbox_boxuse *bu;
-	int status;
-
-	status = down_interruptible(&pf->lkb_pf_lock);
-
-	if (status < 0)
-		return status;
-
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
-	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		status = down_interruptible(&b->lkb_b_lock);
-
-		if (status >= 0)
-		{
-			status = b->lkb_b_users;
-			up(&b->lkb_b_lock);
-		}
-	}
-	up(&pf->lkb_pf_lock);
-	return status;
+	int	canwrite = lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_WRITE);
+	struct group_info *old = bu->lkb_bu_groups;
+
+	get_group_info(lkb_current_groups());
+	++bu->lkb_bu_wseq;
+	smp_wmb();
+	bu->lkb_bu_aclgen = b->lkb_b_aclgen;
+	bu->lkb_bu_tgid = current->tgid;
+	bu->lkb_bu_euid = current_euid();
+	bu->lkb_bu_egid = current_egid();
+	bu->lkb_bu_groups = lkb_current_groups();
+	bu->lkb_bu_canwrite = canwrite;
+	smp_wmb();
+	++bu->lkb_bu_wseq;
+	if (old)
+		put_group_info(old);
+	return canwrite;
 }
 
+/* Add delta to a counter in the current CPU's shard, without taking
+ * any locks. Returns -EAGAIN if the locks are needed after all,
+ * because the write permission has to be checked or the CPU has no
+ * shard yet. Call under rcu_read_lock.
+ */
 static int
-lockbox_get_name(	lockbox_perfile *pf,
+counter_try_add(	lockbox_perfile *pf,
 			lockbox_t	id,
-			char		*name,
-			size_t		bufsize,
-			size_t		*sizeneeded)
+			uint32_t	index,
+			int64_t		delta)
 {
 	lockbox_boxuse *bu;
-	int status = down_interruptible(&pf->lkb_pf_lock);
+	lockbox_box *b;
+	lockbox_counter *c;
+	lockbox_countershard *cs;
+	int	status = lockbox_find_box(pf, id, &bu);
 
 	if (status < 0)
 		return status;
-
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	b = rcu_dereference(bu->lkb_bu_box);
+	if (!b)
+		return -ENOENT;
+	c = b->lkb_b_counter;
+	if (!c || index >= c->lkb_c_capacity)
+		return -EINVAL;
+	switch (cached_write_access(bu, b))
 	{
-		lockbox_box *b = bu->lkb_bu_box;
-		int len = strlen(b->lkb_b_name) + 1;
+	case 0:
+		return -EPERM;
+
+	case 1:
+		break;
+
+	default:
+		return -EAGAIN;
+	}
 
-		*sizeneeded = len;
-		if (len > bufsize)
-			status = -ENOMEM;
-		else if (copy_to_user(name, b->lkb_b_name, len))
-			status = -EFAULT;
-		else
-			status = 0;
+	cs = c->lkb_c_shards[get_cpu()];
+	if (cs)
+	{
+		++cs->lkb_cs_seq;
+		smp_wmb();
+		cs->lkb_cs_values[index] += delta;
+		smp_wmb();
+		++cs->lkb_cs_seq;
+		status = 0;
 	}
-	up(&pf->lkb_pf_lock);
+	else
+	{
+		status = -EAGAIN;
+	}
+	put_cpu();
 	return status;
 }
 
+/* Add delta to a counter in the current CPU's shard. Handles are
+ * looked up without lkb_pf_lock, so that threads sharing a vault file
+ * do not contend, and boxes are only freed after an RCU grace period.
+ * The locks are only taken the first time the handle is used after
+ * the ACL or the caller's credentials change, and the first time the
+ * CPU adds to one of the box's counters.
+ */
 static int
-lockbox_set_acl(lockbox_perfile *pf,
-		lockbox_t	id,
-		lockbox_acl const *acl)
+lockbox_counter_add(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	index,
+			int64_t		delta)
 {
 	lockbox_boxuse *bu;
 	int status;
 
+	rcu_read_lock();
+	status = counter_try_add(pf, id, index, delta);
+	rcu_read_unlock();
+	if (status != -EAGAIN)
+		return status;
+
 	status = down_interruptible(&pf->lkb_pf_lock);
 
 	if (status < 0)
@@ -1338,297 +5539,489 @@ lockbox_set_acl(lockbox_perfile *pf,
 	if (status >= 0)
 	{
 		lockbox_box *b = bu->lkb_bu_box;
+		lockbox_counter *c = b->lkb_b_counter;
 
-		status = down_interruptible(&b->lkb_b_lock);
-
-		if (status >= 0)
+		if (!c || index >= c->lkb_c_capacity)
 		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_SETACL))
-			{
+			status = -EINVAL;
+		}
+		else if ((status = down_interruptible(&b->lkb_b_lock)) >= 0)
+		{
+			if (!cache_write_access(bu, b))
 				status = -EPERM;
-			}
-			else if (b->lkb_b_userlocks & LKB_LOCK_ACL & ~bu->lkb_bu_locks_held)
-			{
-				status = -EBUSY;
-			}
-			else
+			up(&b->lkb_b_lock);
+		}
+		if (status >= 0)
+		{
+			while (1)
 			{
-				lockbox_acl *new_acl;
+				int	cpu = get_cpu();
+				lockbox_countershard *cs = c->lkb_c_shards[cpu];
+				size_t	size;
 
-				status = get_user_acl(acl, &new_acl);
-
-				if (status >= 0)
+				if (cs)
 				{
-					free_acl(b->lkb_b_acl);
-					b->lkb_b_acl = new_acl;
+					++cs->lkb_cs_seq;
+					smp_wmb();
+					cs->lkb_cs_values[index] += delta;
+					smp_wmb();
+					++cs->lkb_cs_seq;
+					put_cpu();
 					status = 0;
+					break;
+				}
+				put_cpu();
+
+				/* Give this CPU its shard, on a cache line
+				 * of its own.
+				 */
+				size = sizeof(lockbox_countershard) +
+				       c->lkb_c_capacity * sizeof(int64_t);
+				size = (size + SMP_CACHE_BYTES - 1) & ~(SMP_CACHE_BYTES - 1);
+				cs = kmalloc(size, GFP_KERNEL);
+				if (!cs)
+				{
+					status = -ENOMEM;
+					break;
+				}
+				memset(cs, 0, size);
+				smp_wmb();
+				down(&b->lkb_b_lock);
+				if (c->lkb_c_shards[cpu])
+				{
+					kfree(cs);
 				}
+				else
+				{
+					c->lkb_c_shards[cpu] = cs;
+				}
+				up(&b->lkb_b_lock);
 			}
-			up(&b->lkb_b_lock);
 		}
 	}
 	up(&pf->lkb_pf_lock);
 	return status;
 }
 
+/* Take a unit of the semaphore for w if one is free, or queue w for
+ * the next one posted. Returns zero if the caller should wait.
+ */
 static int
-lockbox_get_acl(lockbox_perfile *pf,
-		lockbox_t	id,
-		lockbox_acl	*acl,
-		size_t		size,
-		size_t		*sizeneeded)
+sem_try_wait(	lockbox_perfile *pf,
+		lockbox_boxuse	*bu,
+		lockbox_box	*b,
+		lockbox_semwait	*w,
+		int		*status)
 {
-	lockbox_boxuse *bu;
-	int status;
-
-	status = down_interruptible(&pf->lkb_pf_lock);
-
-	if (status < 0)
-		return status;
+	lockbox_semaphore *sm = b->lkb_b_sem;
+	int	retval = 1;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0)
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
 	{
-		lockbox_box *b = bu->lkb_bu_box;
-
-		status = down_interruptible(&b->lkb_b_lock);
-
-		if (status >= 0)
+		*status = -EINTR;
+		return 1;
+	}
+	if (bu->lkb_bu_box != b)
+	{
+		/* Somebody has closed the box on us! */
+		up(&pf->lkb_pf_lock);
+		*status = -ENOENT;
+		return 1;
+	}
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -EINTR;
+		return 1;
+	}
+	if (w->lkb_sw_granted)
+	{
+		*status = 0;
+	}
+	else if (!w->lkb_sw_queued && sm->lkb_sm_count)
+	{
+		--sm->lkb_sm_count;
+		++bu->lkb_bu_semheld;
+		*status = 0;
+	}
+	else
+	{
+		if (!w->lkb_sw_queued)
 		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETACL))
-			{
-				status = -EPERM;
-			}
-			else
-			{
-				*sizeneeded = LKB_ACL_SIZE(b->lkb_b_acl->la_header.lah_n_entries);
+			lockbox_semwait **ploc = &sm->lkb_sm_waiters;
 
-				if (size < *sizeneeded)
-					status = -ENOMEM;
-				else if (copy_to_user(acl,
-						b->lkb_b_acl,
-						*sizeneeded))
-					status = -EFAULT;
-				else
-					status = 0;
-			}
-			up(&b->lkb_b_lock);
+			while (*ploc)
+				ploc = &(*ploc)->lkb_sw_next;
+			w->lkb_sw_next = 0;
+			*ploc = w;
+			w->lkb_sw_queued = 1;
 		}
+		*status = -EWOULDBLOCK;
+		retval = 0;
 	}
+	up(&b->lkb_b_lock);
 	up(&pf->lkb_pf_lock);
-	return status;
+	return retval;
 }
 
+/* Take a unit of the semaphore of a box of type LKB_TYPE_SEMAPHORE,
+ * waiting up to timeout milliseconds for one, or for ever if timeout
+ * is LKB_WAIT_FOREVER. The unit is given back by lockbox_sem_post or
+ * when the handle is closed.
+ */
 static int
-lockbox_list_boxes(	lockbox_perfile *pf,
-			int	shelf,
-			char	*data,
-			int	buffersize,
-			size_t	*psizeneeded)
+lockbox_sem_wait(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	timeout)
 {
-	int	status = 0;
-	lockbox_vault *v;
-	lockbox_shelf *s;
+	lockbox_boxuse *bu;
+	lockbox_box *b;
+	lockbox_semwait w;
+	int	status;
 
-	v = pf->lkb_pf_vault;
-	if (!v)
-		return -EINVAL;
-	status = find_shelf(v, shelf, 1, &s, 0);
+	status = hold_typed(pf, id, 1 << LKB_TYPE_SEMAPHORE, LKB_ACCESS_WRITE, &bu);
 	if (status < 0)
 		return status;
-	if (s)
-		status = down_interruptible(&s->lkb_s_lock);
-	if (status >= 0)
-	{
-		lockbox_box *b;
-		int	sizeneeded = 1;
+	b = bu->lkb_bu_box;
 
-		if (s)
+	memset(&w, 0, sizeof(w));
+	w.lkb_sw_owner = bu;
+	init_waitqueue_head(&w.lkb_sw_waitq);
+
+	if (!timeout)
+	{
+		/* Never queue, so the caller need not unqueue */
+		down(&b->lkb_b_lock);
+		if (b->lkb_b_sem->lkb_sm_count)
 		{
-			for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
-				sizeneeded += strlen(b->lkb_b_name) + 1;
+			--b->lkb_b_sem->lkb_sm_count;
+			++bu->lkb_bu_semheld;
+			status = 0;
 		}
-		*psizeneeded = sizeneeded;
-		if (sizeneeded <= buffersize)
+		else
 		{
-			char c;
-
-			if (s)
-			{
-				for (b = s->lkb_s_boxlist; b; b = b->lkb_b_next)
-				{
-					int len = strlen(b->lkb_b_name) + 1;
-
-					if (copy_to_user(data, b->lkb_b_name, len))
-					{
-						status = -EFAULT;
-						break;
-					}
-					data += len;
-				}
-			}
-			c = 0;
-			if (copy_to_user(data, &c, 1))
-				status = -EFAULT;
+			status = -EWOULDBLOCK;
+		}
+		up(&b->lkb_b_lock);
+	}
+	else
+	{
+		long	left;
 
+		status = -EWOULDBLOCK;
+		if (timeout == LKB_WAIT_FOREVER)
+		{
+			left = 1;
+			wait_event_interruptible(w.lkb_sw_waitq,
+					sem_try_wait(pf, bu, b, &w, &status));
 		}
 		else
 		{
-			status = -ENOMEM;
+			left = wait_event_interruptible_timeout(w.lkb_sw_waitq,
+					sem_try_wait(pf, bu, b, &w, &status),
+					msecs_to_jiffies(timeout));
 		}
-		if (s)
-			up(&s->lkb_s_lock);
+
+		/* A unit may have been handed over after we stopped
+		 * waiting, in which case keep it.
+		 */
+		down(&b->lkb_b_lock);
+		if (w.lkb_sw_queued)
+			unqueue_sem_waiter(b->lkb_b_sem, &w);
+		else if (w.lkb_sw_granted && bu->lkb_bu_box == b)
+			status = 0;
+		up(&b->lkb_b_lock);
+		if (status == -EWOULDBLOCK)
+			status = left ? -EINTR : -ETIMEDOUT;
 	}
+
+	clean_box_holder(pf->lkb_pf_vault, b);
 	return status;
 }
 
+/* Give back units of the semaphore of a box of type LKB_TYPE_SEMAPHORE,
+ * waking as many waiters. A handle may only post units it took, so the
+ * semaphore never holds more than its capacity.
+ */
 static int
-lockbox_acquire_lock(	lockbox_perfile *pf,
-			lockbox_boxuse *bu,
-			lockbox_box	*b,
-			uint32_t	flags,
-			int		*status)
+lockbox_sem_post(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	units)
 {
-	int	retval = 1;
+	lockbox_boxuse *bu;
+	int status;
 
-	if (bu->lkb_bu_box != b)
-	{
-		/* Somebody has closed the box on us! */
-		*status = -ENOENT;
-		return 1;
-	}
+	status = down_interruptible(&pf->lkb_pf_lock);
 
-	if (down_interruptible(&pf->lkb_pf_lock) < 0)
-	{
-		*status = -EINTR;
-		return 1;
-	}
-	
+	if (status < 0)
+		return status;
 
-	if (down_interruptible(&b->lkb_b_lock) < 0)
-	{
-		*status = -EINTR;
-		retval = 1;
-	}
-	else
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
 	{
-		if (flags & (b->lkb_b_userlocks & ~bu->lkb_bu_locks_held))
-		{
-			*status = -EWOULDBLOCK;
-			retval = 0;
-		}
-		else
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
 		{
-			b->lkb_b_userlocks |= flags;
-			bu->lkb_bu_locks_held |= flags;
-			*status = 0;
-			retval = 1;
+			lockbox_semaphore *sm = b->lkb_b_sem;
+
+			if (!sm)
+				status = -EINVAL;
+			else if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_WRITE))
+				status = -EPERM;
+			else if (units > bu->lkb_bu_semheld)
+				status = -EINVAL;	/* More than this handle took */
+			else
+			{
+				bu->lkb_bu_semheld -= units;
+				grant_semaphore(sm, units);
+				status = 0;
+			}
+			up(&b->lkb_b_lock);
 		}
-		up(&b->lkb_b_lock);
 	}
 	up(&pf->lkb_pf_lock);
-	return retval;
+	return status;
 }
 
+/* Copy the totals of count counters from index on to values */
 static int
-lockbox_lock(	lockbox_perfile *pf,
-		lockbox_t id,
-		uint32_t flags_in)
-{
-	lockbox_boxuse *bu;
-	int	status;
-	uint32_t flags = flags_in & LKB_LOCK_ALL;
-	int	no_block = (flags_in & LKB_LOCK_NOBLOCK) ? 1 : 0;
-	int	waiting;
-	lockbox_box *b = 0;
+lockbox_counter_read(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	index,
+			uint32_t	count,
+			int64_t		*values)
+{
+	lockbox_boxuse *bu;
+	int status;
 
 	status = down_interruptible(&pf->lkb_pf_lock);
 
 	if (status < 0)
 		return status;
 
-	waiting = 0;
-
 	status = lockbox_find_box(pf, id, &bu);
-
 	if (status >= 0)
 	{
-		b = bu->lkb_bu_box;
+		lockbox_box *b = bu->lkb_bu_box;
+
 		status = down_interruptible(&b->lkb_b_lock);
 
 		if (status >= 0)
 		{
-			if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_LOCK))
-			{
+			lockbox_counter *c = b->lkb_b_counter;
+			uint32_t i;
+
+			if (!c ||
+			    index > c->lkb_c_capacity ||
+			    count > c->lkb_c_capacity - index)
+				status = -EINVAL;
+			else if (!lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
 				status = -EPERM;
-			}
-			else
+
+			for (i = 0; i < count && status >= 0; ++i)
 			{
-				++b->lkb_b_holders;
-				status = 0;
+				int64_t	total = 0;
+				int	cpu;
+
+				for_each_possible_cpu(cpu)
+				{
+					lockbox_countershard *cs = c->lkb_c_shards[cpu];
+					uint32_t seq;
+					int64_t	value;
+
+					if (!cs)
+						continue;
+					do
+					{
+						seq = ACCESS_ONCE(cs->lkb_cs_seq);
+						smp_rmb();
+						value = ACCESS_ONCE(cs->lkb_cs_values[index + i]);
+						smp_rmb();
+					} while ((seq & 1) || seq != ACCESS_ONCE(cs->lkb_cs_seq));
+					total += value;
+				}
+				if (copy_to_user(values + i, &total, sizeof(total)))
+					status = -EFAULT;
 			}
 			up(&b->lkb_b_lock);
 		}
 	}
-
 	up(&pf->lkb_pf_lock);
+	return status;
+}
 
-	if (status < 0)
-		return status;
-
-	status = 0;
+/* Whether the state or user count of b satisfies a lockbox_wait_state
+ * call, in which case they are stored in *state and *users. Returns
+ * zero if the caller should wait.
+ */
+static int
+wait_state_try(	lockbox_perfile *pf,
+		lockbox_boxuse	*bu,
+		lockbox_box	*b,
+		lockbox_waitstate_struct *ws,
+		int		*status)
+{
+	uint32_t users;
+	uint32_t state;
 
-	if (no_block)
+	if (down_interruptible(&pf->lkb_pf_lock) < 0)
 	{
-		lockbox_acquire_lock(pf, bu, b, flags, &status);
+		*status = -EINTR;
+		return 1;
 	}
-	else
+	if (bu->lkb_bu_box != b)
 	{
-		status = -EWOULDBLOCK;
-
-		wait_event_interruptible(b->lkb_b_waitq,
-			   lockbox_acquire_lock(pf, bu, b, flags, &status));
-		if (status == -EWOULDBLOCK)
-			status = -EINTR;
+		/* Somebody has closed the box on us! */
+		up(&pf->lkb_pf_lock);
+		*status = -ENOENT;
+		return 1;
+	}
+	if (down_interruptible(&b->lkb_b_lock) < 0)
+	{
+		up(&pf->lkb_pf_lock);
+		*status = -EINTR;
+		return 1;
 	}
+	users = b->lkb_b_users;
+	state = b->lkb_b_state;
+	up(&b->lkb_b_lock);
+	up(&pf->lkb_pf_lock);
 
-	clean_box_holder(pf->lkb_pf_vault, b);
-	return status;
+	if ((ws->mask && (state & ws->mask) == ws->value) ||
+	    (ws->users_lt != LKB_SELECT_DISABLE_USERS_LT && users < ws->users_lt) ||
+	    (ws->users_gt != LKB_SELECT_DISABLE_USERS_GT && users > ws->users_gt))
+	{
+		ws->state = state;
+		ws->users = users;
+		*status = 0;
+		return 1;
+	}
+	*status = -EWOULDBLOCK;
+	return 0;
 }
 
+/* Wait up to ws->timeout milliseconds for the state of a box, masked
+ * with ws->mask, to be ws->value, or for its user count to go below
+ * ws->users_lt or above ws->users_gt. The state and user count that
+ * ended the wait are returned in ws.
+ */
 static int
-lockbox_unlock(	lockbox_perfile *pf,
-		lockbox_t id)
+lockbox_wait_state(	lockbox_perfile *pf,
+			lockbox_waitstate_struct *ws)
 {
 	lockbox_boxuse *bu;
-	int need_wakeup = 0;
-	lockbox_box *b = 0;
-	int status = down_interruptible(&pf->lkb_pf_lock);
+	lockbox_box *b;
+	long	left = 1;
+	int	status;
 
+	if ((ws->value & ~ws->mask) ||
+	    (!ws->mask &&
+	     ws->users_lt == LKB_SELECT_DISABLE_USERS_LT &&
+	     ws->users_gt == LKB_SELECT_DISABLE_USERS_GT))
+		return -EINVAL;
+
+	status = hold_typed(pf, ws->lockboxid, ~(uint32_t) 0, LKB_ACCESS_GETSTATE, &bu);
 	if (status < 0)
 		return status;
+	b = bu->lkb_bu_box;
+
+	status = -EWOULDBLOCK;
+	if (!ws->timeout)
+		wait_state_try(pf, bu, b, ws, &status);
+	else if (ws->timeout == LKB_WAIT_FOREVER)
+		wait_event_interruptible(b->lkb_b_statewaitq,
+				wait_state_try(pf, bu, b, ws, &status));
+	else
+		left = wait_event_interruptible_timeout(b->lkb_b_statewaitq,
+				wait_state_try(pf, bu, b, ws, &status),
+				msecs_to_jiffies(ws->timeout));
+	if (status == -EWOULDBLOCK && ws->timeout)
+		status = left ? -EINTR : -ETIMEDOUT;
 
-	status = lockbox_find_box(pf, id, &bu);
-	if (status >= 0 && bu->lkb_bu_locks_held)
+	clean_box_holder(pf->lkb_pf_vault, b);
+	return status;
+}
+
+/* Have the handle id report the events in events on its box, or stop
+ * reporting them if events is zero. Reporting state or data changes
+ * needs the access that reading them would.
+ */
+static int
+lockbox_watch_box(	lockbox_perfile *pf,
+			lockbox_t	id,
+			uint32_t	events)
+{
+	lockbox_boxuse *bu;
+	lockbox_box *b;
+	lockbox_boxwatch *w = 0;
+	lockbox_boxwatch **ploc;
+	int	status;
+
+	if (events & ~LKB_EVENT_BOX)
+		return -EINVAL;
+	if (events)
 	{
-		b = bu->lkb_bu_box;
-		status = down_interruptible(&b->lkb_b_lock);
+		w = kmalloc(sizeof(lockbox_boxwatch), GFP_KERNEL);
+		if (!w)
+			return -ENOMEM;
+		w->lkb_bw_pf = pf;
+		w->lkb_bw_id = id;
+		w->lkb_bw_events = events;
+	}
 
+	status = down_interruptible(&pf->lkb_pf_lock);
+	if (status >= 0)
+	{
+		status = lockbox_find_box(pf, id, &bu);
+		if (status >= 0)
+		{
+			b = bu->lkb_bu_box;
+			status = down_interruptible(&b->lkb_b_lock);
+		}
 		if (status >= 0)
 		{
-			need_wakeup = 1;
-			++b->lkb_b_holders;
-			b->lkb_b_userlocks &= ~bu->lkb_bu_locks_held;
-			bu->lkb_bu_locks_held = 0;
+			if (((events & (LKB_EVENT_STATE_SET | LKB_EVENT_STATE_CLEARED |
+					 LKB_EVENT_STATE_CHANGES)) &&
+			     !lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_GETSTATE)) ||
+			    ((events & LKB_EVENT_DATA) &&
+			     !lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ)))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				for (ploc = &b->lkb_b_watches; *ploc; ploc = &(*ploc)->lkb_bw_next)
+				{
+					if ((*ploc)->lkb_bw_bu == bu)
+						break;
+				}
+				if (*ploc && w)
+				{
+					(*ploc)->lkb_bw_events = events;
+				}
+				else if (*ploc)
+				{
+					w = *ploc;
+					*ploc = w->lkb_bw_next;
+				}
+				else if (w)
+				{
+					w->lkb_bw_bu = bu;
+					w->lkb_bw_next = 0;
+					*ploc = w;
+					w = 0;
+				}
+				status = 0;
+			}
 			up(&b->lkb_b_lock);
 		}
+		up(&pf->lkb_pf_lock);
 	}
-	if (need_wakeup)
-	{
-		wake_box_sleepers(b, 0);
-		clean_box_holder(pf->lkb_pf_vault, b);
-	}
-	up(&pf->lkb_pf_lock);
+	if (w)
+		kfree(w);
 	return status;
 }
 
@@ -1657,6 +6050,30 @@ set_criterion(	lockbox_boxuse *bu,
 		bu->lkb_bu_select_wantlock = value;
 		break;
 
+	case LKB_SELECT_MESSAGES:
+		bu->lkb_bu_select_messages = value;
+		break;
+
+	case LKB_SELECT_LOG:
+		bu->lkb_bu_select_log = value;
+		break;
+
+	case LKB_SELECT_DATA_CHANGED:
+		/* Setting it again acknowledges the changes so far */
+		if (down_interruptible(&bu->lkb_bu_box->lkb_b_lock) < 0)
+		{
+			status = -EINTR;
+			break;
+		}
+		bu->lkb_bu_select_data = value;
+		bu->lkb_bu_seenversion = bu->lkb_bu_box->lkb_b_version;
+		up(&bu->lkb_bu_box->lkb_b_lock);
+		break;
+
+	case LKB_SELECT_ALL:
+		bu->lkb_bu_select_all = value;
+		break;
+
 	default:
 		status = -EINVAL;
 	}
@@ -1678,41 +6095,277 @@ lockbox_setselectcriterion(	lockbox_perfile	*pf,
 	status = lockbox_find_box(pf, id, &bu);
 	if (status >= 0)
 		status = set_criterion(bu, type, value);
+	if (status >= 0 && bu->lkb_bu_box->lkb_b_eventfds)
+	{
+		down(&bu->lkb_bu_box->lkb_b_lock);
+		signal_eventfds(bu->lkb_bu_box, bu);
+		up(&bu->lkb_bu_box->lkb_b_lock);
+	}
+	up(&pf->lkb_pf_lock);
+	return status;
+}
+
+/* Set the criterion that compares a naturally aligned 32 or 64 bit
+ * word of the data of a box with a value, or clear it if op is 0.
+ */
+static int
+lockbox_setselectdata(	lockbox_perfile	*pf,
+			lockbox_t	id,
+			uint32_t	offset,
+			uint32_t	width,
+			uint32_t	op,
+			uint64_t	value)
+{
+	lockbox_boxuse *bu;
+	int status;
+
+	if (op > LKB_CMP_ALLBITS ||
+	    (op && ((width != 4 && width != 8) || (offset & (width - 1)))))
+		return -EINVAL;
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+
+	if (status < 0)
+		return status;
+
+	status = lockbox_find_box(pf, id, &bu);
+	if (status >= 0)
+	{
+		lockbox_box *b = bu->lkb_bu_box;
+
+		status = down_interruptible(&b->lkb_b_lock);
+
+		if (status >= 0)
+		{
+			if (op && !lockbox_access_ok(b->lkb_b_acl, LKB_ACCESS_READ))
+			{
+				status = -EPERM;
+			}
+			else
+			{
+				bu->lkb_bu_select_cmpop = op;
+				bu->lkb_bu_select_cmpoffset = offset;
+				bu->lkb_bu_select_cmpwidth = width;
+				bu->lkb_bu_select_cmpvalue = value;
+				if (b->lkb_b_eventfds)
+					signal_eventfds(b, bu);
+			}
+			up(&b->lkb_b_lock);
+		}
+	}
 	up(&pf->lkb_pf_lock);
 	return status;
 }
 
+/* Whether the word of the data of b that bu compares is in the
+ * wanted relation to the value. Words beyond the data never are.
+ */
+static int
+data_word_matches(	lockbox_boxuse *bu,
+			lockbox_box *b)
+{
+	uint64_t word;
+	uint64_t value = bu->lkb_bu_select_cmpvalue;
+
+	if (bu->lkb_bu_select_cmpoffset + bu->lkb_bu_select_cmpwidth > b->lkb_b_size)
+		return 0;
+	if (bu->lkb_bu_select_cmpwidth == 4)
+		word = *(uint32_t *) (b->lkb_b_data + bu->lkb_bu_select_cmpoffset);
+	else
+		word = *(uint64_t *) (b->lkb_b_data + bu->lkb_bu_select_cmpoffset);
+
+	switch (bu->lkb_bu_select_cmpop)
+	{
+	case LKB_CMP_EQ:	return word == value;
+	case LKB_CMP_NE:	return word != value;
+	case LKB_CMP_LT:	return word < value;
+	case LKB_CMP_LE:	return word <= value;
+	case LKB_CMP_GT:	return word > value;
+	case LKB_CMP_GE:	return word >= value;
+	case LKB_CMP_ANYBITS:	return (word & value) != 0;
+	case LKB_CMP_ALLBITS:	return (word & value) == value;
+	}
+	return 0;
+}
+
+/* Returns 0 if bu has no criteria, 2 if its criteria are met (any one
+ * of them, or all of them if lkb_bu_select_all is set), or 1 if not.
+ * Call with the box locked.
+ */
 static int
 lockbox_getselectstate(	lockbox_boxuse *bu,
 			lockbox_box *b)
 {
 	int	has_selitem = 0;
+	int	met = 0;
 
 	if (bu->lkb_bu_select_users_lt != LKB_SELECT_DISABLE_USERS_LT)
 	{
-		has_selitem = 1;
+		++has_selitem;
 		if (bu->lkb_bu_select_users_lt > b->lkb_b_users)
-			return 2;
+			++met;
 	}
 	if (bu->lkb_bu_select_users_gt != LKB_SELECT_DISABLE_USERS_GT)
 	{
-		has_selitem = 1;
+		++has_selitem;
 		if (bu->lkb_bu_select_users_gt < b->lkb_b_users)
-			return 2;
+			++met;
 	}
 	if (bu->lkb_bu_select_flags)
 	{
-		has_selitem = 1;
+		++has_selitem;
 		if (bu->lkb_bu_select_flags & b->lkb_b_state)
-			return 2;
+			++met;
+	}
+	if (bu->lkb_bu_select_wantlock)
+	{
+		++has_selitem;
+		if (!(bu->lkb_bu_select_wantlock &
+		      (b->lkb_b_userlocks | fast_locks_held(b, 0))))
+			++met;
+	}
+	if (bu->lkb_bu_select_messages && b->lkb_b_queue)
+	{
+		++has_selitem;
+		if (b->lkb_b_queue->lkb_q_count >= bu->lkb_bu_select_messages)
+			++met;
+	}
+	if (bu->lkb_bu_select_log && b->lkb_b_log)
+	{
+		++has_selitem;
+		if (bu->lkb_bu_cursor < b->lkb_b_log->lkb_l_head)
+			++met;
+	}
+	if (bu->lkb_bu_select_data)
+	{
+		++has_selitem;
+		if (bu->lkb_bu_seenversion != b->lkb_b_version)
+			++met;
+	}
+	if (bu->lkb_bu_select_cmpop)
+	{
+		++has_selitem;
+		if (data_word_matches(bu, b))
+			++met;
+	}
+	if (!has_selitem)
+		return 0;
+	if (bu->lkb_bu_select_all ? met == has_selitem : met != 0)
+		return 2;
+	return 1;
+}
+
+/* The select state of bu, as for lockbox_getselectstate. A lock taken
+ * through the fast path is only released through the kernel if it is
+ * flagged as having waiters, so flag any that bu is waiting for. Call
+ * with the box locked.
+ */
+static int
+select_state_marked(	lockbox_boxuse *bu,
+			lockbox_box *b)
+{
+	int	state;
+
+	do
+	{
+		state = lockbox_getselectstate(bu, b);
+	} while (state == 1 &&
+		 !fast_mark_waiters(b, 0, bu->lkb_bu_select_wantlock &
+					  fast_locks_held(b, 0)));
+	return state;
+}
+
+/* Signal the eventfds of the handles on b whose select criteria are
+ * met, or only that of bu if it is not null. Call with the box locked
+ * after anything that might meet a criterion.
+ */
+static void
+signal_eventfds(	lockbox_box *b,
+			lockbox_boxuse *bu)
+{
+	lockbox_eventfd *ef;
+
+	for (ef = b->lkb_b_eventfds; ef; ef = ef->lkb_ef_next)
+	{
+		if ((!bu || ef->lkb_ef_bu == bu) &&
+		    select_state_marked(ef->lkb_ef_bu, b) == 2)
+			eventfd_signal(ef->lkb_ef_ctx, 1);
+	}
+}
+
+/* Bind the eventfd fd to the handle id, replacing any eventfd already
+ * bound to it, or remove the binding if fd is -1. The eventfd is
+ * signalled straight away if the criteria of id are already met.
+ */
+static int
+lockbox_bind_eventfd(	lockbox_perfile *pf,
+			lockbox_t	id,
+			int		fd)
+{
+	lockbox_boxuse *bu;
+	lockbox_box *b;
+	lockbox_eventfd *ef = 0;
+	lockbox_eventfd **ploc;
+	int	status;
+
+	if (fd != -1)
+	{
+		struct eventfd_ctx *ctx = eventfd_ctx_fdget(fd);
+
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+		ef = kmalloc(sizeof(lockbox_eventfd), GFP_KERNEL);
+		if (!ef)
+		{
+			eventfd_ctx_put(ctx);
+			return -ENOMEM;
+		}
+		ef->lkb_ef_ctx = ctx;
+	}
+
+	status = down_interruptible(&pf->lkb_pf_lock);
+	if (status >= 0)
+	{
+		status = lockbox_find_box(pf, id, &bu);
+		if (status >= 0)
+		{
+			b = bu->lkb_bu_box;
+			status = down_interruptible(&b->lkb_b_lock);
+		}
+		if (status >= 0)
+		{
+			lockbox_eventfd *old = 0;
+
+			for (ploc = &b->lkb_b_eventfds; *ploc; ploc = &(*ploc)->lkb_ef_next)
+			{
+				if ((*ploc)->lkb_ef_bu == bu)
+				{
+					old = *ploc;
+					*ploc = old->lkb_ef_next;
+					break;
+				}
+			}
+			if (ef)
+			{
+				ef->lkb_ef_bu = bu;
+				ef->lkb_ef_next = b->lkb_b_eventfds;
+				b->lkb_b_eventfds = ef;
+				signal_eventfds(b, bu);
+			}
+
+			/* Free the old binding in place of the new one */
+			ef = old;
+			status = 0;
+			up(&b->lkb_b_lock);
+		}
+		up(&pf->lkb_pf_lock);
 	}
-	if (bu->lkb_bu_select_wantlock)
+	if (ef)
 	{
-		has_selitem = 1;
-		if (!(bu->lkb_bu_select_wantlock & b->lkb_b_userlocks))
-			return 2;
+		eventfd_ctx_put(ef->lkb_ef_ctx);
+		kfree(ef);
 	}
-	return has_selitem;
+	return status;
 }
 
 static int
@@ -1943,7 +6596,10 @@ lockbox_createselectfd(lockbox_perfile *pf,
 			status = add_box_to_perfile(pfNew, b, 1);
 
 			if (status >= 0)
+			{
 				++b->lkb_b_users;
+				box_event(b, LKB_EVENT_USERS, b->lkb_b_users);
+			}
 			up(&b->lkb_b_lock);
 			if (status < 0)
 				break;
@@ -2021,7 +6677,9 @@ open_lockbox(	struct inode * inode,
 		return -ENOMEM;
 
 	memset(perfile, 0, sizeof(lockbox_perfile));
-	init_MUTEX(&perfile->lkb_pf_lock);
+	sema_init(&perfile->lkb_pf_lock, 1);
+	spin_lock_init(&perfile->lkb_pf_events.lkb_eq_lock);
+	init_waitqueue_head(&perfile->lkb_pf_events.lkb_eq_waitq);
 	file->private_data = perfile;
 	return 0;
 }
@@ -2036,21 +6694,204 @@ close_lockbox(	struct inode * inode,
 	return 0;
 }
 
+/* Carry out the lockbox_command records in buffer. Commands that fail,
+ * or that ask for LKB_CMD_REPORT, queue an LKB_EVENT_COMPLETED event
+ * for read(). Only whole commands are taken, and the bytes they used
+ * are returned, so a writer can send the rest again.
+ */
 static ssize_t
 write_lockbox(	struct file * file,
 		const char * buffer,
 		size_t count, loff_t *ppos)
 {
-	return -EIO;
+	lockbox_perfile *pf = file->private_data;
+	size_t	done = 0;
+
+	if (!pf || !pf->lkb_pf_vault)
+		return -EIO;
+
+	while (count - done >= sizeof(lockbox_command))
+	{
+		lockbox_command c;
+		char const *data = buffer + done + sizeof(lockbox_command);
+		uint32_t offset;
+		int	status;
+
+		if (copy_from_user(&c, buffer + done, sizeof(c)))
+			return done ? done : -EFAULT;
+		if (c.lc_size > count - done - sizeof(lockbox_command) ||
+		    LKB_COMMAND_SIZE(c.lc_size) > count - done)
+			break;
+
+		status = -EINVAL;
+		if (!(c.lc_flags & ~LKB_CMD_REPORT))
+		{
+			switch (c.lc_op)
+			{
+			case LKB_CMD_SETSTATE:
+				status = lockbox_set_state(pf, c.lc_id, c.lc_value);
+				break;
+
+			case LKB_CMD_SETDATA:
+				status = lockbox_set_data(pf, c.lc_id, data, c.lc_size, c.lc_value);
+				if (status > 0)
+					status = 0;
+				break;
+
+			case LKB_CMD_APPEND:
+				status = lockbox_append_data(pf, c.lc_id, data, c.lc_size, &offset);
+				if (status >= 0)
+					status = offset;
+				break;
+			}
+		}
+
+		/* An interrupted command was not carried out */
+		if (status == -EINTR)
+			return done ? done : status;
+
+		if (status < 0 || (c.lc_flags & LKB_CMD_REPORT))
+		{
+			lockbox_event e;
+
+			init_event(&e, LKB_EVENT_COMPLETED, 0);
+			e.le_id = c.lc_id;
+			e.le_value = ((uint64_t) c.lc_tag << 32) | (uint32_t) status;
+			queue_event(pf, &e, 0);
+		}
+		done += LKB_COMMAND_SIZE(c.lc_size);
+	}
+	if (!done && count)
+		return -EINVAL;
+	return done;
+}
+
+/* Take the next event off the queue, making an LKB_EVENT_OVERFLOW
+ * event first if any were lost. Returns zero if there are none.
+ */
+static int
+next_event(	lockbox_eventqueue *q,
+		lockbox_pendingevent **ppe,
+		lockbox_event	*overflow)
+{
+	int	found = 1;
+
+	spin_lock(&q->lkb_eq_lock);
+	if (q->lkb_eq_lost)
+	{
+		init_event(overflow, LKB_EVENT_OVERFLOW, 0);
+		overflow->le_value = q->lkb_eq_lost;
+		q->lkb_eq_lost = 0;
+		*ppe = 0;
+	}
+	else if (q->lkb_eq_head)
+	{
+		*ppe = q->lkb_eq_head;
+		q->lkb_eq_head = (*ppe)->lkb_pe_next;
+		if (!q->lkb_eq_head)
+			q->lkb_eq_tail = 0;
+		--q->lkb_eq_count;
+	}
+	else
+	{
+		found = 0;
+	}
+	spin_unlock(&q->lkb_eq_lock);
+	return found;
+}
+
+/* Put back an event that would not fit in the caller's buffer */
+static void
+unget_event(	lockbox_eventqueue *q,
+		lockbox_pendingevent *pe,
+		lockbox_event const *overflow)
+{
+	spin_lock(&q->lkb_eq_lock);
+	if (pe)
+	{
+		pe->lkb_pe_next = q->lkb_eq_head;
+		q->lkb_eq_head = pe;
+		if (!q->lkb_eq_tail)
+			q->lkb_eq_tail = pe;
+		++q->lkb_eq_count;
+	}
+	else
+	{
+		q->lkb_eq_lost += overflow->le_value;
+	}
+	spin_unlock(&q->lkb_eq_lock);
+}
+
+static int
+has_events(lockbox_eventqueue *q)
+{
+	return q->lkb_eq_head || q->lkb_eq_lost;
 }
 
+/* Read as many whole events as fit, each a lockbox_event padded to
+ * LKB_EVENT_SIZE, waiting for one unless the file is non-blocking.
+ */
 static ssize_t
 read_lockbox(	struct file * file,
 		char * buffer,
 		size_t count,
 		loff_t *ppos)
 {
-	return -EIO;
+	lockbox_perfile *pf = file->private_data;
+	lockbox_eventqueue *q;
+	ssize_t	done = 0;
+
+	if (!pf || !pf->lkb_pf_vault)
+		return -EIO;
+	q = &pf->lkb_pf_events;
+
+	while (1)
+	{
+		lockbox_pendingevent *pe;
+		lockbox_event overflow;
+		lockbox_event const *e;
+		char const *name;
+		size_t	size;
+		size_t	pad;
+
+		if (!next_event(q, &pe, &overflow))
+		{
+			int	status;
+
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			status = wait_event_interruptible(q->lkb_eq_waitq, has_events(q));
+			if (status < 0)
+				return status;
+			continue;
+		}
+		e = pe ? &pe->lkb_pe_event : &overflow;
+		name = pe ? pe->lkb_pe_name : 0;
+		size = LKB_EVENT_SIZE(e->le_namesize);
+		if (size > count - done)
+		{
+			unget_event(q, pe, &overflow);
+			if (!done)
+				return -EINVAL;
+			break;
+		}
+		pad = size - sizeof(lockbox_event) - e->le_namesize;
+		if (copy_to_user(buffer + done, e, sizeof(lockbox_event)) ||
+		    copy_to_user(buffer + done + sizeof(lockbox_event),
+				 name,
+				 e->le_namesize) ||
+		    clear_user(buffer + done + size - pad, pad))
+		{
+			unget_event(q, pe, &overflow);
+			return done ? done : -EFAULT;
+		}
+		done += size;
+		if (pe)
+			kfree(pe);
+	}
+	return done;
 }
 
 static long
@@ -2098,7 +6939,192 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 							s.name,
 							s.data,
 							s.size,
-							s.acl);
+							s.acl,
+							LKB_TYPE_DATA,
+							0);
+		}
+
+	case LKBCALL_CREATETYPED:
+		{
+			lockbox_createtyped_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_create_new(	pf,
+							s.shelfid,
+							s.name,
+							0,
+							0,
+							s.acl,
+							s.type,
+							s.capacity);
+		}
+
+	case LKBCALL_PUSH:
+		{
+			lockbox_push_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_queue_push(pf, s.lockboxid, s.buffer, s.size, s.flags);
+		}
+
+	case LKBCALL_POP:
+		{
+			lockbox_pop_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_queue_pop(pf, s.lockboxid, s.buffer, s.bufsize, s.flags, &s.sizeneeded);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_READLOG:
+		{
+			lockbox_readlog_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_read_log(pf, s.lockboxid, s.buffer, s.bufsize, s.flags, &s.sizeneeded, &s.lost);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_MAPOP:
+		{
+			lockbox_mapop_struct s;
+			uint64_t version;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			status = lockbox_map_op(pf, s.lockboxid, s.op,
+						s.key, s.keysize,
+						s.buffer, s.bufsize,
+						&version, &s.sizeneeded, &s.cookie);
+			s.version_lo = (uint32_t) version;
+			s.version_hi = (uint32_t) (version >> 32);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_COUNTERADD:
+		{
+			lockbox_counteradd_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_counter_add(pf, s.lockboxid, s.index,
+					(int64_t) (((uint64_t) s.delta_hi << 32) | s.delta_lo));
+		}
+
+	case LKBCALL_COUNTERREAD:
+		{
+			lockbox_counterread_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_counter_read(pf, s.lockboxid, s.index, s.count, s.values);
+		}
+
+	case LKBCALL_SEMWAIT:
+		{
+			lockbox_semwait_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_sem_wait(pf, s.lockboxid, s.timeout);
+		}
+
+	case LKBCALL_SEMPOST:
+		{
+			lockbox_sempost_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_sem_post(pf, s.lockboxid, s.units);
+		}
+
+	case LKBCALL_WAITSTATE:
+		{
+			lockbox_waitstate_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_wait_state(pf, &s);
+			if (status >= 0 && copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_SHELFSTATEOP:
+		{
+			lockbox_shelfstateop_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_shelf_state_op(pf, s.shelfid, s.op, s.operand, &s.result);
+			if (status >= 0 && copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_CLOSESHELF:
+		{
+			lockbox_closeshelf_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_close_shelf(pf, s.shelfid, s.closed, s.nbits);
+		}
+
+	case LKBCALL_GETSTATECOUNTS:
+		{
+			lockbox_getstatecounts_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_get_state_counts(pf, &s);
+			if (status >= 0 && copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_WATCHSHELF:
+		{
+			lockbox_watchshelf_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_watch_shelf(pf, s.shelfid, s.events);
+		}
+
+	case LKBCALL_BINDEVENTFD:
+		{
+			lockbox_bindeventfd_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_bind_eventfd(pf, s.lockboxid, s.fd);
+		}
+
+	case LKBCALL_WATCHBOX:
+		{
+			lockbox_watchbox_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_watch_box(pf, s.lockboxid, s.events);
 		}
 
 	case LKBCALL_OPEN:
@@ -2121,65 +7147,134 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 			return lockbox_close_box(pf, s.lockboxid);
 		}
 
-	case LKBCALL_GETNAME:
+	case LKBCALL_GETNAME:
+		{
+			lockbox_getname_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_get_name(pf,
+						s.lockboxid,
+						s.name,
+						s.bufsize,
+						&s.sizeneeded);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_LISTBOXES:
+		{
+			lockbox_listboxes_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_list_boxes(pf,
+						s.shelfid,
+						s.names,
+						s.bufsize,
+						&s.sizeneeded);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_SIZE:
+		{
+			lockbox_size_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_size(pf, s.lockboxid);
+		}
+
+	case LKBCALL_GETDATA:
+		{
+			lockbox_getdata_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_get_data(pf, s.lockboxid, s.buffer, s.size, s.offset, 0);
+		}
+
+	case LKBCALL_GETVERSION:
+		{
+			lockbox_getversion_struct s;
+			uint64_t version;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_get_version(pf, s.lockboxid, &version);
+			if (status >= 0)
+			{
+				s.version_lo = (uint32_t) version;
+				s.version_hi = (uint32_t) (version >> 32);
+				if (copy_to_user((void *) arg, &s, sizeof(s)))
+					return -EFAULT;
+			}
+			return status;
+		}
+
+	case LKBCALL_GETDATAIF:
 		{
-			lockbox_getname_struct s;
+			lockbox_getdataif_struct s;
+			uint64_t version;
 			int	status;
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			status = lockbox_get_name(pf,
-						s.lockboxid,
-						s.name,
-						s.bufsize,
-						&s.sizeneeded);
-			if (copy_to_user((void *) arg, &s, sizeof(s)))
-				return -EFAULT;
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			status = lockbox_get_data(pf, s.lockboxid, s.buffer, s.size, s.offset, &version);
+			if (status >= 0)
+			{
+				s.version_lo = (uint32_t) version;
+				s.version_hi = (uint32_t) (version >> 32);
+				if (copy_to_user((void *) arg, &s, sizeof(s)))
+					return -EFAULT;
+			}
 			return status;
 		}
 
-	case LKBCALL_LISTBOXES:
+	case LKBCALL_GETDELTA:
 		{
-			lockbox_listboxes_struct s;
+			lockbox_getdelta_struct s;
+			uint64_t version;
 			int	status;
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			status = lockbox_list_boxes(pf,
-						s.shelfid,
-						s.names,
-						s.bufsize,
-						&s.sizeneeded);
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			status = lockbox_get_delta(pf, s.lockboxid, s.buffer, s.bufsize, &version, &s.sizeneeded);
+			s.version_lo = (uint32_t) version;
+			s.version_hi = (uint32_t) (version >> 32);
 			if (copy_to_user((void *) arg, &s, sizeof(s)))
 				return -EFAULT;
 			return status;
 		}
 
-	case LKBCALL_SIZE:
+	case LKBCALL_SETDATA:
 		{
-			lockbox_size_struct s;
+			lockbox_setdata_struct s;
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			return lockbox_size(pf, s.lockboxid);
+			return lockbox_set_data(pf, s.lockboxid, s.buffer, s.size, s.offset);
 		}
 
-	case LKBCALL_GETDATA:
+	case LKBCALL_APPEND:
 		{
-			lockbox_getdata_struct s;
+			lockbox_append_struct s;
+			int	status;
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			return lockbox_get_data(pf, s.lockboxid, s.buffer, s.size, s.offset);
-		}
-
-	case LKBCALL_SETDATA:
-		{
-			lockbox_setdata_struct s;
-
-			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+			status = lockbox_append_data(pf, s.lockboxid, s.buffer, s.size, &s.offset);
+			if (status >= 0 && copy_to_user((void *) arg, &s, sizeof(s)))
 				return -EFAULT;
-			return lockbox_set_data(pf, s.lockboxid, s.buffer, s.size, s.offset);
+			return status;
 		}
 
 	case LKBCALL_SETSTATE:
@@ -2263,7 +7358,7 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			return lockbox_lock(pf, s.lockboxid, s.flags);
+			return lockbox_lock(pf, s.lockboxid, 0, s.flags);
 		}
 
 	case LKBCALL_UNLOCK:
@@ -2272,7 +7367,119 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			return lockbox_unlock(pf, s.lockboxid);
+			return lockbox_unlock(pf, s.lockboxid, 0, LKB_LOCK_ALL);
+		}
+
+	case LKBCALL_LOCKRANGE:
+		{
+			lockbox_lockrange_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_lock_range(pf, s.lockboxid, s.offset, s.size, s.flags);
+		}
+
+	case LKBCALL_UNLOCKRANGE:
+		{
+			lockbox_lockrange_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_unlock_range(pf, s.lockboxid, s.offset, s.size);
+		}
+
+	case LKBCALL_SETSPIN:
+		{
+			lockbox_setspin_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_set_spin(pf, s.lockboxid, s.usecs);
+		}
+
+	case LKBCALL_SETCOALESCE:
+		{
+			lockbox_setcoalesce_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_set_coalesce(pf, s.lockboxid, s.msecs);
+		}
+
+	case LKBCALL_SETPI:
+		{
+			lockbox_setpi_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_set_pi(pf, s.lockboxid, s.enable);
+		}
+
+	case LKBCALL_FASTMAP:
+		{
+			lockbox_fastmap_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_fast_map(pf, s.lockboxid);
+		}
+
+	case LKBCALL_STATEOP:
+		{
+			lockbox_stateop_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_state_op(pf, s.lockboxid, s.op, s.operand, s.compare, &s.old);
+			if (status >= 0 &&
+			    copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL_DATAOP:
+		{
+			lockbox_dataop_struct s;
+			uint64_t old;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_data_op(pf,
+						 s.lockboxid,
+						 s.op,
+						 s.width,
+						 s.offset,
+						 ((uint64_t) s.operand_hi << 32) | s.operand_lo,
+						 ((uint64_t) s.compare_hi << 32) | s.compare_lo,
+						 &old);
+			if (status >= 0)
+			{
+				s.old_lo = (uint32_t) old;
+				s.old_hi = (uint32_t) (old >> 32);
+				if (copy_to_user((void *) arg, &s, sizeof(s)))
+					return -EFAULT;
+			}
+			return status;
+		}
+
+	case LKBCALL_LOCKMULTI:
+		{
+			lockbox_lockmulti_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_lock_multi(pf, s.entries, s.count, s.flags);
+		}
+
+	case LKBCALL_WRITEMULTI:
+		{
+			lockbox_writemulti_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_write_multi(pf, s.entries, 0, s.count);
 		}
 
 	case LKBCALL_SETSELC:
@@ -2284,6 +7491,16 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 			return lockbox_setselectcriterion(pf, s.lockboxid, s.type, s.value);
 		}
 
+	case LKBCALL_SETSELDATA:
+		{
+			lockbox_setselectdata_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_setselectdata(pf, s.lockboxid, s.offset, s.width, s.op,
+					((uint64_t) s.value_hi << 32) | s.value_lo);
+		}
+
 	case LKBCALL_GETSELBOXES:
 		{
 			lockbox_getselectableboxes_struct s;
@@ -2364,7 +7581,117 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 							uint32_to_ptr(s.name),
 							uint32_to_ptr(s.data),
 							s.size,
-							uint32_to_ptr(s.acl));
+							uint32_to_ptr(s.acl),
+							LKB_TYPE_DATA,
+							0);
+		}
+
+	case LKBCALL32_CREATETYPED:
+		{
+			lockbox32_createtyped_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_create_new(	pf,
+							s.shelfid,
+							uint32_to_ptr(s.name),
+							0,
+							0,
+							uint32_to_ptr(s.acl),
+							s.type,
+							s.capacity);
+		}
+
+	case LKBCALL32_PUSH:
+		{
+			lockbox32_push_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_queue_push(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, s.flags);
+		}
+
+	case LKBCALL32_POP:
+		{
+			lockbox32_pop_struct s;
+			size_t	sizeneeded;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			sizeneeded = s.sizeneeded;
+			status = lockbox_queue_pop(pf, s.lockboxid,
+						uint32_to_ptr(s.buffer),
+						s.bufsize,
+						s.flags,
+						&sizeneeded);
+			s.sizeneeded = sizeneeded;
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL32_READLOG:
+		{
+			lockbox32_readlog_struct s;
+			size_t	sizeneeded;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			sizeneeded = s.sizeneeded;
+			status = lockbox_read_log(pf, s.lockboxid,
+						uint32_to_ptr(s.buffer),
+						s.bufsize,
+						s.flags,
+						&sizeneeded,
+						&s.lost);
+			s.sizeneeded = sizeneeded;
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL32_MAPOP:
+		{
+			lockbox32_mapop_struct s;
+			uint64_t version;
+			size_t	sizeneeded;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			sizeneeded = s.sizeneeded;
+			status = lockbox_map_op(pf, s.lockboxid, s.op,
+						uint32_to_ptr(s.key), s.keysize,
+						uint32_to_ptr(s.buffer), s.bufsize,
+						&version, &sizeneeded, &s.cookie);
+			s.sizeneeded = sizeneeded;
+			s.version_lo = (uint32_t) version;
+			s.version_hi = (uint32_t) (version >> 32);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
+	case LKBCALL32_COUNTERREAD:
+		{
+			lockbox32_counterread_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_counter_read(pf, s.lockboxid, s.index, s.count,
+						uint32_to_ptr(s.values));
+		}
+
+	case LKBCALL32_CLOSESHELF:
+		{
+			lockbox32_closeshelf_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_close_shelf(pf, s.shelfid, uint32_to_ptr(s.closed), s.nbits);
 		}
 
 	case LKBCALL32_OPEN:
@@ -2404,7 +7731,51 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (copy_from_user(&s, (void *) arg, sizeof(s)))
 				return -EFAULT;
-			return lockbox_get_data(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, s.offset);
+			return lockbox_get_data(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, s.offset, 0);
+		}
+
+	case LKBCALL32_GETDATAIF:
+		{
+			lockbox32_getdataif_struct s;
+			uint64_t version;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			status = lockbox_get_data(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, s.offset, &version);
+			if (status >= 0)
+			{
+				s.version_lo = (uint32_t) version;
+				s.version_hi = (uint32_t) (version >> 32);
+				if (copy_to_user((void *) arg, &s, sizeof(s)))
+					return -EFAULT;
+			}
+			return status;
+		}
+
+	case LKBCALL32_GETDELTA:
+		{
+			lockbox32_getdelta_struct s;
+			uint64_t version;
+			size_t	sizeneeded;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+			sizeneeded = s.sizeneeded;
+			status = lockbox_get_delta(pf, s.lockboxid,
+						uint32_to_ptr(s.buffer),
+						s.bufsize,
+						&version,
+						&sizeneeded);
+			s.sizeneeded = sizeneeded;
+			s.version_lo = (uint32_t) version;
+			s.version_hi = (uint32_t) (version >> 32);
+			if (copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
 		}
 
 	case LKBCALL32_SETDATA:
@@ -2416,6 +7787,19 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 			return lockbox_set_data(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, s.offset);
 		}
 
+	case LKBCALL32_APPEND:
+		{
+			lockbox32_append_struct s;
+			int	status;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			status = lockbox_append_data(pf, s.lockboxid, uint32_to_ptr(s.buffer), s.size, &s.offset);
+			if (status >= 0 && copy_to_user((void *) arg, &s, sizeof(s)))
+				return -EFAULT;
+			return status;
+		}
+
 	case LKBCALL32_SETACL:
 		{
 			lockbox32_setacl_struct s;
@@ -2461,6 +7845,24 @@ ioctl_lockbox(struct file *file, unsigned int cmd, unsigned long arg)
 				return -EFAULT;
 			return lockbox_createselectfd(pf, 0, uint32_to_ptr(s.entries), s.count, s.targetfd);
 		}
+
+	case LKBCALL32_LOCKMULTI:
+		{
+			lockbox32_lockmulti_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_lock_multi(pf, uint32_to_ptr(s.entries), s.count, s.flags);
+		}
+
+	case LKBCALL32_WRITEMULTI:
+		{
+			lockbox32_writemulti_struct s;
+
+			if (copy_from_user(&s, (void *) arg, sizeof(s)))
+				return -EFAULT;
+			return lockbox_write_multi(pf, 0, uint32_to_ptr(s.entries), s.count);
+		}
 #endif
 
 	default:
@@ -2482,10 +7884,21 @@ check_select_attributes(lockbox_boxuse *bu,
 
 	down(&b->lkb_b_lock);
 
-	state = lockbox_getselectstate(bu, b);
-
+	state = select_state_marked(bu, b);
 	if (state == 1)
+	{
 		poll_wait(f, &b->lkb_b_waitq, pt);
+
+		/* New messages, log records and data changes only
+		 * wake the waiters on the queue, log or data.
+		 */
+		if (bu->lkb_bu_select_messages && b->lkb_b_queue)
+			poll_wait(f, &b->lkb_b_queue->lkb_q_popq, pt);
+		if (bu->lkb_bu_select_log && b->lkb_b_log)
+			poll_wait(f, &b->lkb_b_log->lkb_l_waitq, pt);
+		if (bu->lkb_bu_select_data || bu->lkb_bu_select_cmpop)
+			poll_wait(f, &b->lkb_b_datawaitq, pt);
+	}
 	up(&b->lkb_b_lock);
 
 	return state == 2;
@@ -2502,19 +7915,27 @@ poll_lockbox(	struct file *f,
 
 	if (!pf)
 		return 0;
+
+	/* Events to read() are normal data; select criteria are
+	 * exceptional conditions.
+	 */
+	poll_wait(f, &pf->lkb_pf_events.lkb_eq_waitq, pt);
+	if (has_events(&pf->lkb_pf_events))
+		status |= POLLIN | POLLRDNORM;
+
 	down(&pf->lkb_pf_lock);
 
 	for (i = 0; i < IN_PERFILE_BOXES; ++i)
 	{
 		if (check_select_attributes(pf->lkb_pf_boxes + i, f, pt))
 		{
-			status = POLLIN | POLLPRI;
+			status |= POLLIN | POLLPRI;
 			break;
 		}
 			
 	}
 
-	for (bl = pf->lkb_pf_boxlist; bl && !status; bl = bl->lkb_bl_next)
+	for (bl = pf->lkb_pf_boxlist; bl && !(status & POLLPRI); bl = bl->lkb_bl_next)
 	{
 		for (i = 0; i < IN_BOXLIST_BOXES; ++i)
 		{
@@ -2523,7 +7944,7 @@ poll_lockbox(	struct file *f,
 							f,
 							pt))
 			{
-				status = POLLIN | POLLPRI;
+				status |= POLLIN | POLLPRI;
 				break;
 			}
 		}
@@ -2532,6 +7953,42 @@ poll_lockbox(	struct file *f,
 	return status;
 }
 
+/* Map the fast path lock words of the box open as the handle given by
+ * the offset, in pages. This is called with mmap_sem held, and other
+ * calls fault on user memory with lkb_pf_lock and lkb_b_lock held, so
+ * it takes neither and only maps the page LKBCALL_FASTMAP left.
+ */
+static int
+mmap_lockbox(	struct file *file,
+		struct vm_area_struct *vma)
+{
+	lockbox_perfile *pf = file->private_data;
+	lockbox_boxuse *bu;
+	struct page *page = 0;
+	int	status;
+
+	if (!pf ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE ||
+	    vma->vm_pgoff > 0x7fffffff ||
+	    !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	rcu_read_lock();
+	status = lockbox_find_box(pf, (lockbox_t) vma->vm_pgoff, &bu);
+	if (status >= 0)
+		page = xchg(&bu->lkb_bu_fastpage, 0);
+	rcu_read_unlock();
+	if (status < 0)
+		return status;
+	if (!page)
+		return -ENODEV;
+
+	/* The mapping takes its own reference */
+	status = vm_insert_page(vma, vma->vm_start, page);
+	put_page(page);
+	return status;
+}
+
 static struct
 file_operations lockbox_fops = {
 	read:		read_lockbox,
@@ -2540,7 +7997,8 @@ file_operations lockbox_fops = {
 	compat_ioctl:	ioctl_lockbox,
 	open:		open_lockbox,
 	release:	close_lockbox,
-	poll:		poll_lockbox
+	poll:		poll_lockbox,
+	mmap:		mmap_lockbox
 };
 
 static int
@@ -2553,6 +8011,9 @@ void __exit
 lockbox_exit (void)
 {
 	remove_proc_entry("lockbox", 0);
+
+	/* Coalesced wakeups still queued hold code in this module */
+	flush_scheduled_work();
 	printk("lockbox driver unregistered\n");
 }
 
@@ -2563,7 +8024,7 @@ lockbox_init (void)
 
 	pentry = create_proc_entry("lockbox", S_IFREG | S_IRUGO | S_IWUGO, 0);
 
-	init_MUTEX(&vaultlist_lock);
+	sema_init(&vaultlist_lock, 1);
 
 	if (!pentry)
 	{
@@ -2572,7 +8033,9 @@ lockbox_init (void)
 	}
 
 	pentry->proc_fops = &lockbox_fops;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
 	pentry->owner = THIS_MODULE;
+#endif
 	printk("lockbox driver registered\n");
 	return 0;
 }
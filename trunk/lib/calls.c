@@ -23,9 +23,104 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "linux/lockbox.h"
 
 extern int lockbox_call(void *data);
+extern void *lockbox_map(lockbox_t id);
+
+/* Per handle state for the user space lock fast path, indexed by
+ * handle id.
+ */
+typedef struct
+{
+	lockbox_fastlock volatile *lf_words;	/* Mapped lock words, or null	*/
+	uint32_t	lf_token;		/* Our value in the lock words	*/
+	uint32_t	lf_held;		/* Locks taken without the kernel */
+	int		lf_kernel;		/* Locks taken through the kernel */
+} lockbox_fasthandle;
+
+static lockbox_fasthandle *fast_handles = 0;
+static lockbox_t n_fast_handles = 0;
+
+static lockbox_fasthandle *
+find_fast(lockbox_t id)
+{
+	if (id < 0 || id >= n_fast_handles || !fast_handles[id].lf_words)
+		return 0;
+	return fast_handles + id;
+}
+
+static void
+forget_fast(lockbox_fasthandle *f)
+{
+	munmap((void *) f->lf_words, getpagesize());
+	memset(f, 0, sizeof(*f));
+}
+
+/* Called when the vault is closed */
+void
+lockbox_forget_fast(void)
+{
+	lockbox_t id;
+
+	for (id = 0; id < n_fast_handles; ++id)
+	{
+		if (fast_handles[id].lf_words)
+			forget_fast(fast_handles + id);
+	}
+	free(fast_handles);
+	fast_handles = 0;
+	n_fast_handles = 0;
+}
+
+/* Try to take all of the locks in want with a compare-and-swap on
+ * each lock word. This only succeeds if none of them is held, so
+ * if any is busy give back the ones already taken and let the kernel
+ * deal with it.
+ */
+static int
+fast_lock(	lockbox_t	id,
+		lockbox_fasthandle *f,
+		uint32_t	want)
+{
+	uint32_t taken = 0;
+	int	wake = 0;
+	int	i;
+
+	for (i = 0; i < 4; ++i)
+	{
+		if (!(want & (1 << i)))
+			continue;
+		if (!__sync_bool_compare_and_swap(&f->lf_words->lkf_words[i], 0, f->lf_token))
+			break;
+		taken |= 1 << i;
+	}
+	if (taken == want)
+	{
+		f->lf_held = taken;
+		return 1;
+	}
+	for (i = 0; i < 4; ++i)
+	{
+		if ((taken & (1 << i)) &&
+		    !__sync_bool_compare_and_swap(&f->lf_words->lkf_words[i], f->lf_token, 0))
+			wake = 1;
+	}
+	if (wake)
+	{
+		/* Somebody started waiting for one of them already */
+		lockbox_unlock_struct s;
+
+		s.callid = LKBCALL_UNLOCK;
+		s.lockboxid = id;
+		lockbox_call(&s);
+	}
+	return 0;
+}
 
 int
 lkb_open(	int		shelf,
@@ -57,16 +152,73 @@ lkb_create(	int		shelf,
 	return lockbox_call(&s);
 }
 
+int
+lkb_createtyped(int		shelf,
+		char const *	name,
+		uint32_t	type,
+		uint32_t	capacity,
+		lockbox_acl const *acl)
+{
+	lockbox_createtyped_struct s;
+
+	s.callid = LKBCALL_CREATETYPED;
+	s.shelfid = shelf;
+	s.name = name;
+	s.acl = acl;
+	s.type = type;
+	s.capacity = capacity;
+	return lockbox_call(&s);
+}
+
 int
 lkb_close(	lockbox_t	id)
 {
 	lockbox_close_struct s;
+	lockbox_fasthandle *f = find_fast(id);
 
+	if (f)
+		forget_fast(f);
 	s.callid = LKBCALL_CLOSE;
 	s.lockboxid = id;
 	return lockbox_call(&s);
 }
 
+int
+lkb_closeshelf(	int		shelf)
+{
+	lockbox_closeshelf_struct s;
+	uint32_t *closed = 0;
+	lockbox_t id;
+	int	status;
+
+	/* The kernel marks the handles it closes, so only their fast
+	 * paths are dropped.
+	 */
+	if (n_fast_handles)
+	{
+		closed = calloc((n_fast_handles + 31) / 32, sizeof(uint32_t));
+		if (!closed)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	s.callid = LKBCALL_CLOSESHELF;
+	s.shelfid = shelf;
+	s.nbits = n_fast_handles;
+	s.closed = closed;
+	status = lockbox_call(&s);
+
+	for (id = 0; status > 0 && id < n_fast_handles; ++id)
+	{
+		if ((closed[id / 32] & (1U << (id % 32))) &&
+		    fast_handles[id].lf_words)
+			forget_fast(fast_handles + id);
+	}
+	free(closed);
+	return status;
+}
+
 int
 lkb_getname(	lockbox_t	id,
 		char *		name,
@@ -105,6 +257,30 @@ lkb_listboxes(	int		shelf,
 	return status;
 }
 
+int
+lkb_watchshelf(	int		shelf,
+		uint32_t	events)
+{
+	lockbox_watchshelf_struct s;
+
+	s.callid = LKBCALL_WATCHSHELF;
+	s.shelfid = shelf;
+	s.events = events;
+	return lockbox_call(&s);
+}
+
+int
+lkb_watchbox(	lockbox_t	id,
+		uint32_t	events)
+{
+	lockbox_watchbox_struct s;
+
+	s.callid = LKBCALL_WATCHBOX;
+	s.lockboxid = id;
+	s.events = events;
+	return lockbox_call(&s);
+}
+
 int
 lkb_size(	lockbox_t	id)
 {
@@ -147,6 +323,314 @@ lkb_setdata(	lockbox_t	id,
 	return lockbox_call(&s);
 }
 
+int
+lkb_append(	lockbox_t	id,
+		void	const	*buffer,
+		size_t		bufsize,
+		off_t		*offset)
+{
+	lockbox_append_struct s;
+	int	status;
+
+	s.callid = LKBCALL_APPEND;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.size = bufsize;
+	s.offset = 0;
+	status = lockbox_call(&s);
+	if (status >= 0)
+		*offset = s.offset;
+	return status;
+}
+
+int
+lkb_push(	lockbox_t	id,
+		void	const	*buffer,
+		size_t		size,
+		uint32_t	flags)
+{
+	lockbox_push_struct s;
+
+	s.callid = LKBCALL_PUSH;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.size = size;
+	s.flags = flags;
+	return lockbox_call(&s);
+}
+
+int
+lkb_pop(	lockbox_t	id,
+		void		*buffer,
+		size_t		bufsize,
+		uint32_t	flags,
+		size_t		*sizeneeded)
+{
+	lockbox_pop_struct s;
+	int	status;
+
+	s.callid = LKBCALL_POP;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.bufsize = bufsize;
+	s.flags = flags;
+	s.sizeneeded = 0;
+	status = lockbox_call(&s);
+	*sizeneeded = s.sizeneeded;
+	return status;
+}
+
+int
+lkb_readlog(	lockbox_t	id,
+		void		*buffer,
+		size_t		bufsize,
+		uint32_t	flags,
+		size_t		*sizeneeded,
+		uint32_t	*lost)
+{
+	lockbox_readlog_struct s;
+	int	status;
+
+	s.callid = LKBCALL_READLOG;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.bufsize = bufsize;
+	s.flags = flags;
+	s.sizeneeded = 0;
+	s.lost = 0;
+	status = lockbox_call(&s);
+	*sizeneeded = s.sizeneeded;
+	*lost = s.lost;
+	return status;
+}
+
+static int
+map_op(		lockbox_t	id,
+		uint32_t	op,
+		void const	*key,
+		size_t		keysize,
+		void		*buffer,
+		size_t		bufsize,
+		uint64_t	*version,
+		size_t		*sizeneeded,
+		uint32_t	*cookie)
+{
+	lockbox_mapop_struct s;
+	int	status;
+
+	s.callid = LKBCALL_MAPOP;
+	s.lockboxid = id;
+	s.op = op;
+	s.key = key;
+	s.keysize = keysize;
+	s.buffer = buffer;
+	s.bufsize = bufsize;
+	s.sizeneeded = 0;
+	s.cookie = cookie ? *cookie : 0;
+	s.version_lo = version ? (uint32_t) *version : 0;
+	s.version_hi = version ? (uint32_t) (*version >> 32) : 0;
+	status = lockbox_call(&s);
+	if (sizeneeded)
+		*sizeneeded = s.sizeneeded;
+	if (status >= 0 && cookie)
+		*cookie = s.cookie;
+	if (status >= 0 && version)
+		*version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+	return status;
+}
+
+int
+lkb_mapget(	lockbox_t	id,
+		void const	*key,
+		size_t		keysize,
+		void		*buffer,
+		size_t		bufsize,
+		uint64_t	*version,
+		size_t		*sizeneeded)
+{
+	return map_op(id, LKB_MAPOP_GET, key, keysize, buffer, bufsize,
+			version, sizeneeded, 0);
+}
+
+int
+lkb_mapput(	lockbox_t	id,
+		void const	*key,
+		size_t		keysize,
+		void const	*value,
+		size_t		valsize,
+		uint64_t	*version)
+{
+	return map_op(id, LKB_MAPOP_PUT, key, keysize, (void *) value, valsize,
+			version, 0, 0);
+}
+
+int
+lkb_mapdelete(	lockbox_t	id,
+		void const	*key,
+		size_t		keysize)
+{
+	return map_op(id, LKB_MAPOP_DELETE, key, keysize, 0, 0, 0, 0, 0);
+}
+
+int
+lkb_mapkeys(	lockbox_t	id,
+		void		*buffer,
+		size_t		bufsize,
+		uint32_t	*cookie,
+		size_t		*sizeneeded)
+{
+	return map_op(id, LKB_MAPOP_KEYS, 0, 0, buffer, bufsize,
+			0, sizeneeded, cookie);
+}
+
+int
+lkb_counteradd(	lockbox_t	id,
+		uint32_t	index,
+		int64_t		delta)
+{
+	lockbox_counteradd_struct s;
+
+	s.callid = LKBCALL_COUNTERADD;
+	s.lockboxid = id;
+	s.index = index;
+	s.delta_lo = (uint32_t) delta;
+	s.delta_hi = (uint32_t) ((uint64_t) delta >> 32);
+	return lockbox_call(&s);
+}
+
+int
+lkb_counterread(lockbox_t	id,
+		uint32_t	index,
+		uint32_t	count,
+		int64_t		*values)
+{
+	lockbox_counterread_struct s;
+
+	s.callid = LKBCALL_COUNTERREAD;
+	s.lockboxid = id;
+	s.index = index;
+	s.count = count;
+	s.values = values;
+	return lockbox_call(&s);
+}
+
+int
+lkb_semwait(	lockbox_t	id,
+		uint32_t	timeout)
+{
+	lockbox_semwait_struct s;
+
+	s.callid = LKBCALL_SEMWAIT;
+	s.lockboxid = id;
+	s.timeout = timeout;
+	return lockbox_call(&s);
+}
+
+int
+lkb_sempost(	lockbox_t	id,
+		uint32_t	units)
+{
+	lockbox_sempost_struct s;
+
+	s.callid = LKBCALL_SEMPOST;
+	s.lockboxid = id;
+	s.units = units;
+	return lockbox_call(&s);
+}
+
+int
+lkb_waitstate(	lockbox_t	id,
+		uint32_t	mask,
+		uint32_t	value,
+		uint32_t	users_lt,
+		uint32_t	users_gt,
+		uint32_t	timeout,
+		uint32_t	*state,
+		uint32_t	*users)
+{
+	lockbox_waitstate_struct s;
+	int	status;
+
+	s.callid = LKBCALL_WAITSTATE;
+	s.lockboxid = id;
+	s.mask = mask;
+	s.value = value;
+	s.users_lt = users_lt;
+	s.users_gt = users_gt;
+	s.timeout = timeout;
+	status = lockbox_call(&s);
+	if (status >= 0)
+	{
+		if (state)
+			*state = s.state;
+		if (users)
+			*users = s.users;
+	}
+	return status;
+}
+
+int
+lkb_getversion(	lockbox_t	id,
+		uint64_t	*version)
+{
+	lockbox_getversion_struct s;
+	int	status;
+
+	s.callid = LKBCALL_GETVERSION;
+	s.lockboxid = id;
+	status = lockbox_call(&s);
+	if (!status)
+		*version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+	return status;
+}
+
+int
+lkb_getdataif(	lockbox_t	id,
+		void		*buffer,
+		size_t		bufsize,
+		off_t		offset,
+		uint64_t	*version)
+{
+	lockbox_getdataif_struct s;
+	int	status;
+
+	s.callid = LKBCALL_GETDATAIF;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.size = bufsize;
+	s.offset = offset;
+	s.version_lo = (uint32_t) *version;
+	s.version_hi = (uint32_t) (*version >> 32);
+	status = lockbox_call(&s);
+	if (status >= 0)
+		*version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+	return status;
+}
+
+int
+lkb_getdelta(	lockbox_t	id,
+		void		*buffer,
+		size_t		bufsize,
+		uint64_t	*version,
+		size_t		*sizeneeded)
+{
+	lockbox_getdelta_struct s;
+	int	status;
+
+	s.callid = LKBCALL_GETDELTA;
+	s.lockboxid = id;
+	s.buffer = buffer;
+	s.bufsize = bufsize;
+	s.sizeneeded = 0;
+	s.version_lo = (uint32_t) *version;
+	s.version_hi = (uint32_t) (*version >> 32);
+	status = lockbox_call(&s);
+	*sizeneeded = s.sizeneeded;
+	if (status >= 0)
+		*version = ((uint64_t) s.version_hi << 32) | s.version_lo;
+	return status;
+}
+
 int
 lkb_setstate(	lockbox_t	id,
 		uint32_t	state)
@@ -174,6 +658,29 @@ lkb_getstate(	lockbox_t	id,
 	return status;
 }
 
+int
+lkb_getstatecounts(	lockbox_t	id,
+			uint32_t	*state,
+			uint32_t	*setcounts,
+			uint64_t	*sequence)
+{
+	lockbox_getstatecounts_struct s;
+	int	status;
+
+	s.callid = LKBCALL_GETSTATECOUNTS;
+	s.lockboxid = id;
+	status = lockbox_call(&s);
+	if (!status)
+	{
+		*state = s.state;
+		if (setcounts)
+			memcpy(setcounts, s.setcounts, sizeof(s.setcounts));
+		if (sequence)
+			*sequence = ((uint64_t) s.sequence_hi << 32) | s.sequence_lo;
+	}
+	return status;
+}
+
 int
 lkb_getacl(	lockbox_t	id,
 		lockbox_acl	*acl,
@@ -215,6 +722,213 @@ lkb_setacl(	lockbox_t	id,
 	return lockbox_call(&s);
 }
 
+static int
+state_op(	lockbox_t	id,
+		uint32_t	op,
+		uint32_t	operand,
+		uint32_t	compare,
+		uint32_t	*old)
+{
+	lockbox_stateop_struct s;
+	int	status;
+
+	s.callid = LKBCALL_STATEOP;
+	s.lockboxid = id;
+	s.op = op;
+	s.operand = operand;
+	s.compare = compare;
+	status = lockbox_call(&s);
+	if (!status && old)
+		*old = s.old;
+	return status;
+}
+
+int
+lkb_orstate(	lockbox_t	id,
+		uint32_t	bits,
+		uint32_t	*old)
+{
+	return state_op(id, LKB_STATEOP_OR, bits, 0, old);
+}
+
+int
+lkb_andnotstate(lockbox_t	id,
+		uint32_t	bits,
+		uint32_t	*old)
+{
+	return state_op(id, LKB_STATEOP_ANDNOT, bits, 0, old);
+}
+
+int
+lkb_xorstate(	lockbox_t	id,
+		uint32_t	bits,
+		uint32_t	*old)
+{
+	return state_op(id, LKB_STATEOP_XOR, bits, 0, old);
+}
+
+int
+lkb_casstate(	lockbox_t	id,
+		uint32_t	expected,
+		uint32_t	newstate,
+		uint32_t	*old)
+{
+	return state_op(id, LKB_STATEOP_CAS, newstate, expected, old);
+}
+
+static int
+shelf_state_op(	int		shelf,
+		uint32_t	op,
+		uint32_t	bits,
+		lockbox_shelf_result *result)
+{
+	lockbox_shelfstateop_struct s;
+	int	status;
+
+	s.callid = LKBCALL_SHELFSTATEOP;
+	s.shelfid = shelf;
+	s.op = op;
+	s.operand = bits;
+	status = lockbox_call(&s);
+	if (!status && result)
+		*result = s.result;
+	return status;
+}
+
+int
+lkb_shelforstate(	int		shelf,
+			uint32_t	bits,
+			lockbox_shelf_result *result)
+{
+	return shelf_state_op(shelf, LKB_STATEOP_OR, bits, result);
+}
+
+int
+lkb_shelfandnotstate(	int		shelf,
+			uint32_t	bits,
+			lockbox_shelf_result *result)
+{
+	return shelf_state_op(shelf, LKB_STATEOP_ANDNOT, bits, result);
+}
+
+static int
+data_op(	lockbox_t	id,
+		uint32_t	op,
+		uint32_t	width,
+		off_t		offset,
+		uint64_t	operand,
+		uint64_t	compare,
+		uint64_t	*old)
+{
+	lockbox_dataop_struct s;
+	int	status;
+
+	if (offset < 0 || offset > UINT32_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	s.callid = LKBCALL_DATAOP;
+	s.lockboxid = id;
+	s.op = op;
+	s.width = width;
+	s.offset = offset;
+	s.operand_lo = (uint32_t) operand;
+	s.operand_hi = (uint32_t) (operand >> 32);
+	s.compare_lo = (uint32_t) compare;
+	s.compare_hi = (uint32_t) (compare >> 32);
+	status = lockbox_call(&s);
+	if (!status)
+		*old = ((uint64_t) s.old_hi << 32) | s.old_lo;
+	return status;
+}
+
+int
+lkb_fetchadd32(	lockbox_t	id,
+		off_t		offset,
+		uint32_t	value,
+		uint32_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_ADD, 4, offset, value, 0, &o);
+
+	if (!status && old)
+		*old = (uint32_t) o;
+	return status;
+}
+
+int
+lkb_fetchadd64(	lockbox_t	id,
+		off_t		offset,
+		uint64_t	value,
+		uint64_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_ADD, 8, offset, value, 0, &o);
+
+	if (!status && old)
+		*old = o;
+	return status;
+}
+
+int
+lkb_exchange32(	lockbox_t	id,
+		off_t		offset,
+		uint32_t	value,
+		uint32_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_XCHG, 4, offset, value, 0, &o);
+
+	if (!status && old)
+		*old = (uint32_t) o;
+	return status;
+}
+
+int
+lkb_exchange64(	lockbox_t	id,
+		off_t		offset,
+		uint64_t	value,
+		uint64_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_XCHG, 8, offset, value, 0, &o);
+
+	if (!status && old)
+		*old = o;
+	return status;
+}
+
+int
+lkb_cas32(	lockbox_t	id,
+		off_t		offset,
+		uint32_t	expected,
+		uint32_t	value,
+		uint32_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_CAS, 4, offset, value, expected, &o);
+
+	if (!status && old)
+		*old = (uint32_t) o;
+	return status;
+}
+
+int
+lkb_cas64(	lockbox_t	id,
+		off_t		offset,
+		uint64_t	expected,
+		uint64_t	value,
+		uint64_t	*old)
+{
+	uint64_t o;
+	int	status = data_op(id, LKB_DATAOP_CAS, 8, offset, value, expected, &o);
+
+	if (!status && old)
+		*old = o;
+	return status;
+}
+
 int
 lkb_setfile(	lockbox_t	id,
 		int		fd)
@@ -242,20 +956,226 @@ lkb_lock(	lockbox_t	id,
 		uint32_t	flags)
 {
 	lockbox_lock_struct s;
+	lockbox_fasthandle *f = find_fast(id);
+	int	status;
+
+	if (f &&
+	    !f->lf_held &&
+	    !f->lf_kernel &&
+	    !(f->lf_words->lkf_flags & LKB_FAST_SLOW) &&
+	    fast_lock(id, f, flags & LKB_LOCK_ALL))
+		return 0;
 
 	s.callid = LKBCALL_LOCK;
 	s.lockboxid = id;
 	s.flags = flags;
-	return lockbox_call(&s);
+	status = lockbox_call(&s);
+	if (status >= 0 && f)
+		f->lf_kernel = 1;
+	return status;
 }
 
 int
 lkb_unlock(	lockbox_t	id)
 {
 	lockbox_unlock_struct s;
+	lockbox_fasthandle *f = find_fast(id);
+	int	status;
+
+	if (f && f->lf_held && !f->lf_kernel)
+	{
+		int	slow = 0;
+		int	i;
+
+		/* If a lock word has had the waiters bit set, only the
+		 * kernel can release it.
+		 */
+		for (i = 0; i < 4; ++i)
+		{
+			if ((f->lf_held & (1 << i)) &&
+			    !__sync_bool_compare_and_swap(&f->lf_words->lkf_words[i], f->lf_token, 0))
+				slow = 1;
+		}
+		f->lf_held = 0;
+		if (!slow)
+			return 0;
+	}
 
 	s.callid = LKBCALL_UNLOCK;
 	s.lockboxid = id;
+	status = lockbox_call(&s);
+	if (status >= 0 && f)
+	{
+		f->lf_held = 0;
+		f->lf_kernel = 0;
+	}
+	return status;
+}
+
+int
+lkb_lockmulti(	lockbox_multilock_entry const *entries,
+		size_t		count,
+		uint32_t	flags)
+{
+	lockbox_lockmulti_struct s;
+	int	status;
+	size_t	i;
+
+	s.callid = LKBCALL_LOCKMULTI;
+	s.entries = entries;
+	s.count = count;
+	s.flags = flags;
+	status = lockbox_call(&s);
+	for (i = 0; status >= 0 && i < count; ++i)
+	{
+		lockbox_fasthandle *f = find_fast(entries[i].lml_id);
+
+		if (f)
+			f->lf_kernel = 1;
+	}
+	return status;
+}
+
+int
+lkb_writemulti(	lockbox_multiwrite_entry const *entries,
+		size_t		count)
+{
+	lockbox_writemulti_struct s;
+
+	s.callid = LKBCALL_WRITEMULTI;
+	s.entries = entries;
+	s.count = count;
+	return lockbox_call(&s);
+}
+
+int
+lkb_setfast(	lockbox_t	id,
+		int		enable)
+{
+	lockbox_fastmap_struct s;
+	lockbox_fasthandle *f = find_fast(id);
+	void	*words;
+	int	token;
+
+	if (!enable)
+	{
+		if (f && (f->lf_held || f->lf_kernel))
+		{
+			errno = EBUSY;
+			return -1;
+		}
+		if (f)
+			forget_fast(f);
+		return 0;
+	}
+	if (f)
+		return 0;
+
+	s.callid = LKBCALL_FASTMAP;
+	s.lockboxid = id;
+	token = lockbox_call(&s);
+	if (token < 0)
+		return -1;
+
+	if (id >= n_fast_handles)
+	{
+		lockbox_fasthandle *n = realloc(fast_handles, (id + 1) * sizeof(*n));
+
+		if (!n)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(n + n_fast_handles, 0, (id + 1 - n_fast_handles) * sizeof(*n));
+		fast_handles = n;
+		n_fast_handles = id + 1;
+	}
+
+	words = lockbox_map(id);
+	if (words == MAP_FAILED)
+		return -1;
+	f = fast_handles + id;
+	f->lf_words = words;
+	f->lf_token = token;
+	f->lf_held = 0;
+	f->lf_kernel = 0;
+	return 0;
+}
+
+int
+lkb_setspin(	lockbox_t	id,
+		uint32_t	usecs)
+{
+	lockbox_setspin_struct s;
+
+	s.callid = LKBCALL_SETSPIN;
+	s.lockboxid = id;
+	s.usecs = usecs;
+	return lockbox_call(&s);
+}
+
+int
+lkb_setcoalesce(	lockbox_t	id,
+			uint32_t	msecs)
+{
+	lockbox_setcoalesce_struct s;
+
+	s.callid = LKBCALL_SETCOALESCE;
+	s.lockboxid = id;
+	s.msecs = msecs;
+	return lockbox_call(&s);
+}
+
+int
+lkb_setpi(	lockbox_t	id,
+		int		enable)
+{
+	lockbox_setpi_struct s;
+
+	s.callid = LKBCALL_SETPI;
+	s.lockboxid = id;
+	s.enable = enable;
+	return lockbox_call(&s);
+}
+
+int
+lkb_lockrange(	lockbox_t	id,
+		off_t		offset,
+		size_t		size,
+		uint32_t	flags)
+{
+	lockbox_lockrange_struct s;
+
+	if (offset < 0 || offset > UINT32_MAX || size > UINT32_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	s.callid = LKBCALL_LOCKRANGE;
+	s.lockboxid = id;
+	s.offset = offset;
+	s.size = size;
+	s.flags = flags;
+	return lockbox_call(&s);
+}
+
+int
+lkb_unlockrange(lockbox_t	id,
+		off_t		offset,
+		size_t		size)
+{
+	lockbox_lockrange_struct s;
+
+	if (offset < 0 || offset > UINT32_MAX || size > UINT32_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	s.callid = LKBCALL_UNLOCKRANGE;
+	s.lockboxid = id;
+	s.offset = offset;
+	s.size = size;
+	s.flags = 0;
 	return lockbox_call(&s);
 }
 
@@ -273,6 +1193,25 @@ lkb_setselectcriterion(	lockbox_t	id,
 	return lockbox_call(&s);
 }
 
+int
+lkb_setselectdata(	lockbox_t	id,
+			uint32_t	offset,
+			uint32_t	width,
+			uint32_t	op,
+			uint64_t	value)
+{
+	lockbox_setselectdata_struct s;
+
+	s.callid = LKBCALL_SETSELDATA;
+	s.lockboxid = id;
+	s.offset = offset;
+	s.width = width;
+	s.op = op;
+	s.value_lo = (uint32_t) value;
+	s.value_hi = (uint32_t) (value >> 32);
+	return lockbox_call(&s);
+}
+
 int
 lkb_getselectableboxes( size_t		arraysize,
 			lockbox_t	*array)
@@ -293,3 +1232,15 @@ lkb_resetallselects(void)
 	s.callid = LKBCALL_RSTSELCS;
 	return lockbox_call(&s);
 }
+
+int
+lkb_bindeventfd(	lockbox_t	id,
+			int		fd)
+{
+	lockbox_bindeventfd_struct s;
+
+	s.callid = LKBCALL_BINDEVENTFD;
+	s.lockboxid = id;
+	s.fd = fd;
+	return lockbox_call(&s);
+}
@@ -23,10 +23,14 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "linux/lockbox.h"
 
 static int fd = -1;
 
+extern void lockbox_forget_fast(void);
+
 char const lockbox_file_name[] = "/proc/lockbox";
 
 int
@@ -40,6 +44,19 @@ lockbox_call(void *data)
 	return ioctl(fd, LOCKBOX_IOCTL_CALL, data);
 }
 
+/* Map the fast path lock words for a handle */
+void *
+lockbox_map(lockbox_t id)
+{
+	if (fd < 0)
+	{
+		errno = EIO;
+		return MAP_FAILED;
+	}
+	return mmap(0, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, (off_t) id * getpagesize());
+}
+
 int
 lkb_openvault(char const *vaultid)
 {
@@ -81,6 +98,7 @@ lkb_closevault(void)
 {
 	if (fd != -1)
 	{
+		lockbox_forget_fast();
 		close(fd);
 		fd = -1;
 	}
@@ -26,15 +26,20 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
 #include "lockbox.h"
 
 static int	status = 0;
 
-#define EQ_OK(x, y) if ((x) != y) { fprintf(stderr, "Test failed at line %d: %s != %s\n", __LINE__, #x, #y); status = 1; };
-#define NE_OK(x, y) if ((x) == y) { fprintf(stderr, "Test failed at line %d: %s == %s\n", __LINE__, #x, #y); status = 1; };
-#define GE_OK(x, y) if ((x) < y) { fprintf(stderr, "Test failed at line %d: %s < %s\n", __LINE__, #x, #y); status = 1; };
-#define LE_OK(x, y) if ((x) > y) { fprintf(stderr, "Test failed at line %d: %s > %s\n", __LINE__, #x, #y); status = 1; };
+#define EQ_OK(x, y) if ((x) != (y)) { fprintf(stderr, "Test failed at line %d: %s != %s\n", __LINE__, #x, #y); status = 1; };
+#define NE_OK(x, y) if ((x) == (y)) { fprintf(stderr, "Test failed at line %d: %s == %s\n", __LINE__, #x, #y); status = 1; };
+#define GE_OK(x, y) if ((x) < (y)) { fprintf(stderr, "Test failed at line %d: %s < %s\n", __LINE__, #x, #y); status = 1; };
+#define LE_OK(x, y) if ((x) > (y)) { fprintf(stderr, "Test failed at line %d: %s > %s\n", __LINE__, #x, #y); status = 1; };
 #define S_OK(x, y) if (strcmp((x) , y)) { fprintf(stderr, "Test failed at line %d: %s != %s\n", __LINE__, #x, y); status = 1; };
 #define S_NE_OK(x, y) if (!strcmp((x) , y)) { fprintf(stderr, "Test failed at line %d: %s == %s\n", __LINE__, #x, y); status = 1; };
 
@@ -44,6 +49,26 @@ alarm_handler(int i)
 {
 }
 
+/* Returns the kernel's current priority for this process, as shown in
+ * /proc/self/stat. Real-time priorities, including those lent through
+ * priority inheritance, show as negative values.
+ */
+int
+current_priority(void)
+{
+	char	line[512];
+	char	*p;
+	int	prio = 0;
+	FILE	*f = fopen("/proc/self/stat", "r");
+
+	if (!f)
+		return 0;
+	if (fgets(line, sizeof(line), f) && (p = strrchr(line, ')')) != 0)
+		sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %d", &prio);
+	fclose(f);
+	return prio;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -86,6 +111,10 @@ main(int argc, char **argv)
 	if (lb != LOCKBOX_ERROR)
 	{
 		size_t	sizeneeded = -1;
+		uint32_t old32;
+		uint64_t old64;
+		uint64_t version;
+		off_t	end;
 
 		LE_OK(lkb_getname(lb, buffer, 0, &sizeneeded), -1);
 		EQ_OK(errno, ENOMEM);
@@ -143,6 +172,59 @@ main(int argc, char **argv)
 		EQ_OK(lkb_getdata(lb, buffer, 15, 0), 15);
 		S_OK(buffer, "abcuvwxyz");
 
+		memset(buffer, 0, sizeof(buffer));
+		EQ_OK(lkb_setdata(lb, buffer, 8, 24), 8);
+		GE_OK(lkb_fetchadd32(lb, 24, 5, &old32), 0);
+		EQ_OK(old32, 0);
+		GE_OK(lkb_cas32(lb, 24, 4, 9, &old32), 0);
+		EQ_OK(old32, 5);
+		GE_OK(lkb_cas32(lb, 24, 5, 9, &old32), 0);
+		EQ_OK(old32, 5);
+		GE_OK(lkb_exchange32(lb, 24, 0, &old32), 0);
+		EQ_OK(old32, 9);
+		GE_OK(lkb_fetchadd64(lb, 24, 0x100000000ULL, &old64), 0);
+		EQ_OK(old64, 0);
+		GE_OK(lkb_exchange64(lb, 24, 7, &old64), 0);
+		EQ_OK(old64, 0x100000000ULL);
+		GE_OK(lkb_cas64(lb, 24, 7, 0, &old64), 0);
+		EQ_OK(old64, 7);
+		LE_OK(lkb_fetchadd32(lb, 26, 1, &old32), -1);
+		EQ_OK(errno, EINVAL);
+		LE_OK(lkb_fetchadd64(lb, 32, 1, &old64), -1);
+		EQ_OK(errno, EINVAL);
+
+		GE_OK(lkb_getversion(lb, &version), 0);
+		LE_OK(lkb_getdataif(lb, buffer, 3, 0, &version), -1);
+		EQ_OK(errno, EALREADY);
+		old64 = version;
+		EQ_OK(lkb_setdata(lb, "abc", 3, 0), 0);
+		EQ_OK(lkb_getdataif(lb, buffer, 3, 0, &version), 3);
+		NE_OK(version, old64);
+
+		old64 = version;
+		EQ_OK(lkb_setdata(lb, "xy", 2, 1), 0);
+		EQ_OK(lkb_setdata(lb, "z", 1, 3), 0);
+		LE_OK(lkb_getdelta(lb, buffer, 0, &version, &sizeneeded), -1);
+		EQ_OK(errno, ENOMEM);
+		EQ_OK(sizeneeded, LKB_DELTA_SIZE(3));
+		EQ_OK(lkb_getdelta(lb, buffer, sizeof(buffer), &version, &sizeneeded), LKB_DELTA_SIZE(3));
+		EQ_OK(((lockbox_delta_extent *) buffer)->lde_offset, 1);
+		EQ_OK(((lockbox_delta_extent *) buffer)->lde_size, 3);
+		EQ_OK(memcmp(buffer + sizeof(lockbox_delta_extent), "xyz", 3), 0);
+		EQ_OK(version, old64 + 2);
+		EQ_OK(lkb_getdelta(lb, buffer, sizeof(buffer), &version, &sizeneeded), 0);
+		old64 = 0;
+		LE_OK(lkb_getdelta(lb, buffer, sizeof(buffer), &old64, &sizeneeded), -1);
+		EQ_OK(errno, ESTALE);
+
+		EQ_OK(lkb_append(lb, "123", 3, &end), 0);
+		EQ_OK(end, 32);
+		EQ_OK(lkb_append(lb, "45", 2, &end), 0);
+		EQ_OK(end, 35);
+		EQ_OK(lkb_size(lb), 37);
+		EQ_OK(lkb_getdata(lb, buffer, 5, 32), 5);
+		EQ_OK(memcmp(buffer, "12345", 5), 0);
+
 		LE_OK(lkb_getstate(lb, &state), -1);
 		EQ_OK(errno, EPERM);
 
@@ -165,6 +247,19 @@ main(int argc, char **argv)
 		GE_OK(lkb_getstate(lb, &state), 0);
 		EQ_OK(state, 0xa5a5a5a5);
 
+		GE_OK(lkb_orstate(lb, 0x0000000f, &state), 0);
+		EQ_OK(state, 0xa5a5a5a5);
+		GE_OK(lkb_andnotstate(lb, 0x000000f0, &state), 0);
+		EQ_OK(state, 0xa5a5a5af);
+		GE_OK(lkb_xorstate(lb, 0x0000ff00, &state), 0);
+		EQ_OK(state, 0xa5a5a50f);
+		GE_OK(lkb_casstate(lb, 0, 1, &state), 0);
+		EQ_OK(state, 0xa5a55a0f);
+		GE_OK(lkb_casstate(lb, 0xa5a55a0f, 0xa5a5a5a5, &state), 0);
+		EQ_OK(state, 0xa5a55a0f);
+		GE_OK(lkb_getstate(lb, &state), 0);
+		EQ_OK(state, 0xa5a5a5a5);
+
 		LE_OK(lkb_setfile(lb, -1), -1);
 		EQ_OK(errno, EPERM);
 
@@ -252,6 +347,144 @@ main(int argc, char **argv)
 			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA), -1);
 			EQ_OK(errno, EINTR);
 
+			alarm(3);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA | LKB_LOCK_SPIN), -1);
+			EQ_OK(errno, EINTR);
+
+			GE_OK(lkb_setspin(lb2, 1000), 0);
+			alarm(3);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA), -1);
+			EQ_OK(errno, EINTR);
+			GE_OK(lkb_setspin(lb2, 0), 0);
+
+			GE_OK(lkb_setpi(lb2, 1), 0);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA | LKB_LOCK_NOBLOCK), -1);
+			EQ_OK(errno, EWOULDBLOCK);
+			alarm(3);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA), -1);
+			EQ_OK(errno, EINTR);
+
+			/* Retake the lock so that it is backed by an
+			 * rt-mutex, then have a real-time process wait
+			 * for it through the shared vault file.
+			 */
+			GE_OK(lkb_unlock(lb), 0);
+			GE_OK(lkb_lock(lb, LKB_LOCK_DATA), 0);
+			{
+				int	pipefds[2];
+				int	rtstatus = -1;
+				int	boosted = 0;
+				int	i;
+				int	wstatus;
+				pid_t	pid;
+
+				GE_OK(pipe(pipefds), 0);
+				switch(pid = fork())
+				{
+				case 0:
+					{
+						struct sched_param sp;
+
+						sp.sched_priority = 10;
+						rtstatus = sched_setscheduler(0, SCHED_FIFO, &sp);
+						write(pipefds[1], &rtstatus, sizeof(rtstatus));
+						GE_OK(lkb_lock(lb2, LKB_LOCK_DATA), 0);
+						GE_OK(lkb_unlock(lb2), 0);
+					}
+					exit(status);
+					break;
+
+				case -1:
+					perror("fork");
+					GE_OK(lkb_unlock(lb), 0);
+					break;
+
+				default:
+					EQ_OK(read(pipefds[0], &rtstatus, sizeof(rtstatus)), sizeof(rtstatus));
+
+					/* Setting a real-time policy needs
+					 * privilege; without it there is
+					 * nothing to lend.
+					 */
+					for (i = 0; rtstatus == 0 && !boosted && i < 20; ++i)
+					{
+						usleep(50000);
+						boosted = current_priority() < 0;
+					}
+					if (rtstatus == 0)
+						NE_OK(boosted, 0);
+					GE_OK(lkb_unlock(lb), 0);
+					EQ_OK(waitpid(pid, &wstatus, 0), pid);
+					EQ_OK(WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1, 0);
+					break;
+				}
+				close(pipefds[0]);
+				close(pipefds[1]);
+			}
+			GE_OK(lkb_setpi(lb2, 0), 0);
+			GE_OK(lkb_lock(lb, LKB_LOCK_DATA), 0);
+
+			LE_OK(lkb_setfast(lb, 1), -1);
+			EQ_OK(errno, EBUSY);
+			GE_OK(lkb_setfast(lb2, 1), 0);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA | LKB_LOCK_NOBLOCK), -1);
+			EQ_OK(errno, EWOULDBLOCK);
+			GE_OK(lkb_lock(lb2, LKB_LOCK_FILE), 0);
+			LE_OK(lkb_lock(lb, LKB_LOCK_FILE | LKB_LOCK_NOBLOCK), -1);
+			EQ_OK(errno, EWOULDBLOCK);
+			GE_OK(lkb_unlock(lb2), 0);
+			GE_OK(lkb_setfast(lb2, 0), 0);
+
+			{
+				int	lb3;
+				lockbox_multilock_entry ml[2];
+				lockbox_multiwrite_entry mw[2];
+
+				ml[0].lml_id = lb2;
+				ml[0].lml_flags = LKB_LOCK_STATE;
+				ml[1].lml_id = lb;
+				ml[1].lml_flags = LKB_LOCK_FILE;
+				LE_OK(lkb_lockmulti(ml, 2, LKB_LOCK_NOBLOCK), -1);
+				EQ_OK(errno, EINVAL);
+
+				GE_OK(lb3 = lkb_create(0, "test-box-2", "xyz", 3, acl), 0);
+				ml[1].lml_id = lb3;
+				GE_OK(lkb_lockmulti(ml, 2, LKB_LOCK_NOBLOCK), 0);
+				GE_OK(lkb_unlock(lb3), 0);
+				GE_OK(lkb_unlock(lb2), 0);
+				ml[0].lml_flags = LKB_LOCK_DATA;
+				LE_OK(lkb_lockmulti(ml, 2, LKB_LOCK_NOBLOCK), -1);
+				EQ_OK(errno, EWOULDBLOCK);
+
+				mw[0].lmw_id = lb3;
+				mw[0].lmw_op = LKB_MULTI_SETDATA;
+				mw[0].lmw_data = "abc";
+				mw[0].lmw_size = 3;
+				mw[0].lmw_offset = 0;
+				mw[1].lmw_id = lb2;
+				mw[1].lmw_op = LKB_MULTI_SETSTATE;
+				mw[1].lmw_state = 0x11;
+				GE_OK(lkb_writemulti(mw, 2), 0);
+				memset(buffer, 0, sizeof(buffer));
+				EQ_OK(lkb_getdata(lb3, buffer, 3, 0), 3);
+				S_OK(buffer, "abc");
+				GE_OK(lkb_getstate(lb2, &state), 0);
+				EQ_OK(state, 0x11);
+				GE_OK(lkb_setstate(lb2, 0xa5a5a5a5), 0);
+
+				mw[0].lmw_data = "ABC";
+				mw[1].lmw_op = LKB_MULTI_SETDATA;
+				mw[1].lmw_data = "q";
+				mw[1].lmw_size = 1;
+				mw[1].lmw_offset = 0;
+				LE_OK(lkb_writemulti(mw, 2), -1);
+				EQ_OK(errno, EBUSY);
+				memset(buffer, 0, sizeof(buffer));
+				EQ_OK(lkb_getdata(lb3, buffer, 3, 0), 3);
+				S_OK(buffer, "abc");
+				GE_OK(lkb_close(lb3), 0);
+			}
+
 			GE_OK(lkb_lock(lb2, LKB_LOCK_STATE | LKB_LOCK_NOBLOCK), 0);
 
 			GE_OK(lkb_unlock(lb), 0);
@@ -382,6 +615,427 @@ main(int argc, char **argv)
 		GE_OK(lkb_close(lb), 0);
 	}
 
+	NE_OK(lb = lkb_create(0, "range-test", "0123456789", 10, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		GE_OK(lb2 = lkb_open(0, "range-test"), 0);
+		if (lb2 >= 0)
+		{
+			LE_OK(lkb_lockrange(lb, 0, 0, LKB_RANGE_SHARED), -1);
+			EQ_OK(errno, EINVAL);
+			LE_OK(lkb_lockrange(lb, 0, 4, LKB_RANGE_SHARED | LKB_RANGE_EXCLUSIVE), -1);
+			EQ_OK(errno, EINVAL);
+
+			GE_OK(lkb_lockrange(lb, 0, 4, LKB_RANGE_EXCLUSIVE), 0);
+			GE_OK(lkb_lockrange(lb2, 4, 4, LKB_RANGE_EXCLUSIVE | LKB_LOCK_NOBLOCK), 0);
+			LE_OK(lkb_lockrange(lb2, 2, 4, LKB_RANGE_SHARED | LKB_LOCK_NOBLOCK), -1);
+			EQ_OK(errno, EWOULDBLOCK);
+			LE_OK(lkb_lock(lb2, LKB_LOCK_DATA | LKB_LOCK_NOBLOCK), -1);
+			EQ_OK(errno, EWOULDBLOCK);
+
+			GE_OK(lkb_setdata(lb, "ab", 2, 0), 0);
+			LE_OK(lkb_setdata(lb2, "cd", 2, 2), -1);
+			EQ_OK(errno, EBUSY);
+			GE_OK(lkb_setdata(lb2, "ef", 2, 4), 0);
+			GE_OK(lkb_setdata(lb2, "gh", 2, 8), 0);
+
+			alarm(3);
+			LE_OK(lkb_lockrange(lb2, 3, 1, LKB_RANGE_SHARED), -1);
+			EQ_OK(errno, EINTR);
+
+			LE_OK(lkb_unlockrange(lb, 0, 2), -1);
+			EQ_OK(errno, ENOENT);
+			GE_OK(lkb_unlockrange(lb, 0, 4), 0);
+			GE_OK(lkb_lockrange(lb2, 0, 4, LKB_RANGE_SHARED | LKB_LOCK_NOBLOCK), 0);
+			GE_OK(lkb_lockrange(lb, 0, 4, LKB_RANGE_SHARED | LKB_LOCK_NOBLOCK), 0);
+			LE_OK(lkb_setdata(lb, "ij", 2, 0), -1);
+			EQ_OK(errno, EBUSY);
+
+			GE_OK(lkb_close(lb2), 0);
+			GE_OK(lkb_setdata(lb, "ij", 2, 0), 0);
+			GE_OK(lkb_lock(lb, LKB_LOCK_DATA | LKB_LOCK_NOBLOCK), 0);
+			GE_OK(lkb_unlock(lb), 0);
+
+			memset(buffer, 0, sizeof(buffer));
+			EQ_OK(lkb_getdata(lb, buffer, 10, 0), 10);
+			S_OK(buffer, "ij23ef67gh");
+		}
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	LE_OK(lkb_createtyped(0, "queue-test", LKB_TYPE_QUEUE, 0, 0), -1);
+	EQ_OK(errno, EINVAL);
+	NE_OK(lb = lkb_createtyped(0, "queue-test", LKB_TYPE_QUEUE, 2, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		size_t	sizeneeded;
+
+		LE_OK(lkb_setdata(lb, "ab", 2, 0), -1);
+		EQ_OK(errno, EINVAL);
+		LE_OK(lkb_pop(lb, buffer, sizeof(buffer), LKB_LOCK_NOBLOCK, &sizeneeded), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		GE_OK(lkb_push(lb, "first", 5, 0), 0);
+		GE_OK(lkb_push(lb, "second", 6, 0), 0);
+		LE_OK(lkb_push(lb, "third", 5, LKB_LOCK_NOBLOCK), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		LE_OK(lkb_pop(lb, buffer, 2, 0, &sizeneeded), -1);
+		EQ_OK(errno, ENOMEM);
+		EQ_OK(sizeneeded, 5);
+		EQ_OK(lkb_pop(lb, buffer, sizeof(buffer), 0, &sizeneeded), 5);
+		EQ_OK(memcmp(buffer, "first", 5), 0);
+		EQ_OK(lkb_pop(lb, buffer, sizeof(buffer), 0, &sizeneeded), 6);
+		EQ_OK(memcmp(buffer, "second", 6), 0);
+
+		alarm(3);
+		LE_OK(lkb_pop(lb, buffer, sizeof(buffer), 0, &sizeneeded), -1);
+		EQ_OK(errno, EINTR);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_createtyped(0, "log-test", LKB_TYPE_LOG, 2, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		size_t	sizeneeded;
+		uint32_t lost;
+
+		LE_OK(lkb_readlog(lb, buffer, sizeof(buffer), LKB_LOCK_NOBLOCK, &sizeneeded, &lost), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		GE_OK(lkb_push(lb, "a", 1, 0), 0);
+		GE_OK(lkb_push(lb, "bb", 2, 0), 0);
+		GE_OK(lkb_push(lb, "ccc", 3, 0), 0);
+		LE_OK(lkb_readlog(lb, buffer, 4, 0, &sizeneeded, &lost), -1);
+		EQ_OK(errno, ENOMEM);
+		EQ_OK(sizeneeded, LKB_LOG_RECORD_SIZE(2));
+		EQ_OK(lkb_readlog(lb, buffer, sizeof(buffer), 0, &sizeneeded, &lost),
+		      LKB_LOG_RECORD_SIZE(2) + LKB_LOG_RECORD_SIZE(3));
+		EQ_OK(lost, 1);
+		EQ_OK(((lockbox_log_record *) buffer)->llr_size, 2);
+		EQ_OK(memcmp(buffer + sizeof(lockbox_log_record), "bb", 2), 0);
+		LE_OK(lkb_readlog(lb, buffer, sizeof(buffer), LKB_LOCK_NOBLOCK, &sizeneeded, &lost), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_createtyped(0, "map-test", LKB_TYPE_MAP, 2, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		size_t	sizeneeded;
+		uint64_t version = 0;
+		uint64_t old64;
+		uint32_t cookie = 0;
+
+		LE_OK(lkb_mapget(lb, "a", 1, buffer, sizeof(buffer), &version, &sizeneeded), -1);
+		EQ_OK(errno, ENOKEY);
+		GE_OK(lkb_mapput(lb, "a", 1, "one", 3, &version), 0);
+		old64 = version;
+		GE_OK(lkb_mapput(lb, "a", 1, "uno", 3, &version), 0);
+		NE_OK(version, old64);
+		old64 = 0;
+		EQ_OK(lkb_mapget(lb, "a", 1, buffer, sizeof(buffer), &old64, &sizeneeded), 3);
+		EQ_OK(memcmp(buffer, "uno", 3), 0);
+		EQ_OK(old64, version);
+		LE_OK(lkb_mapget(lb, "a", 1, buffer, sizeof(buffer), &old64, &sizeneeded), -1);
+		EQ_OK(errno, EALREADY);
+		GE_OK(lkb_mapput(lb, "b", 1, "two", 3, &version), 0);
+		LE_OK(lkb_mapput(lb, "c", 1, "three", 5, &version), -1);
+		EQ_OK(errno, ENOSPC);
+		EQ_OK(lkb_mapkeys(lb, buffer, sizeof(buffer), &cookie, &sizeneeded), 2 * LKB_MAP_KEY_SIZE(1));
+		EQ_OK(lkb_mapkeys(lb, buffer, sizeof(buffer), &cookie, &sizeneeded), 0);
+		GE_OK(lkb_mapdelete(lb, "a", 1), 0);
+		LE_OK(lkb_mapdelete(lb, "a", 1), -1);
+		EQ_OK(errno, ENOKEY);
+		GE_OK(lkb_mapput(lb, "c", 1, "three", 5, &version), 0);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_createtyped(0, "counter-test", LKB_TYPE_COUNTER, 2, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		int64_t	values[2];
+
+		GE_OK(lkb_counteradd(lb, 0, 5), 0);
+		GE_OK(lkb_counteradd(lb, 1, -3), 0);
+		GE_OK(lkb_counteradd(lb, 0, 0x100000000LL), 0);
+		GE_OK(lkb_counterread(lb, 0, 2, values), 0);
+		EQ_OK(values[0], 0x100000005LL);
+		EQ_OK(values[1], -3);
+		LE_OK(lkb_counteradd(lb, 2, 1), -1);
+		EQ_OK(errno, EINVAL);
+		LE_OK(lkb_counterread(lb, 1, 2, values), -1);
+		EQ_OK(errno, EINVAL);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_createtyped(0, "semaphore-test", LKB_TYPE_SEMAPHORE, 1, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		GE_OK(lkb_semwait(lb, 0), 0);
+		LE_OK(lkb_semwait(lb, 0), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		LE_OK(lkb_semwait(lb, 10), -1);
+		EQ_OK(errno, ETIMEDOUT);
+		GE_OK(lkb_sempost(lb, 1), 0);
+		GE_OK(lkb_semwait(lb, LKB_WAIT_FOREVER), 0);
+		NE_OK(lb2 = lkb_open(0, "semaphore-test"), LOCKBOX_ERROR);
+		LE_OK(lkb_semwait(lb2, 0), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		/* Only units that were taken can be posted */
+		LE_OK(lkb_sempost(lb2, 1), -1);
+		EQ_OK(errno, EINVAL);
+		LE_OK(lkb_sempost(lb, 2), -1);
+		EQ_OK(errno, EINVAL);
+		LE_OK(lkb_semwait(lb2, 0), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		/* Closing the handle gives its unit back */
+		GE_OK(lkb_close(lb), 0);
+		GE_OK(lkb_semwait(lb2, 0), 0);
+		GE_OK(lkb_close(lb2), 0);
+	}
+
+	NE_OK(lb = lkb_create(0, "waitstate-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		uint32_t users;
+		uint64_t old64;
+
+		GE_OK(lkb_setstate(lb, 5), 0);
+		GE_OK(lkb_waitstate(lb, 3, 1, LKB_SELECT_DISABLE_USERS_LT, LKB_SELECT_DISABLE_USERS_GT, 0, &state, &users), 0);
+		EQ_OK(state, 5);
+		EQ_OK(users, 1);
+		LE_OK(lkb_waitstate(lb, 2, 2, LKB_SELECT_DISABLE_USERS_LT, LKB_SELECT_DISABLE_USERS_GT, 0, &state, &users), -1);
+		EQ_OK(errno, EWOULDBLOCK);
+		LE_OK(lkb_waitstate(lb, 2, 2, LKB_SELECT_DISABLE_USERS_LT, LKB_SELECT_DISABLE_USERS_GT, 10, &state, &users), -1);
+		EQ_OK(errno, ETIMEDOUT);
+		GE_OK(lkb_waitstate(lb, 2, 2, LKB_SELECT_DISABLE_USERS_LT, 0, 10, &state, &users), 0);
+		EQ_OK(users, 1);
+		LE_OK(lkb_waitstate(lb, 0, 0, LKB_SELECT_DISABLE_USERS_LT, LKB_SELECT_DISABLE_USERS_GT, 0, &state, &users), -1);
+		EQ_OK(errno, EINVAL);
+
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_DATA_CHANGED, 1), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 0);
+		GE_OK(lkb_setdata(lb, "abc", 3, 0), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 1);
+		EQ_OK(lb2, lb);
+		EQ_OK(lkb_getdata(lb, buffer, 3, 0), 3);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 0);
+		GE_OK(lkb_setdata(lb, "d", 1, 3), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 1);
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_DATA_CHANGED, 1), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 0);
+		GE_OK(lkb_resetallselects(), 0);
+
+		old64 = 5;
+		GE_OK(lkb_setdata(lb, &old64, 8, 8), 0);
+		GE_OK(lkb_setselectdata(lb, 8, 8, LKB_CMP_GE, 10), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 0);
+		old64 = 10;
+		GE_OK(lkb_setdata(lb, &old64, 8, 8), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 1);
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_USERS_LESS_THAN, 1), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 1);
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_ALL, 1), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 0);
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_USERS_LESS_THAN, 2), 0);
+		EQ_OK(lkb_getselectableboxes(1, &lb2), 1);
+		LE_OK(lkb_setselectdata(lb, 4, 8, LKB_CMP_GE, 0), -1);
+		EQ_OK(errno, EINVAL);
+		GE_OK(lkb_resetallselects(), 0);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	GE_OK(lkb_watchshelf(1, LKB_EVENT_CREATED | LKB_EVENT_DESTROYED), 0);
+	NE_OK(lb = lkb_create(1, "watch-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		char	events[2 * LKB_EVENT_SIZE(11)];
+		lockbox_event *e = (lockbox_event *) events;
+
+		GE_OK(lkb_close(lb), 0);
+		EQ_OK(read(fdVault, events, sizeof(events)), sizeof(events));
+		EQ_OK(e->le_type, LKB_EVENT_CREATED);
+		EQ_OK(e->le_shelf, 1);
+		EQ_OK(e->le_namesize, 11);
+		S_OK((char *) (e + 1), "watch-test");
+		e = (lockbox_event *) (events + LKB_EVENT_SIZE(11));
+		EQ_OK(e->le_type, LKB_EVENT_DESTROYED);
+		S_OK((char *) (e + 1), "watch-test");
+		GE_OK(lkb_watchshelf(1, 0), 0);
+	}
+
+	NE_OK(lb = lkb_create(1, "boxwatch-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		lockbox_event events[2];
+
+		GE_OK(lkb_watchbox(lb, LKB_EVENT_STATE_SET | LKB_EVENT_DATA), 0);
+		GE_OK(lkb_setstate(lb, 1), 0);
+		GE_OK(lkb_setstate(lb, 0), 0);
+		GE_OK(lkb_setdata(lb, "x", 1, 0), 0);
+		EQ_OK(read(fdVault, events, sizeof(events)), sizeof(events));
+		EQ_OK(events[0].le_type, LKB_EVENT_STATE_SET);
+		EQ_OK(events[0].le_id, lb);
+		EQ_OK(events[0].le_value, 1);
+		EQ_OK(events[1].le_type, LKB_EVENT_DATA);
+		GE_OK(events[1].le_time, events[0].le_time);
+		LE_OK(lkb_watchbox(lb, LKB_EVENT_CREATED), -1);
+		EQ_OK(errno, EINVAL);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_create(1, "command-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		char	commands[2 * sizeof(lockbox_command) + LKB_COMMAND_SIZE(3)];
+		lockbox_command *c = (lockbox_command *) commands;
+		lockbox_event events[2];
+
+		memset(commands, 0, sizeof(commands));
+		c->lc_op = LKB_CMD_SETSTATE;
+		c->lc_id = lb;
+		c->lc_value = 7;
+		c = (lockbox_command *) (commands + sizeof(lockbox_command));
+		c->lc_op = LKB_CMD_SETDATA;
+		c->lc_id = lb;
+		c->lc_flags = LKB_CMD_REPORT;
+		c->lc_tag = 5;
+		c->lc_size = 3;
+		memcpy(c + 1, "abc", 3);
+		c = (lockbox_command *) ((char *) c + LKB_COMMAND_SIZE(3));
+		c->lc_op = 99;
+		c->lc_id = lb;
+		c->lc_tag = 6;
+		EQ_OK(write(fdVault, commands, sizeof(commands)), sizeof(commands));
+		EQ_OK(read(fdVault, events, sizeof(events)), sizeof(events));
+		EQ_OK(events[0].le_type, LKB_EVENT_COMPLETED);
+		EQ_OK(LKB_COMPLETION_TAG(events), 5);
+		EQ_OK(LKB_COMPLETION_STATUS(events), 0);
+		EQ_OK(LKB_COMPLETION_TAG(events + 1), 6);
+		EQ_OK(LKB_COMPLETION_STATUS(events + 1), -EINVAL);
+		GE_OK(lkb_getstate(lb, &state), 0);
+		EQ_OK(state, 7);
+		EQ_OK(lkb_getdata(lb, buffer, 3, 0), 3);
+		EQ_OK(memcmp(buffer, "abc", 3), 0);
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_create(1, "eventfd-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		int	efd;
+		uint64_t count;
+
+		GE_OK(efd = eventfd(0, 0), 0);
+		GE_OK(lkb_setselectcriterion(lb, LKB_SELECT_FLAGS, 2), 0);
+		if (lkb_bindeventfd(lb, efd) < 0)
+		{
+			/* Kernels before 2.6.31 cannot bind eventfds */
+			EQ_OK(errno, ENOSYS);
+		}
+		else
+		{
+			GE_OK(lkb_setstate(lb, 1), 0);
+			GE_OK(lkb_setstate(lb, 3), 0);
+			EQ_OK(read(efd, &count, sizeof(count)), sizeof(count));
+			EQ_OK(count, 1);
+			GE_OK(lkb_bindeventfd(lb, -1), 0);
+			LE_OK(lkb_bindeventfd(lb, fdVault), -1);
+			EQ_OK(errno, EINVAL);
+		}
+		GE_OK(lkb_close(lb), 0);
+		close(efd);
+	}
+
+	NE_OK(lb = lkb_create(1, "coalesce-test", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR)
+	{
+		lockbox_event events[2];
+
+		GE_OK(lkb_watchbox(lb, LKB_EVENT_STATE_CHANGES), 0);
+		LE_OK(lkb_setcoalesce(lb, 0xffffffff), -1);
+		EQ_OK(errno, EINVAL);
+		GE_OK(lkb_setcoalesce(lb, 50), 0);
+		GE_OK(lkb_setstate(lb, 1), 0);
+		GE_OK(lkb_setstate(lb, 3), 0);
+		GE_OK(lkb_setstate(lb, 2), 0);
+		EQ_OK(read(fdVault, events, sizeof(events)), sizeof(lockbox_event));
+		EQ_OK(events[0].le_type, LKB_EVENT_STATE_CHANGES);
+		EQ_OK(events[0].le_value, (3ULL << 32) | 2);
+		GE_OK(lkb_setcoalesce(lb, 0), 0);
+		GE_OK(lkb_setstate(lb, 0), 0);
+		EQ_OK(read(fdVault, events, sizeof(events)), sizeof(lockbox_event));
+		EQ_OK(events[0].le_value, (2ULL << 32) | 0);
+		GE_OK(lkb_watchbox(lb, 0), 0);
+		GE_OK(lkb_setstate(lb, 1), 0);
+		GE_OK(lkb_setstate(lb, 1), 0);
+		{
+			uint32_t setcounts[LKB_STATE_BITS];
+			uint64_t sequence;
+
+			GE_OK(lkb_getstatecounts(lb, &state, setcounts, &sequence), 0);
+			EQ_OK(state, 1);
+			EQ_OK(setcounts[0], 2);
+			EQ_OK(setcounts[1], 1);
+			EQ_OK(setcounts[2], 0);
+			EQ_OK(sequence, 5);
+		}
+		GE_OK(lkb_close(lb), 0);
+	}
+
+	NE_OK(lb = lkb_create(2, "shelf-a", 0, 0, 0), LOCKBOX_ERROR);
+	NE_OK(lb2 = lkb_create(2, "shelf-b", 0, 0, 0), LOCKBOX_ERROR);
+	if (lb != LOCKBOX_ERROR && lb2 != LOCKBOX_ERROR)
+	{
+		lockbox_shelf_result r;
+		int	lb3;
+
+		GE_OK(lkb_setstate(lb, 1), 0);
+		GE_OK(lkb_shelforstate(2, 4, &r), 0);
+		EQ_OK(r.lsr_boxes, 2);
+		EQ_OK(r.lsr_busy, 0);
+		EQ_OK(r.lsr_oldbits, 1);
+		GE_OK(lkb_getstate(lb, &state), 0);
+		EQ_OK(state, 5);
+		GE_OK(lkb_getstate(lb2, &state), 0);
+		EQ_OK(state, 4);
+		GE_OK(lkb_lock(lb2, LKB_LOCK_STATE), 0);
+		GE_OK(lkb_shelfandnotstate(2, 4, &r), 0);
+		EQ_OK(r.lsr_boxes, 1);
+		EQ_OK(r.lsr_busy, 1);
+		GE_OK(lkb_getstate(lb, &state), 0);
+		EQ_OK(state, 1);
+		GE_OK(lkb_unlock(lb2), 0);
+
+		acl->la_header.lah_n_entries = 2;
+		acl->la_entries[0].lae_idtype = LKB_IDTYPE_USER;
+		acl->la_entries[0].lae_id = geteuid();
+		acl->la_entries[0].lae_access = LKB_ACCESS_ALL & ~LKB_ACCESS_SETSTATE;
+		acl->la_entries[1].lae_idtype = LKB_IDTYPE_PROCESS;
+		acl->la_entries[1].lae_id = getpid();
+		acl->la_entries[1].lae_access = LKB_ACCESS_GETSTATE;
+		NE_OK(lb3 = lkb_create(2, "shelf-c", 0, 0, acl), LOCKBOX_ERROR);
+		GE_OK(lkb_shelforstate(2, 2, &r), 0);
+		EQ_OK(r.lsr_boxes, 2);
+		EQ_OK(r.lsr_denied, 1);
+		EQ_OK(r.lsr_busy, 0);
+		GE_OK(lkb_getstate(lb3, &state), 0);
+		EQ_OK(state, 0);
+
+		acl->la_entries[0].lae_access = LKB_ACCESS_ALL & ~LKB_ACCESS_GETSTATE;
+		acl->la_entries[1].lae_access = LKB_ACCESS_SETACL;
+		GE_OK(lkb_setacl(lb3, acl), 0);
+		GE_OK(lkb_setstate(lb3, 8), 0);
+		GE_OK(lkb_shelforstate(2, 2, &r), 0);
+		EQ_OK(r.lsr_boxes, 3);
+		EQ_OK(r.lsr_denied, 0);
+		EQ_OK(r.lsr_oldbits, 7);
+
+		EQ_OK(lkb_closeshelf(2), 3);
+		LE_OK(lkb_getstate(lb, &state), -1);
+		EQ_OK(errno, ENOENT);
+		LE_OK(lkb_getstate(lb3, &state), -1);
+		EQ_OK(errno, ENOENT);
+	}
+
 	NE_OK(lb = lkb_create(0, "test", 0, 0, 0), LOCKBOX_ERROR);
 	if (lb != LOCKBOX_ERROR)
 	{